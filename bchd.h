@@ -0,0 +1,320 @@
+/*
+ * bchd.h -- definitions shared by the bchd source files
+ *
+ * Inspired by the "scull" driver as described in
+ * "Linux Device Drivers Third Edition" by Corbet et al.
+ */
+
+#ifndef _BCHD_H_
+#define _BCHD_H_
+
+#include <linux/types.h>        /* For dev_t */
+#include <linux/cdev.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+
+#include "bchd_stats.h"
+#include "bchd_storage.h"
+
+#ifndef BCHD_MAJOR
+#define BCHD_MAJOR 0            /* default: 0 -- that is, dynamic major */
+#endif
+
+#ifndef BCHD_QUANTUM
+#define BCHD_QUANTUM 4000       /* default: 4000 */
+#endif
+
+#ifndef BCHD_QSET
+#define BCHD_QSET 1000          /* default: 1000 */
+#endif
+
+#ifndef BCHD_NR_DEVS
+#define BCHD_NR_DEVS 1          /* default: 1 -- that is, /dev/bchd0 */
+#endif
+
+#ifndef BCHD_MAX_WORD_LEN
+#define BCHD_MAX_WORD_LEN 20    /* default: 20 */
+#endif
+
+/* The backing file of a device, see bchd_backing.c */
+struct bchd_backing {
+    struct file *file;          /* NULL without bchd_backing */
+    struct delayed_work ws;     /* Writeback */
+    struct mutex lock;          /* Serializes writeback passes */
+    bool truncate;              /* Trimmed since the last pass (protected by the device lock) */
+    u64 write_seq;              /* Writes and trims so far (protected by the device lock) */
+    u64 synced_seq;             /* Writes the last fsync covered (protected by lock) */
+    char *buf;                  /* Runs of dirty quanta are copied here ... */
+    int batch;                  /* ... up to this many */
+
+    /* The write-ahead journal, see bchd_journal.c (all protected by lock) */
+    struct file *journal;       /* NULL without bchd_journal */
+    loff_t journal_pos;         /* End of the journal */
+    u64 tx;                     /* Number of the current transaction */
+    loff_t tx_start;            /* Where it starts in the journal */
+    bool tx_open;               /* Not committed yet */
+    unsigned long committed_size;   /* Size of the device in the last commit */
+};
+
+/*
+ * How far bchd_init got with a device; bchd_cleanup only undoes the steps it
+ * finished. A step that fails undoes what it did itself.
+ */
+enum bchd_init_step {
+    BCHD_INIT_NONE,             /* Nothing to undo */
+    BCHD_INIT_STATS,            /* Stats, store, lock, works and notifier list */
+    BCHD_INIT_GEN,
+    BCHD_INIT_TIER,
+    BCHD_INIT_SHMEM,
+    BCHD_INIT_BACKING,
+    BCHD_INIT_SNAPSHOT,
+    BCHD_INIT_STATUS,
+    BCHD_INIT_CDEV,             /* Live: the char device is added */
+};
+
+/* Tiers of cold quanta, see bchd_tier.c (protected by the device lock) */
+struct bchd_tier {
+    struct crypto_comp *tfm;    /* NULL without bchd_compress, see bchd_compress.c */
+    void *buf;                  /* A quantum compresses or decompresses into this */
+    struct file *swap;          /* NULL without bchd_tier_swap */
+    struct delayed_work ws;     /* The tiering passes */
+};
+
+/* A range of quanta that changed, see bchd_gen.c */
+struct bchd_change {
+    u64 gen;                    /* The last generation that changed it */
+    loff_t start, end;          /* At quantum boundaries */
+};
+
+/* The changes of the contents since some generation, see bchd_gen.c */
+struct bchd_changes {
+    struct bchd_change *log;    /* A ring of bchd_delta_log changes (NULL if 0) ... */
+    unsigned int head, nr;      /* ... the oldest one and how many there are */
+    u64 since;                  /* It has all changes after this generation */
+};
+
+struct bchd_dev {
+    struct bchd_store store;    /* The data stored in the device */
+    struct file *shmem;         /* ... or in this shmem file, see bchd_shmem.c */
+    struct bchd_backing backing;
+    bool snapshot;              /* Save the contents on unload, see bchd_snapshot.c */
+    struct bchd_tier tier;
+
+    int max_word_len;           /* Max word length we write into the kernel log */
+    struct delayed_work ws_logger;
+    int log_pos;                /* Index used for logging data into the kernel log */
+    u64 gen;                    /* Bumped by every change of the contents, see bchd_gen.c */
+    struct bchd_changes changes;
+    struct bchd_status *status; /* The page mapped at BCHD_STATUS_OFF, see bchd_status.c */
+    struct list_head notifiers; /* The eventfds to signal on changes, see bchd_notify.c */
+
+    struct bchd_stats __percpu *stats;
+    struct dentry *debugfs;     /* Directory of this device in debugfs */
+
+    struct mutex lock;          /* Mutual exclusion semaphore */
+    enum bchd_lock_site lock_site;  /* Who holds the lock ... */
+    u64 lock_start;             /* ... and since when (both protected by lock) */
+    struct cdev cdev;           /* Char device structure */
+    bool replacing;             /* A write-only open replaces the contents, see bchd_replace.c */
+    enum bchd_init_step init_step;  /* The last step of bchd_init it finished */
+};
+
+/*
+ * Take the device lock and account the time spent waiting for it to site.
+ * If interruptible, returns nonzero if we were interrupted, like mutex_lock_interruptible.
+ */
+static inline int __bchd_lock(struct bchd_dev *dev, enum bchd_lock_site site, bool interruptible)
+{
+    struct bchd_lock_stats *ls;
+    u64 start = ktime_get_ns();
+    u64 now, wait;
+
+    if (!mutex_trylock(&dev->lock)) {
+        this_cpu_inc(dev->stats->lock[site].contended);
+        if (!interruptible) {
+            mutex_lock(&dev->lock);
+        } else if (mutex_lock_interruptible(&dev->lock)) {
+            return -ERESTARTSYS;
+        }
+    }
+    now = ktime_get_ns();
+    wait = now - start;
+    dev->lock_site = site;
+    dev->lock_start = now;
+
+    this_cpu_inc(dev->stats->lat[BCHD_LAT_LOCK_WAIT][bchd_lat_bucket(wait)]);
+    this_cpu_inc(dev->stats->lock[site].acquired);
+    this_cpu_add(dev->stats->lock[site].wait_ns, wait);
+    this_cpu_inc(dev->stats->lock[site].wait[bchd_lat_bucket(wait)]);
+    /* Racing with an update on the same CPU only loses a maximum, that is fine */
+    ls = raw_cpu_ptr(&dev->stats->lock[site]);
+    if (ls->wait_max_ns < wait) {
+        ls->wait_max_ns = wait;
+    }
+    return 0;
+}
+
+static inline int bchd_lock(struct bchd_dev *dev, enum bchd_lock_site site)
+{
+    return __bchd_lock(dev, site, true);
+}
+
+/* Release the device lock and account the time it was held */
+static inline void bchd_unlock(struct bchd_dev *dev)
+{
+    enum bchd_lock_site site = dev->lock_site;
+    u64 hold = ktime_get_ns() - dev->lock_start;
+    struct bchd_lock_stats *ls;
+
+    mutex_unlock(&dev->lock);
+
+    this_cpu_add(dev->stats->lock[site].hold_ns, hold);
+    this_cpu_inc(dev->stats->lock[site].hold[bchd_lat_bucket(hold)]);
+    ls = raw_cpu_ptr(&dev->stats->lock[site]);
+    if (ls->hold_max_ns < hold) {
+        ls->hold_max_ns = hold;
+    }
+}
+
+/* Configurable parameters, see bchd_main.c */
+extern int bchd_major;
+extern int bchd_minor;
+extern int bchd_nr_devs;
+extern int bchd_quantum_size;
+extern int bchd_qset_size;
+extern int bchd_max_word_len;
+
+extern struct bchd_dev *bchd_devices;
+
+extern struct workqueue_struct *bchd_wq;
+
+/* bchd_main.c */
+void bchd_trim(struct bchd_dev *dev);
+long bchd_dev_ioctl(struct bchd_dev *dev, struct file *filp, unsigned int cmd, unsigned long arg);
+
+/* bchd_backing.c */
+extern char *bchd_backing;
+extern int bchd_writeback_ms;
+int bchd_backing_init(struct bchd_dev *dev, int index);
+void bchd_backing_exit(struct bchd_dev *dev);
+void bchd_backing_dirty(struct bchd_dev *dev);
+int bchd_backing_fsync(struct bchd_dev *dev, int datasync);
+void bchd_backing_trim(struct bchd_dev *dev);
+
+/* bchd_journal.c */
+extern bool bchd_journal;
+extern int bchd_checkpoint_mb;
+int bchd_journal_init(struct bchd_dev *dev, const char *path);
+void bchd_journal_exit(struct bchd_dev *dev);
+void bchd_journal_begin(struct bchd_dev *dev);
+int bchd_journal_data(struct bchd_dev *dev, loff_t off, const void *data, size_t len);
+int bchd_journal_truncate(struct bchd_dev *dev);
+int bchd_journal_commit(struct bchd_dev *dev, unsigned long size);
+int bchd_journal_checkpoint(struct bchd_dev *dev);
+
+/* bchd_snapshot.c */
+extern char *bchd_snapshot;
+int bchd_snapshot_restore(struct bchd_dev *dev, int index);
+void bchd_snapshot_save(struct bchd_dev *dev, int index);
+
+/* bchd_tier.c */
+extern int bchd_tier_ms;
+extern bool bchd_tier_swap;
+int bchd_tier_init(struct bchd_dev *dev, int index);
+void bchd_tier_trim(struct bchd_dev *dev);
+void bchd_tier_stop(struct bchd_dev *dev);
+void bchd_tier_exit(struct bchd_dev *dev);
+int bchd_tier_read(struct bchd_dev *dev, loff_t off, void *buf);
+unsigned long bchd_tier_swap_resident(struct bchd_dev *dev);
+
+/* bchd_compress.c */
+extern char *bchd_compress;
+int bchd_compress_init(struct bchd_dev *dev, int index);
+bool bchd_compress_quantum(struct bchd_dev *dev, struct bchd_qset *qs, int j);
+void bchd_compress_exit(struct bchd_dev *dev);
+
+/* bchd_dedup.c */
+extern bool bchd_dedup;
+u64 bchd_dedup_hash(const void *quantum, int quantum_size);
+bool bchd_dedup_quantum(struct bchd_dev *dev, struct bchd_qset *qs, int j);
+bool bchd_dedup_alone(const void *quantum);
+void bchd_dedup_init(struct bchd_dev *dev);
+void bchd_dedup_counts(unsigned long *entries, unsigned long *refs);
+
+/* bchd_shmem.c */
+struct vm_area_struct;
+struct pipe_inode_info;
+extern bool bchd_shmem;
+int bchd_shmem_init(struct bchd_dev *dev, int index);
+void bchd_shmem_exit(struct bchd_dev *dev);
+ssize_t bchd_shmem_read(struct bchd_dev *dev, char __user *buf, size_t count, loff_t *f_pos);
+ssize_t bchd_shmem_write(struct bchd_dev *dev, const char __user *buf, size_t count,
+                         loff_t *f_pos);
+void bchd_shmem_trim(struct bchd_dev *dev);
+int bchd_shmem_next_word(struct bchd_dev *dev, int *pos, char *word, int len);
+int bchd_shmem_mmap(struct bchd_dev *dev, struct vm_area_struct *vma);
+ssize_t bchd_shmem_splice_read(struct bchd_dev *dev, loff_t *ppos, struct pipe_inode_info *pipe,
+                               size_t len, unsigned int flags);
+unsigned long bchd_shmem_resident(struct bchd_dev *dev);
+
+/* bchd_snap.c */
+int bchd_snap_create(struct bchd_dev *dev);
+
+/* bchd_gen.c */
+struct bchd_cread;
+struct bchd_delta;
+extern int bchd_delta_log;
+int bchd_gen_init(struct bchd_dev *dev);
+void bchd_gen_exit(struct bchd_dev *dev);
+void bchd_gen_bump(struct bchd_dev *dev);
+void bchd_gen_write(struct bchd_dev *dev, loff_t off, size_t len);
+long bchd_gen_get(struct bchd_dev *dev, u64 __user *argp);
+long bchd_gen_cread(struct bchd_dev *dev, struct bchd_cread __user *argp);
+long bchd_gen_delta(struct bchd_dev *dev, struct bchd_delta __user *argp);
+
+/* bchd_status.c */
+struct vm_area_struct;
+int bchd_status_init(struct bchd_dev *dev);
+void bchd_status_exit(struct bchd_dev *dev);
+void bchd_status_publish(struct bchd_dev *dev, bool write);
+int bchd_status_mmap(struct bchd_dev *dev, struct vm_area_struct *vma);
+
+/* bchd_notify.c */
+struct bchd_notify;
+void bchd_notify_init(struct bchd_dev *dev);
+void bchd_notify(struct bchd_dev *dev);
+long bchd_notify_ioctl(struct bchd_dev *dev, struct file *filp, struct bchd_notify __user *argp);
+void bchd_notify_release(struct bchd_dev *dev, struct file *filp);
+
+/* bchd_replace.c */
+extern bool bchd_replace;
+int bchd_replace_open(struct bchd_dev *dev, struct file *filp);
+
+/* bchd_selfbench.c */
+enum bchd_selfbench_item {
+    BCHD_SB_ALLOC,
+    BCHD_SB_COPY,
+    BCHD_SB_HASH,
+    BCHD_SB_LOOKUP,
+    BCHD_SB_WORDS,
+    BCHD_SB_TRIM,
+    BCHD_SB_NR,
+};
+
+struct bchd_selfbench_result {
+    const char *name;
+    u64 ops;                    /* 0 if it did not run */
+    u64 ns;
+};
+
+extern bool bchd_bench;
+extern struct bchd_selfbench_result bchd_selfbench_results[BCHD_SB_NR];
+int bchd_selfbench(void);
+
+/* bchd_stats.c */
+u64 bchd_stat_sum(struct bchd_dev *dev, enum bchd_stat_item item);
+void bchd_debugfs_init(void);
+void bchd_debugfs_exit(void);
+void bchd_debugfs_add_dev(struct bchd_dev *dev, int index);
+
+#endif /* _BCHD_H_ */
@@ -0,0 +1,394 @@
+/*
+ * bchd_backing.c -- persistent backing files for the bchd devices
+ *
+ * With bchd_backing=/path/prefix, device N keeps its contents in the file
+ * /path/prefixN, an image of the device: byte k of the device is byte k
+ * of the file, and the size of the file is the size of the device.
+ *  -- On load the image is not read in; a quantum is read from the file
+ *     (see bchd_store_quantum) the first time it is needed.
+ *  -- Writes only mark their quanta dirty. A writeback work copies runs of
+ *     adjacent dirty quanta into a buffer under the device lock and writes
+ *     each run with one kernel_write after dropping it, so writes wait for
+ *     the device lock at most as long as the copying takes.
+ *     It runs bchd_writeback_ms after the first write that found it idle.
+ *  -- Trimming the device (opening it O_WRONLY) truncates the file;
+ *     the truncation is left to the writeback work too.
+ *  -- fsync writes back and syncs the file. Concurrent fsyncs share a pass:
+ *     every write (and trim) takes a sequence number, and an fsync that
+ *     finds its writes covered by a pass that started after them is done.
+ *  -- On unload everything is written back and synced.
+ *  -- With bchd_journal=1, a pass goes to a write-ahead journal first,
+ *     so a crash never leaves the image torn (see bchd_journal.c).
+ * Holes of the device read as zeros after a reload, as they do in the file.
+ */
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/fs.h>
+#include <linux/jiffies.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+
+#include "bchd.h"
+
+#define BCHD_WRITEBACK_BATCH (1 << 20)  /* most bytes per kernel_write */
+
+/* Where a writeback pass is in the list (valid until the device is trimmed) */
+struct bchd_wb_cursor {
+    struct bchd_qset *qs;
+    int item;
+    int qset_pos;
+    bool started;
+};
+
+/* Read the quantum at off from the backing file; called with the device lock held */
+static int bchd_backing_fill(struct bchd_store *store, loff_t off, void *quantum)
+{
+    struct bchd_dev *dev = container_of(store, struct bchd_dev, store);
+    ssize_t ret;
+
+    ret = kernel_read(dev->backing.file, quantum, store->quantum_size, &off);
+    if (ret < 0) {
+        printk_ratelimited(KERN_WARNING "bchd%d: reading the backing file failed: %zd\n",
+                           MINOR(dev->cdev.dev) - bchd_minor, ret);
+        return ret;
+    }
+    /* The end of the file ends in the middle of the quantum */
+    memset((char *) quantum + ret, 0, store->quantum_size - ret);
+    bchd_stat_inc(dev->stats, BCHD_STAT_FILLS);
+    return 0;
+}
+
+/*
+ * Copy the next run of adjacent dirty quanta (at most b->batch) into b->buf
+ * and clear their dirty bits. Called with the device lock held.
+ * Returns the number of bytes to write at *off, 0 if nothing is dirty anymore.
+ */
+static size_t bchd_backing_collect(struct bchd_dev *dev, struct bchd_wb_cursor *c, loff_t *off)
+{
+    struct bchd_store *store = &dev->store;
+    int quantum_size = store->quantum_size;
+    int qset_size = store->qset_size;
+    size_t len = 0;
+    int n = 0;
+
+    if (!c->started) {
+        c->qs = store->data;
+        c->item = 0;
+        c->qset_pos = 0;
+        c->started = true;
+    }
+    for (; c->qs != NULL; c->qs = c->qs->next, c->item++, c->qset_pos = 0) {
+        for (; c->qset_pos < qset_size; c->qset_pos++) {
+            int j = c->qset_pos;
+
+            if (c->qs->data == NULL || c->qs->data[j] == NULL || !test_bit(j, c->qs->dirty)) {
+                if (n > 0) {
+                    goto out;   /* the run ends here */
+                }
+                continue;
+            }
+            if (n == 0) {
+                *off = ((loff_t) c->item * qset_size + j) * quantum_size;
+            }
+            memcpy(dev->backing.buf + n * quantum_size, c->qs->data[j], quantum_size);
+            __clear_bit(j, c->qs->dirty);
+            if (++n == dev->backing.batch) {
+                c->qset_pos++;
+                goto out;
+            }
+        }
+    }
+out:
+    /* Do not write the part of the last quantum behind the end of the device */
+    if (n > 0) {
+        len = min_t(u64, (u64) n * quantum_size, store->size - *off);
+    }
+    return len;
+}
+
+/* Mark the quanta of a run dirty again, since writing them failed */
+static void bchd_backing_redirty(struct bchd_dev *dev, loff_t off, size_t len)
+{
+    struct bchd_store *store = &dev->store;
+    struct bchd_pos pos;
+    loff_t end = off + len;
+
+    if (bchd_lock(dev, BCHD_LOCK_WRITEBACK)) {
+        return;
+    }
+    /* After a trim, the data is gone anyway */
+    if (!dev->backing.truncate) {
+        for (; off < end; off += store->quantum_size) {
+            bchd_store_locate(store, off, &pos);
+            bchd_store_quantum(store, &pos, BCHD_QUANTUM_DIRTY);
+        }
+    }
+    bchd_unlock(dev);
+}
+
+/*
+ * Write back all dirty quanta and bring the file to the size of the device.
+ * Passes are serialized by backing.lock (which the caller holds), so a truncation
+ * never overtakes data of an earlier pass. *seq is set to the write sequence
+ * number the pass covers. Returns 0 or the error that stopped the pass.
+ */
+static int bchd_backing_flush(struct bchd_dev *dev, u64 *seq)
+{
+    struct bchd_backing *b = &dev->backing;
+    struct bchd_wb_cursor c = { .started = false };
+    unsigned long size = b->committed_size;     /* until something is collected */
+    u64 start = ktime_get_ns();
+    loff_t off = 0, pos;
+    size_t len;
+    ssize_t ret = 0;
+    int err;
+    bool first = true;
+
+    if (b->journal != NULL) {
+        bchd_journal_begin(dev);
+    }
+    for (;;) {
+        if (bchd_lock(dev, BCHD_LOCK_WRITEBACK)) {
+            ret = -ERESTARTSYS;
+            break;
+        }
+        /* Everything written before this point is dirty now and will be found */
+        if (first) {
+            *seq = b->write_seq;
+            first = false;
+        }
+        if (b->truncate) {
+            /* Trimmed: the cursor is stale and the file has to go first */
+            b->truncate = false;
+            c.started = false;
+            bchd_unlock(dev);
+            if (b->journal != NULL) {
+                ret = bchd_journal_truncate(dev);
+            } else {
+                ret = vfs_truncate(&b->file->f_path, 0);
+            }
+            if (ret < 0) {
+                bchd_stat_inc(dev->stats, BCHD_STAT_WRITEBACK_ERRORS);
+                /* Try again next time */
+                if (bchd_lock(dev, BCHD_LOCK_WRITEBACK) == 0) {
+                    b->truncate = true;
+                    bchd_unlock(dev);
+                }
+                break;
+            }
+            continue;
+        }
+        len = bchd_backing_collect(dev, &c, &off);
+        size = dev->store.size;
+        bchd_unlock(dev);
+        if (len == 0) {
+            break;
+        }
+
+        if (b->journal != NULL) {
+            ret = bchd_journal_data(dev, off, b->buf, len);
+            ret = ret < 0 ? ret : len;
+        } else {
+            pos = off;
+            ret = kernel_write(b->file, b->buf, len, &pos);
+        }
+        if (ret != (ssize_t) len) {
+            printk_ratelimited(KERN_WARNING "bchd%d: writing the backing file failed: %zd\n",
+                               MINOR(dev->cdev.dev) - bchd_minor, ret);
+            bchd_stat_inc(dev->stats, BCHD_STAT_WRITEBACK_ERRORS);
+            bchd_backing_redirty(dev, off, len);
+            ret = ret < 0 ? ret : -EIO;
+            break;
+        }
+        ret = 0;
+        bchd_stat_inc(dev->stats, BCHD_STAT_WRITEBACK_WRITES);
+        bchd_stat_add(dev->stats, BCHD_STAT_WRITEBACK_BYTES, len);
+    }
+
+    if (b->journal != NULL) {
+        /*
+         * Commit what made it into the journal, even if the pass stopped early:
+         * the rest is still dirty. The commit record carries the size.
+         */
+        err = bchd_journal_commit(dev, size);
+        if (err < 0) {
+            bchd_stat_inc(dev->stats, BCHD_STAT_WRITEBACK_ERRORS);
+            ret = ret < 0 ? ret : err;
+        }
+    } else if (ret == 0 && i_size_read(file_inode(b->file)) != size) {
+        /* Holes at the end of the device only exist as the size of the file */
+        ret = vfs_truncate(&b->file->f_path, size);
+        if (ret < 0) {
+            bchd_stat_inc(dev->stats, BCHD_STAT_WRITEBACK_ERRORS);
+        }
+    }
+    bchd_lat_record(dev->stats, BCHD_LAT_WRITEBACK, start);
+    return ret;
+}
+
+static void bchd_backing_work(struct work_struct *ws)
+{
+    struct bchd_dev *dev = container_of(ws, struct bchd_dev, backing.ws.work);
+    u64 seq;
+    int ret;
+
+    mutex_lock(&dev->backing.lock);
+    ret = bchd_backing_flush(dev, &seq);
+    mutex_unlock(&dev->backing.lock);
+
+    /* Keep the dirty data and try again later */
+    if (ret < 0) {
+        queue_delayed_work(bchd_wq, &dev->backing.ws, msecs_to_jiffies(bchd_writeback_ms));
+    }
+}
+
+/*
+ * Make everything written to the device before the call durable (group commit).
+ * While one caller flushes, the others wait for backing.lock; a waiter whose
+ * writes were dirty when that pass started finds them covered and returns at once.
+ */
+int bchd_backing_fsync(struct bchd_dev *dev, int datasync)
+{
+    struct bchd_backing *b = &dev->backing;
+    u64 start = ktime_get_ns();
+    u64 want, seq;
+    int ret;
+
+    if (b->file == NULL) {
+        return 0;       /* nothing to be durable on */
+    }
+    bchd_stat_inc(dev->stats, BCHD_STAT_FSYNCS);
+
+    if (bchd_lock(dev, BCHD_LOCK_FSYNC)) {
+        return -ERESTARTSYS;
+    }
+    want = b->write_seq;
+    bchd_unlock(dev);
+
+    if (mutex_lock_interruptible(&b->lock)) {
+        return -ERESTARTSYS;
+    }
+    if (b->synced_seq >= want) {
+        ret = 0;        /* somebody else's pass covered us */
+        goto out;
+    }
+    bchd_stat_inc(dev->stats, BCHD_STAT_FSYNC_FLUSHES);
+    ret = bchd_backing_flush(dev, &seq);
+    if (ret == 0 && b->journal == NULL) {
+        ret = vfs_fsync(b->file, datasync);     /* a commit syncs the journal */
+    }
+    if (ret == 0) {
+        b->synced_seq = seq;
+    }
+out:
+    mutex_unlock(&b->lock);
+    bchd_lat_record(dev->stats, BCHD_LAT_FSYNC, start);
+    return ret;
+}
+
+/* Schedule a writeback; called after the device was written to or trimmed, with the device lock held */
+void bchd_backing_dirty(struct bchd_dev *dev)
+{
+    if (dev->backing.file == NULL) {
+        return;
+    }
+    dev->backing.write_seq++;
+    /* Does nothing if a writeback is pending already, so writes are batched */
+    queue_delayed_work(bchd_wq, &dev->backing.ws, msecs_to_jiffies(bchd_writeback_ms));
+}
+
+/* The device was trimmed; called with the device lock held */
+void bchd_backing_trim(struct bchd_dev *dev)
+{
+    if (dev->backing.file == NULL) {
+        return;
+    }
+    dev->backing.truncate = true;
+    bchd_backing_dirty(dev);
+}
+
+/* Open the backing file of the device and make its contents the contents of the device */
+int bchd_backing_init(struct bchd_dev *dev, int index)
+{
+    struct bchd_backing *b = &dev->backing;
+    struct bchd_store *store = &dev->store;
+    struct file *file;
+    char *path;
+    int result = 0;
+
+    mutex_init(&b->lock);
+    INIT_DELAYED_WORK(&b->ws, bchd_backing_work);
+    if (bchd_backing == NULL || bchd_backing[0] == '\0' || dev->shmem != NULL) {
+        return 0;
+    }
+
+    path = kasprintf(GFP_KERNEL, "%s%d", bchd_backing, index);
+    if (path == NULL) {
+        return -ENOMEM;
+    }
+    file = filp_open(path, O_RDWR | O_CREAT | O_LARGEFILE, 0600);
+    if (IS_ERR(file)) {
+        printk(KERN_WARNING "bchd: can't open backing file %s: %ld\n", path, PTR_ERR(file));
+        result = PTR_ERR(file);
+        goto out;
+    }
+
+    b->batch = max(1, BCHD_WRITEBACK_BATCH / store->quantum_size);
+    b->buf = vmalloc((size_t) b->batch * store->quantum_size);
+    if (b->buf == NULL) {
+        filp_close(file, NULL);
+        result = -ENOMEM;
+        goto out;
+    }
+    b->file = file;
+    b->truncate = false;
+    b->write_seq = 0;
+    b->synced_seq = 0;
+
+    /* A journal left over from a crash is applied before the image is used */
+    if (bchd_journal) {
+        result = bchd_journal_init(dev, path);
+        if (result < 0) {
+            filp_close(file, NULL);
+            b->file = NULL;
+            vfree(b->buf);
+            b->buf = NULL;
+            goto out;
+        }
+    }
+
+    store->size = i_size_read(file_inode(file));
+    store->track_dirty = true;
+    store->fill_size = store->size;
+    store->fill = bchd_backing_fill;
+    b->committed_size = store->size;
+    printk(KERN_INFO "bchd%d: backed by %s%s, %lu bytes\n", index, path,
+           b->journal != NULL ? " with a journal" : "", store->size);
+out:
+    kfree(path);
+    return result;
+}
+
+/*
+ * Write everything back and close the file; nobody may write to the device anymore.
+ * The last pass runs in the workqueue, where no signal can interrupt it.
+ */
+void bchd_backing_exit(struct bchd_dev *dev)
+{
+    struct bchd_backing *b = &dev->backing;
+
+    if (b->file == NULL) {
+        return;
+    }
+    mod_delayed_work(bchd_wq, &b->ws, 0);
+    flush_delayed_work(&b->ws);
+    cancel_delayed_work_sync(&b->ws);   /* a retry after a failure */
+    bchd_journal_exit(dev);
+    vfs_fsync(b->file, 0);
+    filp_close(b->file, NULL);
+    b->file = NULL;
+    vfree(b->buf);
+    b->buf = NULL;
+}
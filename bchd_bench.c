@@ -0,0 +1,539 @@
+/*
+ * bchd_bench -- throughput and latency benchmark for /dev/bchd
+ *
+ * Measures sequential and random reads and writes for a set of request sizes,
+ * thread counts, open modes and I/O variants (read/write, pread/pwrite,
+ * preadv/pwritev, mmap, splice) and prints the results as JSON,
+ * one object per run, so the output can be stored and compared.
+ *
+ * Before the runs, the device is filled with the amount of data the runs transfer
+ * (opening it O_WRONLY, which trims the previous contents).
+ * All threads of a run together transfer that amount:
+ *  -- sequential runs split it into one slice per thread
+ *     (the rw variant has no lseek, so each thread reads/writes from offset 0),
+ *  -- random runs pick request-size aligned offsets in the whole area.
+ *
+ * Variants the device does not support (bchd has neither mmap nor splice_read)
+ * are reported with an "error" member instead of results.
+ *
+ * Usage: see bchd_bench -h
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#define BENCH_MAX_LIST 16
+#define BENCH_IOVECS 4          /* iovecs per request of the readv variant */
+
+enum bench_mode { SEQREAD, SEQWRITE, RANDREAD, RANDWRITE, NR_MODES };
+enum bench_variant { RW, PRW, READV, MMAP, SPLICE, NR_VARIANTS };
+
+static const char * const mode_names[NR_MODES] = {
+    "seqread", "seqwrite", "randread", "randwrite",
+};
+static const char * const variant_names[NR_VARIANTS] = {
+    "rw", "prw", "readv", "mmap", "splice",
+};
+
+struct bench_run {
+    enum bench_mode mode;
+    enum bench_variant variant;
+    int open_flags;
+    size_t size;                /* request size */
+    int threads;
+    size_t bytes;               /* total amount of data of the run */
+};
+
+struct bench_thread {
+    pthread_t tid;
+    const struct bench_run *run;
+    int index;
+    int fd;
+    char *buf;
+    uint64_t *lat;              /* latency of each request in ns */
+    size_t nr_lat;
+    size_t max_lat;
+    size_t done;                /* bytes transferred */
+    int err;                    /* errno of the first failure */
+};
+
+static const char *device = "/dev/bchd";
+static size_t total_bytes = 16 << 20;
+static int fsync_every;         /* fsync after this many writes of a thread, 0: never */
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static const char *open_name(int flags)
+{
+    switch (flags & O_ACCMODE) {
+    case O_RDONLY:
+        return "rdonly";
+    case O_WRONLY:
+        return "wronly";
+    default:
+        return "rdwr";
+    }
+}
+
+/* xorshift, good enough to pick offsets */
+static uint64_t next_rand(uint64_t *state)
+{
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+/*
+ * Transfer up to len bytes at off using the variant of the run.
+ * Returns the amount transferred (0 at the end of the device) or -errno.
+ */
+static ssize_t do_io(struct bench_thread *t, off_t off, size_t len, int pipefd[2], char *map)
+{
+    const struct bench_run *run = t->run;
+    int is_read = run->mode == SEQREAD || run->mode == RANDREAD;
+    struct iovec iov[BENCH_IOVECS];
+    ssize_t ret;
+    int i, nr_iov;
+
+    switch (run->variant) {
+    case RW:
+        if ((run->mode == RANDREAD || run->mode == RANDWRITE) && lseek(t->fd, off, SEEK_SET) < 0) {
+            ret = -1;
+            break;
+        }
+        ret = is_read ? read(t->fd, t->buf, len) : write(t->fd, t->buf, len);
+        break;
+    case PRW:
+        ret = is_read ? pread(t->fd, t->buf, len, off) : pwrite(t->fd, t->buf, len, off);
+        break;
+    case READV:
+        nr_iov = len < BENCH_IOVECS ? 1 : BENCH_IOVECS;
+        for (i = 0; i < nr_iov; i++) {
+            iov[i].iov_base = t->buf + i * (len / nr_iov);
+            iov[i].iov_len = i == nr_iov - 1 ? len - i * (len / nr_iov) : len / nr_iov;
+        }
+        ret = is_read ? preadv(t->fd, iov, nr_iov, off) : pwritev(t->fd, iov, nr_iov, off);
+        break;
+    case MMAP:
+        if (off >= (off_t) run->bytes) {
+            return 0;
+        }
+        if (len > run->bytes - off) {
+            len = run->bytes - off;
+        }
+        if (is_read) {
+            memcpy(t->buf, map + off, len);
+        } else {
+            memcpy(map + off, t->buf, len);
+        }
+        ret = len;
+        break;
+    case SPLICE:
+        if (is_read) {
+            loff_t loff = off;
+
+            ret = splice(t->fd, &loff, pipefd[1], NULL, len, 0);
+            if (ret > 0 && read(pipefd[0], t->buf, ret) != ret) {
+                ret = -1;
+            }
+        } else {
+            loff_t loff = off;
+
+            ssize_t n;
+
+            if (write(pipefd[1], t->buf, len) != (ssize_t) len) {
+                ret = -1;
+                break;
+            }
+            /* Empty the pipe again, a short splice leaves data behind */
+            for (ret = 0; ret < (ssize_t) len; ret += n) {
+                n = splice(pipefd[0], NULL, t->fd, &loff, len - ret, 0);
+                if (n <= 0) {
+                    ret = -1;
+                    break;
+                }
+            }
+        }
+        break;
+    default:
+        errno = EINVAL;
+        ret = -1;
+    }
+    return ret < 0 ? -errno : ret;
+}
+
+static void *bench_thread_fn(void *arg)
+{
+    struct bench_thread *t = arg;
+    const struct bench_run *run = t->run;
+    int is_seq = run->mode == SEQREAD || run->mode == SEQWRITE;
+    int is_write = run->mode == SEQWRITE || run->mode == RANDWRITE;
+    size_t nr_writes = 0;
+    size_t slice = run->bytes / run->threads;
+    uint64_t seed = 0x9e3779b97f4a7c15ULL * (t->index + 1);
+    size_t nr_blocks = run->bytes / run->size;
+    int pipefd[2] = { -1, -1 };
+    char *map = NULL;
+    off_t off = run->variant == RW ? 0 : (off_t) (t->index * slice);
+    size_t want;
+    ssize_t ret;
+    uint64_t start;
+
+    if (run->variant == SPLICE) {
+        /* The pipe has to hold a whole request, or writing into it blocks */
+        if (pipe(pipefd) < 0 ||
+            (run->size > 65536 && fcntl(pipefd[1], F_SETPIPE_SZ, run->size) < 0)) {
+            t->err = errno;
+            return NULL;
+        }
+    }
+    if (run->variant == MMAP) {
+        int prot = (run->mode == SEQREAD || run->mode == RANDREAD) ? PROT_READ : PROT_WRITE;
+
+        map = mmap(NULL, run->bytes, prot, MAP_SHARED, t->fd, 0);
+        if (map == MAP_FAILED) {
+            t->err = errno;
+            return NULL;
+        }
+    }
+
+    while (t->done < slice) {
+        if (is_seq) {
+            want = slice - t->done < run->size ? slice - t->done : run->size;
+        } else {
+            off = (off_t) (next_rand(&seed) % nr_blocks) * run->size;
+            want = run->size;
+        }
+        start = now_ns();
+        ret = do_io(t, off, want, pipefd, map);
+        /* The fsync counts towards the latency of the write that triggered it */
+        if (ret > 0 && is_write && fsync_every > 0 && ++nr_writes % fsync_every == 0
+            && fsync(t->fd) < 0) {
+            ret = -errno;
+        }
+        if (t->nr_lat < t->max_lat) {
+            t->lat[t->nr_lat++] = now_ns() - start;
+        }
+        if (ret < 0) {
+            t->err = -ret;
+            break;
+        }
+        if (ret == 0) {
+            break;  /* end of device */
+        }
+        t->done += ret;
+        off += ret;
+    }
+
+    if (map != NULL) {
+        munmap(map, run->bytes);
+    }
+    if (pipefd[0] >= 0) {
+        close(pipefd[0]);
+        close(pipefd[1]);
+    }
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(const uint64_t *v, size_t n, int permille)
+{
+    size_t i = (n * permille + 999) / 1000;
+
+    if (n == 0) {
+        return 0;
+    }
+    return v[i == 0 ? 0 : i - 1];
+}
+
+/* Fill the device with total_bytes of text, trimming the old contents */
+static int fill_device(size_t bytes)
+{
+    static const char text[] = "Write in C, write in C, everything is fine.\n";
+    char buf[65536];
+    size_t done = 0, i;
+    ssize_t ret;
+    int fd;
+
+    for (i = 0; i < sizeof(buf); i++) {
+        buf[i] = text[i % (sizeof(text) - 1)];
+    }
+    fd = open(device, O_WRONLY);
+    if (fd < 0) {
+        return -errno;
+    }
+    while (done < bytes) {
+        ret = write(fd, buf, bytes - done < sizeof(buf) ? bytes - done : sizeof(buf));
+        if (ret <= 0) {
+            close(fd);
+            return ret < 0 ? -errno : -EIO;
+        }
+        done += ret;
+    }
+    close(fd);
+    return 0;
+}
+
+static void run_bench(const struct bench_run *run, int *first)
+{
+    struct bench_thread *t;
+    uint64_t *lat, start, elapsed = 0;
+    size_t nr_lat = 0, done = 0, max_lat;
+    int i, err = 0;
+
+    printf("%s  {\"mode\": \"%s\", \"variant\": \"%s\", \"open\": \"%s\", "
+           "\"size\": %zu, \"threads\": %d, ",
+           *first ? "" : ",\n", mode_names[run->mode], variant_names[run->variant],
+           open_name(run->open_flags), run->size, run->threads);
+    if (fsync_every > 0 && (run->mode == SEQWRITE || run->mode == RANDWRITE)) {
+        printf("\"fsync_every\": %d, ", fsync_every);
+    }
+    *first = 0;
+
+    t = calloc(run->threads, sizeof(*t));
+    max_lat = run->bytes / run->size / run->threads + 1;
+    for (i = 0; i < run->threads; i++) {
+        t[i].run = run;
+        t[i].index = i;
+        t[i].buf = malloc(run->size);
+        t[i].max_lat = max_lat;
+        t[i].lat = malloc(max_lat * sizeof(uint64_t));
+        memset(t[i].buf, 'a' + i % 26, run->size);
+        /* Open all files before the clock starts, an O_WRONLY open trims the device */
+        t[i].fd = open(device, run->open_flags);
+        if (t[i].fd < 0 && err == 0) {
+            err = errno;
+        }
+    }
+
+    if (err == 0) {
+        start = now_ns();
+        for (i = 0; i < run->threads; i++) {
+            pthread_create(&t[i].tid, NULL, bench_thread_fn, &t[i]);
+        }
+        for (i = 0; i < run->threads; i++) {
+            pthread_join(t[i].tid, NULL);
+        }
+        elapsed = now_ns() - start;
+    }
+
+    lat = malloc(max_lat * run->threads * sizeof(uint64_t));
+    for (i = 0; i < run->threads; i++) {
+        if (err == 0 && t[i].err != 0) {
+            err = t[i].err;
+        }
+        memcpy(lat + nr_lat, t[i].lat, t[i].nr_lat * sizeof(uint64_t));
+        nr_lat += t[i].nr_lat;
+        done += t[i].done;
+        if (t[i].fd >= 0) {
+            close(t[i].fd);
+        }
+        free(t[i].buf);
+        free(t[i].lat);
+    }
+    free(t);
+
+    if (err != 0) {
+        printf("\"error\": \"%s\"}", strerror(err));
+        free(lat);
+        return;
+    }
+
+    qsort(lat, nr_lat, sizeof(uint64_t), cmp_u64);
+    printf("\"bytes\": %zu, \"ops\": %zu, \"seconds\": %.6f, \"mib_per_s\": %.2f, "
+           "\"ops_per_s\": %.0f, \"lat_ns\": {\"p50\": %llu, \"p99\": %llu, "
+           "\"p999\": %llu, \"max\": %llu}}",
+           done, nr_lat, elapsed / 1e9, elapsed ? done / (elapsed / 1e9) / (1 << 20) : 0.0,
+           elapsed ? nr_lat / (elapsed / 1e9) : 0.0,
+           (unsigned long long) percentile(lat, nr_lat, 500),
+           (unsigned long long) percentile(lat, nr_lat, 990),
+           (unsigned long long) percentile(lat, nr_lat, 999),
+           (unsigned long long) (nr_lat ? lat[nr_lat - 1] : 0));
+    free(lat);
+}
+
+/* Parse a comma separated list of numbers (with optional k/m/g suffix) */
+static int parse_sizes(char *arg, size_t *out)
+{
+    char *tok, *end;
+    int n = 0;
+
+    for (tok = strtok(arg, ","); tok != NULL && n < BENCH_MAX_LIST; tok = strtok(NULL, ",")) {
+        size_t v = strtoull(tok, &end, 0);
+
+        switch (*end) {
+        case 'g': case 'G':
+            v <<= 10;
+            /* fall through */
+        case 'm': case 'M':
+            v <<= 10;
+            /* fall through */
+        case 'k': case 'K':
+            v <<= 10;
+        }
+        if (v == 0) {
+            return -1;
+        }
+        out[n++] = v;
+    }
+    return n;
+}
+
+/* Parse a comma separated list of names, returns a bitmask of their indices */
+static int parse_names(char *arg, const char * const *names, int nr)
+{
+    char *tok;
+    int mask = 0, i;
+
+    for (tok = strtok(arg, ","); tok != NULL; tok = strtok(NULL, ",")) {
+        for (i = 0; i < nr; i++) {
+            if (strcmp(tok, names[i]) == 0) {
+                break;
+            }
+        }
+        if (i == nr) {
+            return -1;
+        }
+        mask |= 1 << i;
+    }
+    return mask;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-d device] [-b bytes] [-m modes] [-v variants] [-s sizes]\n"
+            "          [-t threads] [-o openmodes] [-f n]\n"
+            "  -d  device to test (default /dev/bchd)\n"
+            "  -b  data per run, e.g. 64m (default 16m)\n"
+            "  -m  seqread,seqwrite,randread,randwrite (default all)\n"
+            "  -v  rw,prw,readv,mmap,splice (default all)\n"
+            "  -s  request sizes, e.g. 64,4k,64k (default 64,512,4k,64k)\n"
+            "  -t  thread counts, e.g. 1,2,4 (default 1,4)\n"
+            "  -o  rdonly,wronly,rdwr; reads use rdonly/rdwr and writes wronly/rdwr\n"
+            "      of these (default rdonly,rdwr)\n"
+            "  -f  fsync after every n writes of a thread (default never)\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    static const char * const open_names[] = { "rdonly", "wronly", "rdwr" };
+    size_t sizes[BENCH_MAX_LIST] = { 64, 512, 4096, 65536 };
+    size_t threads[BENCH_MAX_LIST] = { 1, 4 };
+    int nr_sizes = 4, nr_threads = 2;
+    int modes = (1 << NR_MODES) - 1;
+    int variants = (1 << NR_VARIANTS) - 1;
+    int opens = 1 << O_RDONLY | 1 << O_RDWR;
+    struct bench_run run;
+    int opt, m, v, o, s, n, ret, first = 1;
+
+    while ((opt = getopt(argc, argv, "d:b:m:v:s:t:o:f:h")) != -1) {
+        switch (opt) {
+        case 'd':
+            device = optarg;
+            break;
+        case 'b':
+            if (parse_sizes(optarg, &total_bytes) != 1) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'm':
+            modes = parse_names(optarg, mode_names, NR_MODES);
+            break;
+        case 'v':
+            variants = parse_names(optarg, variant_names, NR_VARIANTS);
+            break;
+        case 's':
+            nr_sizes = parse_sizes(optarg, sizes);
+            break;
+        case 't':
+            nr_threads = parse_sizes(optarg, threads);
+            break;
+        case 'f':
+            fsync_every = atoi(optarg);
+            break;
+        case 'o':
+            /* O_RDONLY, O_WRONLY and O_RDWR are 0, 1 and 2 */
+            opens = parse_names(optarg, open_names, 3);
+            break;
+        default:
+            usage(argv[0]);
+            return opt != 'h';
+        }
+        if (modes <= 0 || variants <= 0 || opens <= 0 || nr_sizes <= 0 || nr_threads <= 0) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    ret = fill_device(total_bytes);
+    if (ret < 0) {
+        fprintf(stderr, "%s: %s\n", device, strerror(-ret));
+        return 1;
+    }
+
+    printf("{\"device\": \"%s\", \"bytes\": %zu, \"runs\": [\n", device, total_bytes);
+    for (m = 0; m < NR_MODES; m++) {
+        int is_read = m == SEQREAD || m == RANDREAD;
+
+        if (!(modes & 1 << m)) {
+            continue;
+        }
+        for (o = 0; o < 3; o++) {
+            if (!(opens & 1 << o) || o == (is_read ? O_WRONLY : O_RDONLY)) {
+                continue;
+            }
+            for (v = 0; v < NR_VARIANTS; v++) {
+                if (!(variants & 1 << v)) {
+                    continue;
+                }
+                for (s = 0; s < nr_sizes; s++) {
+                    for (n = 0; n < nr_threads; n++) {
+                        run.mode = m;
+                        run.variant = v;
+                        run.open_flags = o;
+                        run.size = sizes[s];
+                        run.threads = threads[n];
+                        run.bytes = total_bytes;
+                        run_bench(&run, &first);
+                        fflush(stdout);
+
+                        /* A write run may have trimmed or shortened the device */
+                        if (!is_read && fill_device(total_bytes) < 0) {
+                            fprintf(stderr, "%s: refilling failed\n", device);
+                            return 1;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    printf("\n]}\n");
+    return 0;
+}
@@ -0,0 +1,98 @@
+/*
+ * bchd_compress.c -- compression of cold quanta
+ *
+ * With bchd_compress set to the name of a compression algorithm of the
+ * crypto API (e.g. lz4 or zstd), the tiering work (see bchd_tier.c)
+ * compresses the quanta nobody touched for a whole interval.
+ * A compressed quantum (struct bchd_cquantum) takes the place of the quantum
+ * in its quantum set, and bchd_store_quantum decompresses it on the next access.
+ * It stays decompressed until it goes cold again, so the quanta in use are
+ * their own cache of decompressed quanta.
+ * Quanta that did not shrink by at least 1/8 stay as they are.
+ *
+ * Both directions run under the device lock, which also protects the
+ * compressor of the device (tfm and buf).
+ */
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/crypto.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "bchd.h"
+
+/* The decompress callback of the store; called with the device lock held */
+static int bchd_compress_inflate(struct bchd_store *store, const struct bchd_cquantum *cq,
+                                 void *quantum)
+{
+    struct bchd_dev *dev = container_of(store, struct bchd_dev, store);
+    unsigned int len = store->quantum_size;
+    int ret;
+
+    ret = crypto_comp_decompress(dev->tier.tfm, cq->data, cq->len, quantum, &len);
+    if (ret == 0 && len != store->quantum_size) {
+        ret = -EIO;
+    }
+    if (ret < 0) {
+        printk_ratelimited(KERN_WARNING "bchd%d: decompressing a quantum failed: %d\n",
+                           MINOR(dev->cdev.dev) - bchd_minor, ret);
+    }
+    return ret;
+}
+
+/* Compress quantum j of qs; returns whether it was worth it */
+bool bchd_compress_quantum(struct bchd_dev *dev, struct bchd_qset *qs, int j)
+{
+    struct bchd_store *store = &dev->store;
+    struct bchd_cquantum *cq;
+    unsigned int len = store->quantum_size - store->quantum_size / 8;
+
+    if (crypto_comp_compress(dev->tier.tfm, qs->data[j], store->quantum_size,
+                             dev->tier.buf, &len) < 0) {
+        bchd_stat_inc(dev->stats, BCHD_STAT_COMPRESS_REJECTS);
+        return false;   /* did not fit into len */
+    }
+    cq = kmalloc(sizeof(*cq) + len, GFP_KERNEL);
+    if (cq == NULL) {
+        bchd_stat_inc(dev->stats, BCHD_STAT_ALLOC_FAILS);
+        return false;
+    }
+    cq->len = len;
+    memcpy(cq->data, dev->tier.buf, len);
+    kfree(qs->data[j]);
+    qs->data[j] = cq;
+    __set_bit(j, qs->compressed);
+    bchd_stat_inc(dev->stats, BCHD_STAT_QUANTUM_FREES);
+    bchd_stat_inc(dev->stats, BCHD_STAT_COMPRESSIONS);
+    bchd_stat_add(dev->stats, BCHD_STAT_COMPRESSED_BYTES, len);
+    return true;
+}
+
+/* Set up the compressor of the device, if bchd_compress is set; called before it is used */
+int bchd_compress_init(struct bchd_dev *dev, int index)
+{
+    struct bchd_store *store = &dev->store;
+    struct crypto_comp *tfm;
+
+    if (bchd_compress == NULL || bchd_compress[0] == '\0') {
+        return 0;
+    }
+    tfm = crypto_alloc_comp(bchd_compress, 0, 0);
+    if (IS_ERR(tfm)) {
+        printk(KERN_WARNING "bchd%d: can't use compression %s: %ld\n", index, bchd_compress,
+               PTR_ERR(tfm));
+        return PTR_ERR(tfm);
+    }
+    dev->tier.tfm = tfm;
+    store->decompress = bchd_compress_inflate;
+    return 0;
+}
+
+void bchd_compress_exit(struct bchd_dev *dev)
+{
+    if (dev->tier.tfm != NULL) {
+        crypto_free_comp(dev->tier.tfm);
+        dev->tier.tfm = NULL;
+    }
+}
@@ -0,0 +1,144 @@
+/*
+ * bchd_dedup.c -- sharing identical quanta within and between the devices
+ *
+ * With bchd_dedup=1, the tiering work (bchd_tier.c) looks up every cold quantum
+ * by the hash of its contents in a table shared by all devices:
+ *  -- if the table has a quantum with the same contents, the cold one is freed
+ *     and its slot refers to the one in the table instead,
+ *  -- otherwise the quantum moves into the table, so later ones can find it.
+ * The quanta in the table (struct bchd_dquantum) are counted references and
+ * never change; the slots referring to them are marked in the shared bitmap
+ * of their quantum set. Writing to a shared quantum gives the slot a private
+ * copy first (bchd_store_quantum with BCHD_QUANTUM_DIRTY), trimming drops the
+ * reference. Since the quantum size is a module parameter, all quanta have the same size.
+ *
+ * A quantum that stayed alone in the table for a whole interval is taken out
+ * again when it can move on to a lower tier (compressed or swap), so unique
+ * quanta do not stay in the table for good.
+ *
+ * The table, the reference counts and the totals are protected by
+ * bchd_dedup_lock, which nests inside the device locks. Reading a shared
+ * quantum needs no lock: it does not change while the slot refers to it.
+ */
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/hashtable.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/xxhash.h>
+
+#include "bchd.h"
+
+#define BCHD_DEDUP_HASH_BITS 14
+
+/* A quantum in the table; slots refer to data */
+struct bchd_dquantum {
+    struct hlist_node node;
+    u64 hash;                   /* of data */
+    unsigned long refs;         /* slots referring to it */
+    u8 data[];
+};
+
+static DEFINE_HASHTABLE(bchd_dedup_table, BCHD_DEDUP_HASH_BITS);
+static DEFINE_MUTEX(bchd_dedup_lock);
+static unsigned long bchd_dedup_entries;       /* quanta in the table ... */
+static unsigned long bchd_dedup_refs;          /* ... and slots referring to them */
+
+/* The hash the table is keyed by; also timed by bchd_selfbench */
+u64 bchd_dedup_hash(const void *quantum, int quantum_size)
+{
+    return xxh64(quantum, quantum_size, 0);
+}
+
+/*
+ * Replace quantum j of qs with a reference to a quantum in the table,
+ * adding it to the table if necessary; returns whether it was replaced.
+ * Called with the device lock held.
+ */
+bool bchd_dedup_quantum(struct bchd_dev *dev, struct bchd_qset *qs, int j)
+{
+    int quantum_size = dev->store.quantum_size;
+    u64 hash = bchd_dedup_hash(qs->data[j], quantum_size);
+    struct bchd_dquantum *dq;
+    bool hit = false;
+
+    mutex_lock(&bchd_dedup_lock);
+    hash_for_each_possible(bchd_dedup_table, dq, node, hash) {
+        if (dq->hash == hash && memcmp(dq->data, qs->data[j], quantum_size) == 0) {
+            hit = true;
+            break;
+        }
+    }
+    if (!hit) {
+        dq = kmalloc(sizeof(*dq) + quantum_size, GFP_KERNEL);
+        if (dq == NULL) {
+            mutex_unlock(&bchd_dedup_lock);
+            bchd_stat_inc(dev->stats, BCHD_STAT_ALLOC_FAILS);
+            return false;
+        }
+        dq->hash = hash;
+        dq->refs = 0;
+        memcpy(dq->data, qs->data[j], quantum_size);
+        hash_add(bchd_dedup_table, &dq->node, hash);
+        bchd_dedup_entries++;
+    }
+    dq->refs++;
+    bchd_dedup_refs++;
+    mutex_unlock(&bchd_dedup_lock);
+
+    kfree(qs->data[j]);
+    qs->data[j] = dq->data;
+    __set_bit(j, qs->shared);
+    bchd_stat_inc(dev->stats, BCHD_STAT_QUANTUM_FREES);
+    bchd_stat_inc(dev->stats, BCHD_STAT_DEDUP_REFS);
+    if (hit) {
+        bchd_stat_inc(dev->stats, BCHD_STAT_DEDUP_HITS);
+    }
+    return true;
+}
+
+/* The release callback of the store: drop a reference, and the quantum with the last one */
+static void bchd_dedup_release(struct bchd_store *store, void *quantum)
+{
+    struct bchd_dquantum *dq = container_of(quantum, struct bchd_dquantum, data);
+
+    mutex_lock(&bchd_dedup_lock);
+    bchd_dedup_refs--;
+    if (--dq->refs == 0) {
+        hash_del(&dq->node);
+        bchd_dedup_entries--;
+        kfree(dq);
+    }
+    mutex_unlock(&bchd_dedup_lock);
+}
+
+/* Whether the shared quantum has no other reference */
+bool bchd_dedup_alone(const void *quantum)
+{
+    const struct bchd_dquantum *dq = container_of(quantum, struct bchd_dquantum, data);
+    bool alone;
+
+    mutex_lock(&bchd_dedup_lock);
+    alone = dq->refs == 1;
+    mutex_unlock(&bchd_dedup_lock);
+    return alone;
+}
+
+/* Share the quanta of the device, if bchd_dedup is set; called before it is used */
+void bchd_dedup_init(struct bchd_dev *dev)
+{
+    if (bchd_dedup) {
+        dev->store.release = bchd_dedup_release;
+    }
+}
+
+/* The totals of the table, for debugfs */
+void bchd_dedup_counts(unsigned long *entries, unsigned long *refs)
+{
+    mutex_lock(&bchd_dedup_lock);
+    *entries = bchd_dedup_entries;
+    *refs = bchd_dedup_refs;
+    mutex_unlock(&bchd_dedup_lock);
+}
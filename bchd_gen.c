@@ -0,0 +1,284 @@
+/*
+ * bchd_gen.c -- the generation of the device contents and its changes
+ *
+ * Each device counts the changes of its contents: every write, trim and
+ * replacement of the contents (bchd_replace.c) bumps its generation, which
+ * starts at 1 when the device is set up. Clients that keep a copy of the
+ * contents can ask whether it is still current instead of reading it all again:
+ *  -- BCHD_IOC_GEN returns the generation,
+ *  -- BCHD_IOC_CREAD reads a range only if the generation is not the one the
+ *     client has, and returns the generation the data is of. It takes the
+ *     device lock once per quantum, so writers do not wait for all of it, and
+ *     stops early if the generation changed in between, so what it returns is
+ *     all of one generation, unlike a read of several quanta,
+ *  -- BCHD_IOC_DELTA returns the ranges that changed after the generation the
+ *     client has, so it only has to read those.
+ * See bchd_ioctl.h for the arguments.
+ *
+ * For the delta, each device logs the ranges its writes changed, rounded to
+ * quanta, in a ring of bchd_delta_log entries (struct bchd_changes). A write
+ * that overlaps or touches the range of the one before, like the next one of
+ * a sequential writer, extends that entry instead of taking a new one. The
+ * log only goes back so far: when the ring is full, the oldest entry goes,
+ * and a trim or replacement empties it, since all of the contents changed.
+ * Clients with an older generation than the log covers get all of the device.
+ * Writes through a mapping of a shmem device (bchd_shmem.c) are not seen.
+ *
+ * The generation and the log are protected by the device lock.
+ */
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/uaccess.h>
+
+#include "bchd.h"
+#include "bchd_ioctl.h"
+
+/* Start counting the generations of the device; called before it is used */
+int bchd_gen_init(struct bchd_dev *dev)
+{
+    struct bchd_changes *c = &dev->changes;
+
+    dev->gen = 1;
+    c->since = dev->gen;
+    if (bchd_delta_log > 0) {
+        c->log = kcalloc(bchd_delta_log, sizeof(*c->log), GFP_KERNEL);
+        if (c->log == NULL) {
+            return -ENOMEM;
+        }
+    }
+    return 0;
+}
+
+void bchd_gen_exit(struct bchd_dev *dev)
+{
+    kfree(dev->changes.log);
+    dev->changes.log = NULL;
+}
+
+/* All of the contents changed; called with the device lock held */
+void bchd_gen_bump(struct bchd_dev *dev)
+{
+    dev->gen++;
+    dev->changes.nr = 0;
+    dev->changes.since = dev->gen;
+    bchd_status_publish(dev, false);
+    bchd_notify(dev);
+}
+
+/* len bytes at off were written; called with the device lock held */
+void bchd_gen_write(struct bchd_dev *dev, loff_t off, size_t len)
+{
+    struct bchd_changes *c = &dev->changes;
+    struct bchd_change *last;
+    int quantum_size = dev->store.quantum_size;
+    loff_t start = off - (long) off % quantum_size;
+    loff_t end = off + len + quantum_size - 1;
+
+    end -= (long) end % quantum_size;
+    dev->gen++;
+    bchd_status_publish(dev, true);
+    bchd_notify(dev);
+    if (c->log == NULL) {
+        c->since = dev->gen;
+        return;
+    }
+    if (c->nr > 0) {
+        last = &c->log[(c->head + c->nr - 1) % bchd_delta_log];
+        if (start <= last->end && end >= last->start) {
+            last->start = min(last->start, start);
+            last->end = max(last->end, end);
+            last->gen = dev->gen;
+            return;
+        }
+    }
+    if (c->nr == bchd_delta_log) {
+        /* Forget the oldest change, and with it the generations up to it */
+        c->since = c->log[c->head].gen;
+        c->head = (c->head + 1) % bchd_delta_log;
+        c->nr--;
+    }
+    last = &c->log[(c->head + c->nr) % bchd_delta_log];
+    last->gen = dev->gen;
+    last->start = start;
+    last->end = end;
+    c->nr++;
+}
+
+/* BCHD_IOC_GEN */
+long bchd_gen_get(struct bchd_dev *dev, u64 __user *argp)
+{
+    u64 gen;
+
+    if (bchd_lock(dev, BCHD_LOCK_GEN)) {
+        return -ERESTARTSYS;
+    }
+    gen = dev->gen;
+    bchd_unlock(dev);
+    return put_user(gen, argp);
+}
+
+/* BCHD_IOC_CREAD */
+long bchd_gen_cread(struct bchd_dev *dev, struct bchd_cread __user *argp)
+{
+    struct bchd_cread cr;
+    char __user *buf;
+    loff_t pos;
+    size_t len, done = 0;
+    ssize_t ret = 0;
+    u64 gen;
+
+    if (copy_from_user(&cr, argp, sizeof(cr))) {
+        return -EFAULT;
+    }
+    if (cr.off > (u64) LLONG_MAX) {
+        return -EINVAL;
+    }
+    buf = u64_to_user_ptr(cr.buf);
+    pos = cr.off;
+    len = min_t(u64, cr.len, MAX_RW_COUNT);
+    bchd_stat_inc(dev->stats, BCHD_STAT_CREADS);
+
+    if (bchd_lock(dev, BCHD_LOCK_GEN)) {
+        return -ERESTARTSYS;
+    }
+    gen = dev->gen;
+    if (cr.gen == gen) {
+        bchd_unlock(dev);
+        bchd_stat_inc(dev->stats, BCHD_STAT_CREAD_UNCHANGED);
+        return -ENODATA;
+    }
+    /* One quantum per hold of the lock: bchd_store_read stops at the end of each */
+    for (;;) {
+        if (dev->shmem != NULL) {
+            ret = bchd_shmem_read(dev, buf + done,
+                                  min_t(size_t, len - done, dev->store.quantum_size), &pos);
+        } else {
+            ret = bchd_store_read(&dev->store, buf + done, len - done, &pos);
+        }
+        bchd_unlock(dev);
+        if (ret <= 0) {
+            break;
+        }
+        done += ret;
+        if (done == len) {
+            break;
+        }
+        if (bchd_lock(dev, BCHD_LOCK_GEN)) {
+            ret = -ERESTARTSYS;
+            break;
+        }
+        if (dev->gen != gen) {
+            bchd_unlock(dev);   /* the rest is of another generation */
+            break;
+        }
+    }
+
+    if (ret < 0 && done == 0) {
+        return ret;
+    }
+    if (put_user(gen, &argp->gen)) {
+        return -EFAULT;
+    }
+    return done;
+}
+
+static int bchd_change_cmp(const void *a, const void *b)
+{
+    const struct bchd_change *x = a, *y = b;
+
+    return x->start < y->start ? -1 : x->start > y->start;
+}
+
+/* BCHD_IOC_DELTA */
+long bchd_gen_delta(struct bchd_dev *dev, struct bchd_delta __user *argp)
+{
+    struct bchd_changes *c = &dev->changes;
+    struct bchd_extent __user *extents;
+    struct bchd_delta d;
+    struct bchd_extent e;
+    struct bchd_change *found;
+    unsigned int i, n = 0, m = 0;
+    loff_t size;
+    long ret = 0;
+
+    if (copy_from_user(&d, argp, sizeof(d))) {
+        return -EFAULT;
+    }
+    extents = u64_to_user_ptr(d.extents);
+    bchd_stat_inc(dev->stats, BCHD_STAT_DELTAS);
+
+    /* Room for all of the log, or for all of the device */
+    found = kmalloc_array(max(bchd_delta_log, 1), sizeof(*found), GFP_KERNEL);
+    if (found == NULL) {
+        return -ENOMEM;
+    }
+    if (bchd_lock(dev, BCHD_LOCK_GEN)) {
+        ret = -ERESTARTSYS;
+        goto out;
+    }
+    if (d.gen > dev->gen) {
+        bchd_unlock(dev);
+        ret = -EINVAL;
+        goto out;
+    }
+    size = dev->store.size;
+    d.flags = 0;
+    if (d.gen < c->since) {
+        d.flags |= BCHD_DELTA_ALL;
+        bchd_stat_inc(dev->stats, BCHD_STAT_DELTA_ALLS);
+        found[n].start = 0;
+        found[n].end = size;
+        n++;
+    } else {
+        for (i = 0; i < c->nr; i++) {
+            if (c->log[(c->head + i) % bchd_delta_log].gen > d.gen) {
+                found[n++] = c->log[(c->head + i) % bchd_delta_log];
+            }
+        }
+    }
+    d.gen = dev->gen;
+    d.size = size;
+    bchd_unlock(dev);
+
+    /* Sort the changes and merge the ones that overlap or touch, up to the size */
+    sort(found, n, sizeof(*found), bchd_change_cmp, NULL);
+    for (i = 0; i < n; i++) {
+        found[i].end = min(found[i].end, size);
+        if (found[i].start >= found[i].end) {
+            continue;
+        }
+        if (m > 0 && found[i].start <= found[m - 1].end) {
+            found[m - 1].end = max(found[m - 1].end, found[i].end);
+        } else {
+            found[m++] = found[i];
+        }
+    }
+    if (d.nr == 0) {
+        d.nr = m;       /* only how many there are */
+        m = 0;
+    } else if (m > d.nr) {
+        found[d.nr - 1].end = found[m - 1].end;
+        m = d.nr;
+    } else {
+        d.nr = m;
+    }
+
+    for (i = 0; i < m; i++) {
+        e.off = found[i].start;
+        e.len = found[i].end - found[i].start;
+        if (copy_to_user(&extents[i], &e, sizeof(e))) {
+            ret = -EFAULT;
+            goto out;
+        }
+    }
+    if (copy_to_user(argp, &d, sizeof(d))) {
+        ret = -EFAULT;
+    }
+out:
+    kfree(found);
+    return ret;
+}
@@ -0,0 +1,101 @@
+/*
+ * bchd_ioctl.h -- the ioctls and the status page of the bchd devices
+ *
+ * Included by the module and by userspace programs.
+ */
+
+#ifndef _BCHD_IOCTL_H_
+#define _BCHD_IOCTL_H_
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define BCHD_IOC_MAGIC 0xbc
+
+/*
+ * Take a snapshot of the device (see bchd_snap.c). Returns a new file
+ * descriptor, open for reading only, with the contents of the device at
+ * the time of the call.
+ */
+#define BCHD_IOC_SNAP _IO(BCHD_IOC_MAGIC, 1)
+
+/*
+ * The generation of the contents (see bchd_gen.c): it starts at 1 and grows
+ * with every write, trim or replacement of the contents, so 0 is never current.
+ */
+#define BCHD_IOC_GEN _IOR(BCHD_IOC_MAGIC, 2, __u64)
+
+/*
+ * Conditional read: if the generation of the device differs from gen, read up
+ * to len bytes at off into buf, all as of one generation, and set gen to it.
+ * Returns the bytes read (fewer at the end of the device, at a hole or where
+ * the contents changed during the read),
+ * or fails with ENODATA and reads nothing if the generation is still gen.
+ */
+struct bchd_cread {
+    __u64 gen;                  /* in: the generation the caller has, out: the one read */
+    __u64 off;
+    __u64 buf;                  /* a pointer */
+    __u64 len;
+};
+
+#define BCHD_IOC_CREAD _IOWR(BCHD_IOC_MAGIC, 3, struct bchd_cread)
+
+/*
+ * Delta read: the ranges of the device that changed after generation gen,
+ * sorted and at quantum boundaries, so a client can read just those.
+ * Up to nr extents are stored at extents; if there are more, the last one
+ * covers the rest. With nr 0, nr returns how many there are.
+ * With BCHD_DELTA_ALL, the device does not remember back to gen (it was
+ * trimmed or replaced since, or had too many changes), and the one extent
+ * is all of it.
+ */
+struct bchd_extent {
+    __u64 off;
+    __u64 len;
+};
+
+#define BCHD_DELTA_ALL 0x1
+
+struct bchd_delta {
+    __u64 gen;                  /* in: the generation the caller has, out: the current one */
+    __u64 size;                 /* out: the size of the device */
+    __u64 extents;              /* in: a pointer to nr struct bchd_extent */
+    __u32 nr;                   /* in: room at extents, out: extents stored there */
+    __u32 flags;                /* out: BCHD_DELTA_* */
+};
+
+#define BCHD_IOC_DELTA _IOWR(BCHD_IOC_MAGIC, 4, struct bchd_delta)
+
+/*
+ * Signal the eventfd fd whenever the contents change (see bchd_notify.c):
+ * at once, or with coalesce_ms once that many ms after the first change, for
+ * all changes meanwhile. Each open file has at most one, registering another
+ * replaces it, and fd -1 drops it.
+ */
+struct bchd_notify {
+    __s32 fd;
+    __u32 coalesce_ms;
+};
+
+#define BCHD_IOC_NOTIFY _IOW(BCHD_IOC_MAGIC, 5, struct bchd_notify)
+
+/*
+ * The status page (see bchd_status.c): mapping a device read-only at this offset
+ * maps a page with its struct bchd_status, which the module keeps up to date.
+ * It is published with a sequence count: seq is odd while the rest changes,
+ * so a reader copies the rest between two reads of an even seq that agree
+ * (with read barriers in between) and tries again otherwise.
+ */
+#define BCHD_STATUS_OFF (1ULL << 40)
+
+struct bchd_status {
+    __u32 seq;
+    __u32 pad;
+    __u64 size;                 /* of the contents */
+    __u64 gen;                  /* see BCHD_IOC_GEN */
+    __u64 writes;               /* that changed the contents */
+    __u64 log_pos;              /* where the logger is */
+};
+
+#endif /* _BCHD_IOCTL_H_ */
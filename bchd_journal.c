@@ -0,0 +1,319 @@
+/*
+ * bchd_journal.c -- write-ahead journal of the backing files
+ *
+ * Without a journal, a crash in the middle of a writeback pass leaves the
+ * backing file with some runs of the pass written and others not.
+ * With bchd_journal=1, a pass does not write into the image but appends
+ * to the journal, the file <bchd_backing>N.journal:
+ *  -- a data record per run of dirty quanta (offset, length, data),
+ *  -- a truncate record if the device was trimmed,
+ *  -- a commit record with the size of the device, after which the journal is synced.
+ * Every record carries the number of its pass (transaction) and a crc32
+ * of itself and its data, so a torn or unsynced tail is recognized.
+ * Once the journal has grown past bchd_checkpoint_mb, and on unload,
+ * the committed records are applied to the image (a checkpoint), the image is
+ * synced and the journal emptied. On load, the committed part of a journal
+ * left over from a crash is applied the same way before the image is used,
+ * which takes time proportional to the size of the journal, not of the device.
+ * Applying records is idempotent, so a crash during a checkpoint is harmless.
+ *
+ * All of this runs under backing.lock, see bchd_backing.c.
+ */
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/crc32.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "bchd.h"
+
+#define BCHD_JOURNAL_MAGIC 0x4a484342   /* "BCHJ" */
+
+enum bchd_jrec_type {
+    BCHD_JREC_DATA = 1,
+    BCHD_JREC_TRUNCATE,
+    BCHD_JREC_COMMIT,
+};
+
+/* A record of the journal, followed by len bytes of data */
+struct bchd_jrec {
+    __le32 magic;
+    __le32 type;
+    __le64 tx;                  /* Transaction (writeback pass) of the record */
+    __le64 off;                 /* Data: offset in the device, commit: size of the device */
+    __le32 len;
+    __le32 crc;                 /* crc32 of the record (with crc 0) and the data */
+};
+
+static u32 bchd_jrec_crc(struct bchd_jrec *rec, const void *data, size_t len)
+{
+    u32 saved = rec->crc;
+    u32 crc;
+
+    rec->crc = 0;
+    crc = crc32(~0, rec, sizeof(*rec));
+    rec->crc = saved;
+    return crc32(crc, data, len);
+}
+
+static int bchd_journal_append(struct bchd_dev *dev, enum bchd_jrec_type type, loff_t off,
+                               const void *data, size_t len)
+{
+    struct bchd_backing *b = &dev->backing;
+    struct bchd_jrec rec = {
+        .magic = cpu_to_le32(BCHD_JOURNAL_MAGIC),
+        .type = cpu_to_le32(type),
+        .tx = cpu_to_le64(b->tx),
+        .off = cpu_to_le64(off),
+        .len = cpu_to_le32(len),
+    };
+    loff_t pos = b->journal_pos;
+    ssize_t ret;
+
+    rec.crc = cpu_to_le32(bchd_jrec_crc(&rec, data, len));
+    ret = kernel_write(b->journal, &rec, sizeof(rec), &pos);
+    if (ret == sizeof(rec) && len > 0) {
+        ret = kernel_write(b->journal, data, len, &pos);
+        if (ret == (ssize_t) len) {
+            ret = sizeof(rec);
+        }
+    }
+    if (ret != sizeof(rec)) {
+        printk_ratelimited(KERN_WARNING "bchd%d: writing the journal failed: %zd\n",
+                           MINOR(dev->cdev.dev) - bchd_minor, ret);
+        /* Cut off what made it; if that fails, the next record overwrites it */
+        vfs_truncate(&b->journal->f_path, b->journal_pos);
+        return ret < 0 ? ret : -EIO;
+    }
+    b->journal_pos = pos;
+    bchd_stat_add(dev->stats, BCHD_STAT_JOURNAL_BYTES, sizeof(rec) + len);
+    return 0;
+}
+
+/* Start the transaction of a writeback pass, unless the last one could not be committed */
+void bchd_journal_begin(struct bchd_dev *dev)
+{
+    struct bchd_backing *b = &dev->backing;
+
+    if (!b->tx_open) {
+        b->tx++;
+        b->tx_start = b->journal_pos;
+        b->tx_open = true;
+    }
+}
+
+int bchd_journal_data(struct bchd_dev *dev, loff_t off, const void *data, size_t len)
+{
+    return bchd_journal_append(dev, BCHD_JREC_DATA, off, data, len);
+}
+
+int bchd_journal_truncate(struct bchd_dev *dev)
+{
+    return bchd_journal_append(dev, BCHD_JREC_TRUNCATE, 0, NULL, 0);
+}
+
+/*
+ * Commit the transaction with the size the device had when its data was collected
+ * and sync the journal. A transaction without records that leaves the size
+ * alone is not written at all. If the commit fails, the transaction stays open
+ * and the next pass adds to it.
+ */
+int bchd_journal_commit(struct bchd_dev *dev, unsigned long size)
+{
+    struct bchd_backing *b = &dev->backing;
+    loff_t pos = b->journal_pos;
+    int ret;
+
+    if (b->journal_pos == b->tx_start && size == b->committed_size) {
+        b->tx_open = false;
+        return 0;
+    }
+    ret = bchd_journal_append(dev, BCHD_JREC_COMMIT, size, NULL, 0);
+    if (ret == 0) {
+        ret = vfs_fsync(b->journal, 1);
+        if (ret < 0) {
+            vfs_truncate(&b->journal->f_path, pos);
+            b->journal_pos = pos;
+        }
+    }
+    if (ret < 0) {
+        return ret;
+    }
+    b->tx_open = false;
+    b->committed_size = size;
+    bchd_stat_inc(dev->stats, BCHD_STAT_JOURNAL_COMMITS);
+
+    if (b->journal_pos >= (loff_t) bchd_checkpoint_mb << 20) {
+        bchd_journal_checkpoint(dev);   /* on failure, the journal just keeps growing */
+    }
+    return 0;
+}
+
+/*
+ * Read the journal from its start up to end and, with apply, apply its records to the image.
+ * Returns the offset behind the last valid commit record (0 if there is none)
+ * or an error; *txs is set to the number of committed transactions.
+ */
+static loff_t bchd_journal_scan(struct bchd_dev *dev, loff_t end, bool apply, u64 *txs)
+{
+    struct bchd_backing *b = &dev->backing;
+    size_t max_len = (size_t) b->batch * dev->store.quantum_size;
+    struct bchd_jrec rec;
+    loff_t pos = 0, committed = 0, off;
+    u64 tx = 0, last = 0;
+    size_t len;
+    ssize_t ret;
+
+    *txs = 0;
+    while (pos + (loff_t) sizeof(rec) <= end) {
+        off = pos;
+        ret = kernel_read(b->journal, &rec, sizeof(rec), &off);
+        if (ret < 0) {
+            return ret;
+        }
+        len = le32_to_cpu(rec.len);
+        if (ret != sizeof(rec) || le32_to_cpu(rec.magic) != BCHD_JOURNAL_MAGIC || len > max_len
+            || pos + (loff_t) (sizeof(rec) + len) > end) {
+            break;
+        }
+        /* All records of a transaction have its number, which is above the ones before */
+        if (tx == 0 && le64_to_cpu(rec.tx) > last) {
+            tx = le64_to_cpu(rec.tx);
+        }
+        if (tx == 0 || le64_to_cpu(rec.tx) != tx) {
+            break;
+        }
+        ret = kernel_read(b->journal, b->buf, len, &off);
+        if (ret < 0) {
+            return ret;
+        }
+        if (ret != (ssize_t) len || bchd_jrec_crc(&rec, b->buf, len) != le32_to_cpu(rec.crc)) {
+            break;      /* torn */
+        }
+        pos = off;
+
+        if (!apply) {
+            ret = 0;
+        } else if (le32_to_cpu(rec.type) == BCHD_JREC_DATA) {
+            off = le64_to_cpu(rec.off);
+            ret = kernel_write(b->file, b->buf, len, &off);
+            if (ret == (ssize_t) len) {
+                ret = 0;
+                bchd_stat_add(dev->stats, BCHD_STAT_CHECKPOINT_BYTES, len);
+            } else if (ret >= 0) {
+                ret = -EIO;
+            }
+        } else if (le32_to_cpu(rec.type) == BCHD_JREC_TRUNCATE) {
+            ret = vfs_truncate(&b->file->f_path, 0);
+        } else if (le32_to_cpu(rec.type) == BCHD_JREC_COMMIT
+                   && i_size_read(file_inode(b->file)) != le64_to_cpu(rec.off)) {
+            ret = vfs_truncate(&b->file->f_path, le64_to_cpu(rec.off));
+        } else {
+            ret = 0;
+        }
+        if (ret < 0) {
+            return ret;
+        }
+
+        if (le32_to_cpu(rec.type) == BCHD_JREC_COMMIT) {
+            committed = pos;
+            last = tx;
+            tx = 0;
+            (*txs)++;
+        }
+    }
+    b->tx = max(b->tx, last);
+    return committed;
+}
+
+/*
+ * Apply the committed records to the image, sync it and empty the journal.
+ * Called after a commit (so everything in the journal is committed) and on load.
+ */
+int bchd_journal_checkpoint(struct bchd_dev *dev)
+{
+    struct bchd_backing *b = &dev->backing;
+    u64 start = ktime_get_ns();
+    loff_t end;
+    u64 txs;
+    int ret;
+
+    end = bchd_journal_scan(dev, b->journal_pos, true, &txs);
+    if (end >= 0 && end != b->journal_pos) {
+        end = -EIO;     /* the journal does not read back as it was written */
+    }
+    ret = end < 0 ? end : vfs_fsync(b->file, 0);
+    if (ret == 0) {
+        ret = vfs_truncate(&b->journal->f_path, 0);
+    }
+    if (ret < 0) {
+        printk_ratelimited(KERN_WARNING "bchd%d: checkpoint failed: %d\n",
+                           MINOR(dev->cdev.dev) - bchd_minor, ret);
+        bchd_stat_inc(dev->stats, BCHD_STAT_WRITEBACK_ERRORS);
+        return ret;
+    }
+    b->journal_pos = 0;
+    b->tx_start = 0;
+    bchd_stat_inc(dev->stats, BCHD_STAT_CHECKPOINTS);
+    bchd_lat_record(dev->stats, BCHD_LAT_CHECKPOINT, start);
+    return 0;
+}
+
+/* Open the journal of the image at path and replay what it has committed */
+int bchd_journal_init(struct bchd_dev *dev, const char *path)
+{
+    struct bchd_backing *b = &dev->backing;
+    u64 start = ktime_get_ns();
+    struct file *file;
+    char *jpath;
+    loff_t end;
+    u64 txs;
+    int result;
+
+    jpath = kasprintf(GFP_KERNEL, "%s.journal", path);
+    if (jpath == NULL) {
+        return -ENOMEM;
+    }
+    file = filp_open(jpath, O_RDWR | O_CREAT | O_LARGEFILE, 0600);
+    if (IS_ERR(file)) {
+        printk(KERN_WARNING "bchd: can't open journal %s: %ld\n", jpath, PTR_ERR(file));
+        result = PTR_ERR(file);
+        goto out;
+    }
+    b->journal = file;
+    b->tx = 0;
+    b->tx_open = false;
+
+    /* Find the end of the last commit, then apply everything before it */
+    end = bchd_journal_scan(dev, i_size_read(file_inode(file)), false, &txs);
+    b->journal_pos = end < 0 ? 0 : end;
+    result = end < 0 ? end : bchd_journal_checkpoint(dev);
+    if (result < 0) {
+        printk(KERN_WARNING "bchd: can't recover from journal %s: %d\n", jpath, result);
+        filp_close(file, NULL);
+        b->journal = NULL;
+        goto out;
+    }
+    if (txs > 0) {
+        printk(KERN_INFO "bchd: replayed %llu transactions (%lld bytes) of %s in %llu us\n",
+               txs, end, jpath, div_u64(ktime_get_ns() - start, 1000));
+    }
+out:
+    kfree(jpath);
+    return result;
+}
+
+/* Checkpoint and close the journal; the last writeback pass is done */
+void bchd_journal_exit(struct bchd_dev *dev)
+{
+    struct bchd_backing *b = &dev->backing;
+
+    if (b->journal == NULL) {
+        return;
+    }
+    bchd_journal_checkpoint(dev);
+    filp_close(b->journal, NULL);
+    b->journal = NULL;
+}
@@ -0,0 +1,1074 @@
+/*
+ * bchd_kunit.c -- KUnit tests and microbenchmarks of bchd
+ *
+ * Built into bchd.ko with "make kunit" (CONFIG_BCHD_KUNIT_TEST=y, for a kernel
+ * with CONFIG_KUNIT), the suite runs when the module is loaded, on devices of
+ * its own that are set up like bchd_init sets up its devices, without the char
+ * device. bchd_ufuzz covers the storage engine in userspace already; the tests
+ * here cover what only runs in the kernel:
+ *  -- quantum lookup at the edges of quanta and list items, holes and trimming,
+ *  -- snapshots of a store copied on write, with writers on several threads,
+ *  -- saving and restoring a snapshot file (bchd_snapshot.c), also through the
+ *     shmem file of a device with bchd_shmem (bchd_shmem.c),
+ *  -- writeback, fsync and reloading through the backing file (bchd_backing.c),
+ *  -- replaying the journal after a crash without its uncommitted or torn tail
+ *     (bchd_journal.c),
+ *  -- dedup, compression and swap by the tiering work and reading the quanta
+ *     back (bchd_tier.c), also by saving a snapshot,
+ *  -- the generation and the delta log (bchd_gen.c) and that nothing is
+ *     signaled without a registered eventfd (bchd_notify.c).
+ * Not covered: the file operations, which take user buffers (the tests read and
+ * write the stores directly, like bchd_read and bchd_write do), and signaling
+ * an eventfd, which a test can't create without a process.
+ * The microbenchmark times allocating, copying, looking up, copying on write
+ * after a snapshot and trimming with the configured geometry, like bchd_selfbench.
+ *
+ * The files go to bchd_kunit_dir (default /tmp) and are removed afterwards;
+ * the tests that need them are skipped if it is not writable. While a test
+ * runs, it sets the module parameters it tests for its own devices, so load the
+ * module with the tests and without other parameters:
+ *     sudo insmod bchd.ko bchd_kunit_dir=/var/tmp
+ *     cat /sys/kernel/debug/kunit/bchd/results
+ */
+
+#include <linux/kernel.h>
+#include <linux/completion.h>
+#include <linux/crypto.h>       /* crypto_has_comp */
+#include <linux/errno.h>
+#include <linux/fs.h>
+#include <linux/kthread.h>
+#include <linux/math64.h>       /* div64_u64 */
+#include <linux/moduleparam.h>
+#include <linux/mount.h>
+#include <linux/namei.h>
+#include <linux/percpu.h>
+#include <linux/random.h>
+#include <linux/sched.h>        /* cond_resched */
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+#include <kunit/test.h>
+
+#include "bchd.h"
+
+#define BCHD_KUNIT_THREADS 4    /* writers of the threads test ... */
+#define BCHD_KUNIT_QUANTA 16    /* ... each on this many quanta of its own ... */
+#define BCHD_KUNIT_ROUNDS 200   /* ... this many times */
+#define BCHD_KUNIT_PASSES 4     /* tiering passes that share a cold quantum, then move it on */
+#define BCHD_KUNIT_BENCH_BYTES (16 << 20)
+#define BCHD_KUNIT_BENCH_LOOKUPS (1 << 20)
+
+static char *bchd_kunit_dir = "/tmp";
+module_param(bchd_kunit_dir, charp, S_IRUGO);
+
+/* The module parameters a test device is set up with; the ones left out are off */
+struct bchd_kunit_params {
+    char *backing;
+    bool journal;
+    char *compress;
+    bool tier_swap;
+    bool dedup;
+    bool shmem;
+};
+
+/* Undo what bchd_kunit_dev did, like bchd_cleanup does */
+static void bchd_kunit_dev_free(void *data)
+{
+    struct bchd_dev *dev = data;
+
+    if (dev->init_step >= BCHD_INIT_TIER) {
+        bchd_tier_stop(dev);
+    }
+    if (dev->init_step >= BCHD_INIT_BACKING) {
+        bchd_backing_exit(dev);
+    }
+    if (dev->init_step >= BCHD_INIT_STATS) {
+        bchd_trim(dev);
+    }
+    if (dev->init_step >= BCHD_INIT_SHMEM) {
+        bchd_shmem_exit(dev);
+    }
+    if (dev->init_step >= BCHD_INIT_TIER) {
+        bchd_tier_exit(dev);
+    }
+    if (dev->init_step >= BCHD_INIT_GEN) {
+        bchd_gen_exit(dev);
+    }
+    free_percpu(dev->stats);
+    kfree(dev);
+}
+
+/*
+ * A device of the test's own, set up like bchd_init sets up its devices (up to
+ * the backing file) with the parameters in p, or with all of them off if p is NULL.
+ * It is freed when the test ends; if a step fails, the test is skipped.
+ */
+static struct bchd_dev * bchd_kunit_dev(struct kunit *test, int quantum_size, int qset_size,
+                                        const struct bchd_kunit_params *p)
+{
+    static const struct bchd_kunit_params none = { };
+    char *backing = bchd_backing, *compress = bchd_compress;
+    bool journal = bchd_journal, tier_swap = bchd_tier_swap, dedup = bchd_dedup;
+    bool shmem = bchd_shmem;
+    struct bchd_dev *dev;
+    int result;
+
+    dev = kzalloc(sizeof(*dev), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, dev);
+    KUNIT_ASSERT_EQ(test, kunit_add_action_or_reset(test, bchd_kunit_dev_free, dev), 0);
+    dev->stats = alloc_percpu(struct bchd_stats);
+    KUNIT_ASSERT_NOT_NULL(test, dev->stats);
+    mutex_init(&dev->lock);
+    bchd_store_init(&dev->store, quantum_size, qset_size, dev->stats);
+    bchd_notify_init(dev);
+    dev->max_word_len = bchd_max_word_len;
+    dev->init_step = BCHD_INIT_STATS;
+
+    if (p == NULL) {
+        p = &none;
+    }
+    bchd_backing = p->backing;
+    bchd_journal = p->journal;
+    bchd_compress = p->compress;
+    bchd_tier_swap = p->tier_swap;
+    bchd_dedup = p->dedup;
+    bchd_shmem = p->shmem;
+    result = bchd_gen_init(dev);
+    if (result == 0) {
+        dev->init_step = BCHD_INIT_GEN;
+        result = bchd_tier_init(dev, 0);
+    }
+    if (result == 0) {
+        dev->init_step = BCHD_INIT_TIER;
+        result = bchd_shmem_init(dev, 0);
+    }
+    if (result == 0) {
+        dev->init_step = BCHD_INIT_SHMEM;
+        result = bchd_backing_init(dev, 0);
+    }
+    if (result == 0) {
+        dev->init_step = BCHD_INIT_BACKING;
+    }
+    bchd_backing = backing;
+    bchd_journal = journal;
+    bchd_compress = compress;
+    bchd_tier_swap = tier_swap;
+    bchd_dedup = dedup;
+    bchd_shmem = shmem;
+
+    if (result < 0) {
+        kunit_skip(test, "can't set up the device: %d", result);
+    }
+    return dev;
+}
+
+/* Write len bytes of data at off into the store of dev like bchd_write does; returns the bytes written */
+static size_t bchd_kunit_write(struct bchd_dev *dev, loff_t off, const void *data, size_t len)
+{
+    struct bchd_store *store = &dev->store;
+    struct bchd_pos pos;
+    size_t done, count;
+    char *quantum;
+
+    __bchd_lock(dev, BCHD_LOCK_WRITE, false);
+    for (done = 0; done < len; done += count) {
+        bchd_store_locate(store, off + done, &pos);
+        quantum = bchd_store_quantum(store, &pos, BCHD_QUANTUM_CREATE | BCHD_QUANTUM_DIRTY);
+        if (quantum == NULL) {
+            break;
+        }
+        count = min_t(size_t, len - done, store->quantum_size - pos.q_pos);
+        memcpy(quantum + pos.q_pos, (const char *) data + done, count);
+    }
+    if (done > 0) {
+        if (store->size < off + done) {
+            store->size = off + done;
+        }
+        bchd_backing_dirty(dev);
+        bchd_gen_write(dev, off, done);
+    }
+    bchd_unlock(dev);
+    return done;
+}
+
+/*
+ * Read up to len bytes at off from store (the store of dev or a snapshot of it)
+ * like bchd_read does; holes read as zeros. Returns the bytes read.
+ */
+static size_t bchd_kunit_read(struct bchd_dev *dev, struct bchd_store *store, loff_t off,
+                              void *buf, size_t len)
+{
+    struct bchd_pos pos;
+    size_t done, count;
+    char *quantum;
+
+    __bchd_lock(dev, BCHD_LOCK_READ, false);
+    len = off < store->size ? min_t(u64, len, store->size - off) : 0;
+    for (done = 0; done < len; done += count) {
+        bchd_store_locate(store, off + done, &pos);
+        count = min_t(size_t, len - done, store->quantum_size - pos.q_pos);
+        quantum = bchd_store_quantum(store, &pos, 0);
+        if (quantum == NULL) {
+            memset((char *) buf + done, 0, count);
+        } else {
+            memcpy((char *) buf + done, quantum + pos.q_pos, count);
+        }
+    }
+    bchd_unlock(dev);
+    return len;
+}
+
+/* Write len bytes of data at off into the shmem file of dev like bchd_shmem_write does */
+static size_t bchd_kunit_shmem_write(struct bchd_dev *dev, loff_t off, const void *data,
+                                     size_t len)
+{
+    ssize_t ret;
+
+    __bchd_lock(dev, BCHD_LOCK_WRITE, false);
+    ret = kernel_write(dev->shmem, data, len, &off);
+    dev->store.size = i_size_read(file_inode(dev->shmem));
+    bchd_unlock(dev);
+    return ret < 0 ? 0 : ret;
+}
+
+/* Trim dev like opening it O_WRONLY does */
+static void bchd_kunit_trim(struct bchd_dev *dev)
+{
+    __bchd_lock(dev, BCHD_LOCK_OPEN, false);
+    bchd_trim(dev);
+    bchd_unlock(dev);
+}
+
+/* Text that differs with seed and compresses well */
+static void bchd_kunit_text(char *buf, size_t len, int seed)
+{
+    static const char text[] = "Write in C, write in C, everything is fine.\n";
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        buf[i] = text[(i + seed) % (sizeof(text) - 1)];
+    }
+    if (len > 0) {
+        buf[0] = 'a' + seed % 26;
+    }
+}
+
+/* A buffer the test frees when it ends */
+static char * bchd_kunit_buf(struct kunit *test, size_t len)
+{
+    char *buf = kunit_kzalloc(test, len, GFP_KERNEL);
+
+    KUNIT_ASSERT_NOT_NULL(test, buf);
+    return buf;
+}
+
+/* Remove the file at path, if there is one */
+static void bchd_kunit_unlink(const char *path)
+{
+    struct path p;
+    struct dentry *dir;
+
+    if (kern_path(path, 0, &p) < 0) {
+        return;
+    }
+    if (mnt_want_write(p.mnt) == 0) {
+        dir = dget_parent(p.dentry);
+        inode_lock_nested(d_inode(dir), I_MUTEX_PARENT);
+        if (p.dentry->d_parent == dir) {
+            vfs_unlink(mnt_idmap(p.mnt), d_inode(dir), p.dentry, NULL);
+        }
+        inode_unlock(d_inode(dir));
+        dput(dir);
+        mnt_drop_write(p.mnt);
+    }
+    path_put(&p);
+}
+
+/* Remove the files of device 0 with the prefix data */
+static void bchd_kunit_remove(void *data)
+{
+    static const char * const suffixes[] = { "0", "0.journal", "0.tmp" };
+    char *path;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(suffixes); i++) {
+        path = kasprintf(GFP_KERNEL, "%s%s", (const char *) data, suffixes[i]);
+        if (path != NULL) {
+            bchd_kunit_unlink(path);
+            kfree(path);
+        }
+    }
+}
+
+/*
+ * The prefix of the files of the test called name in bchd_kunit_dir, for bchd_backing
+ * or bchd_snapshot. They are removed when the test ends; the test is skipped if the
+ * directory is not writable.
+ */
+static char * bchd_kunit_prefix(struct kunit *test, const char *name)
+{
+    struct file *file;
+    char *prefix, *probe;
+
+    prefix = bchd_kunit_buf(test, PATH_MAX);
+    probe = bchd_kunit_buf(test, PATH_MAX);
+    snprintf(prefix, PATH_MAX, "%s/bchd-kunit-%s", bchd_kunit_dir, name);
+    snprintf(probe, PATH_MAX, "%s0.tmp", prefix);
+    KUNIT_ASSERT_EQ(test, kunit_add_action_or_reset(test, bchd_kunit_remove, prefix), 0);
+    bchd_kunit_remove(prefix);  /* left over from a test that did not finish */
+
+    file = filp_open(probe, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0600);
+    if (IS_ERR(file)) {
+        kunit_skip(test, "can't create files in %s: %ld", bchd_kunit_dir, PTR_ERR(file));
+    }
+    filp_close(file, NULL);
+    bchd_kunit_unlink(probe);
+    return prefix;
+}
+
+/* Read all of the file at path into buf (of len bytes); returns its size or an error */
+static loff_t bchd_kunit_read_file(const char *path, void *buf, size_t len)
+{
+    struct file *file;
+    loff_t size, pos = 0;
+    ssize_t ret;
+
+    file = filp_open(path, O_RDONLY | O_LARGEFILE, 0);
+    if (IS_ERR(file)) {
+        return PTR_ERR(file);
+    }
+    size = i_size_read(file_inode(file));
+    ret = kernel_read(file, buf, min_t(loff_t, len, size), &pos);
+    filp_close(file, NULL);
+    return ret < 0 ? ret : size;
+}
+
+/* Quantum lookup at the edges of quanta and list items, and beyond 2^31 */
+static void bchd_kunit_locate_test(struct kunit *test)
+{
+    static const struct {
+        loff_t off;
+        struct bchd_pos pos;
+    } cases[] = {
+        { 0, { 0, 0, 0 } },
+        { 99, { 0, 0, 99 } },
+        { 100, { 0, 1, 0 } },
+        { 999, { 0, 9, 99 } },
+        { 1000, { 1, 0, 0 } },
+        { 1001, { 1, 0, 1 } },
+        { 12345, { 12, 3, 45 } },
+        { 3000000999LL, { 3000000, 9, 99 } },
+    };
+    struct bchd_store store = { .quantum_size = 100, .qset_size = 10 };
+    struct bchd_pos pos;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(cases); i++) {
+        bchd_store_locate(&store, cases[i].off, &pos);
+        KUNIT_EXPECT_EQ_MSG(test, pos.item, cases[i].pos.item, "off %lld", cases[i].off);
+        KUNIT_EXPECT_EQ_MSG(test, pos.qset_pos, cases[i].pos.qset_pos, "off %lld", cases[i].off);
+        KUNIT_EXPECT_EQ_MSG(test, pos.q_pos, cases[i].pos.q_pos, "off %lld", cases[i].off);
+    }
+}
+
+/* Writes across quanta and list items, holes between them, and trimming all of it */
+static void bchd_kunit_quantum_test(struct kunit *test)
+{
+    static const struct {
+        loff_t off;
+        size_t len;
+    } writes[] = {
+        { 0, 100 },             /* one whole quantum */
+        { 150, 250 },           /* across quanta */
+        { 990, 20 },            /* across list items */
+        { 5000, 150 },          /* behind holes of whole list items */
+    };
+    struct bchd_dev *dev = bchd_kunit_dev(test, 100, 10, NULL);
+    struct bchd_store *store = &dev->store;
+    size_t size = 5150;
+    char *model = bchd_kunit_buf(test, size);
+    char *buf = bchd_kunit_buf(test, size);
+    char word[20];
+    struct bchd_pos pos;
+    int i, log_pos;
+
+    for (i = 0; i < ARRAY_SIZE(writes); i++) {
+        bchd_kunit_text(model + writes[i].off, writes[i].len, i);
+        KUNIT_ASSERT_EQ(test, bchd_kunit_write(dev, writes[i].off, model + writes[i].off,
+                                               writes[i].len), writes[i].len);
+    }
+    KUNIT_EXPECT_EQ(test, store->size, size);
+    KUNIT_EXPECT_EQ(test, bchd_kunit_read(dev, store, 0, buf, size), size);
+    KUNIT_EXPECT_MEMEQ(test, buf, model, size);
+    KUNIT_EXPECT_EQ(test, bchd_kunit_read(dev, store, size, buf, 1), 0);
+
+    /* The holes are not allocated by reading them */
+    bchd_store_locate(store, 3000, &pos);
+    KUNIT_EXPECT_NULL(test, bchd_store_quantum(store, &pos, 0));
+    bchd_store_locate(store, 100, &pos);
+    KUNIT_EXPECT_NULL(test, bchd_store_quantum(store, &pos, 0));
+    log_pos = 3050;
+    KUNIT_EXPECT_EQ(test, bchd_store_next_word(store, &log_pos, word, sizeof(word)), -ENODATA);
+    KUNIT_EXPECT_EQ(test, log_pos, 3100);
+
+    bchd_kunit_trim(dev);
+    KUNIT_EXPECT_NULL(test, store->data);
+    KUNIT_EXPECT_EQ(test, store->size, 0);
+    KUNIT_EXPECT_EQ(test, bchd_stat_sum(dev, BCHD_STAT_QUANTUM_FREES),
+                    bchd_stat_sum(dev, BCHD_STAT_QUANTUM_ALLOCS));
+    KUNIT_EXPECT_EQ(test, bchd_stat_sum(dev, BCHD_STAT_QSET_FREES),
+                    bchd_stat_sum(dev, BCHD_STAT_QSET_ALLOCS));
+    KUNIT_EXPECT_EQ(test, bchd_stat_sum(dev, BCHD_STAT_PTRS_FREES),
+                    bchd_stat_sum(dev, BCHD_STAT_PTRS_ALLOCS));
+}
+
+/* A snapshot keeps its contents while the store is written, trimmed and written again */
+static void bchd_kunit_cow_test(struct kunit *test)
+{
+    struct bchd_dev *dev = bchd_kunit_dev(test, 100, 10, NULL);
+    struct bchd_store *store = &dev->store;
+    struct bchd_store snap;
+    size_t size = 3000;
+    char *model = bchd_kunit_buf(test, size);
+    char *buf = bchd_kunit_buf(test, size);
+    char *data = bchd_kunit_buf(test, size);
+
+    bchd_kunit_text(model, size, 1);
+    KUNIT_ASSERT_EQ(test, bchd_kunit_write(dev, 0, model, size), size);
+    __bchd_lock(dev, BCHD_LOCK_SNAP, false);
+    bchd_store_snapshot(store, &snap);
+    bchd_unlock(dev);
+
+    /* Across the first two list items */
+    bchd_kunit_text(data, size, 2);
+    KUNIT_ASSERT_EQ(test, bchd_kunit_write(dev, 950, data, 200), 200);
+    KUNIT_EXPECT_EQ(test, bchd_kunit_read(dev, &snap, 0, buf, size), size);
+    KUNIT_EXPECT_MEMEQ(test, buf, model, size);
+    KUNIT_EXPECT_EQ(test, bchd_kunit_read(dev, store, 950, buf, 200), 200);
+    KUNIT_EXPECT_MEMEQ(test, buf, data, 200);
+    KUNIT_EXPECT_EQ(test, bchd_kunit_read(dev, store, 2000, buf, 1000), 1000);
+    KUNIT_EXPECT_MEMEQ(test, buf, model + 2000, 1000);
+    KUNIT_EXPECT_GT(test, bchd_stat_sum(dev, BCHD_STAT_SNAP_COWS), 0);
+
+    bchd_kunit_trim(dev);
+    KUNIT_ASSERT_EQ(test, bchd_kunit_write(dev, 0, data, 500), 500);
+    KUNIT_EXPECT_EQ(test, bchd_kunit_read(dev, &snap, 0, buf, size), size);
+    KUNIT_EXPECT_MEMEQ(test, buf, model, size);
+
+    __bchd_lock(dev, BCHD_LOCK_SNAP, false);
+    bchd_store_trim(&snap);
+    bchd_unlock(dev);
+    bchd_kunit_trim(dev);
+    KUNIT_EXPECT_EQ(test, bchd_stat_sum(dev, BCHD_STAT_QUANTUM_FREES),
+                    bchd_stat_sum(dev, BCHD_STAT_QUANTUM_ALLOCS));
+    KUNIT_EXPECT_EQ(test, bchd_stat_sum(dev, BCHD_STAT_QSET_FREES),
+                    bchd_stat_sum(dev, BCHD_STAT_QSET_ALLOCS));
+}
+
+struct bchd_kunit_writer {
+    struct bchd_dev *dev;
+    int index;
+    char *buf;                  /* a quantum */
+    struct completion done;
+};
+
+/* The byte a writer fills its quanta with in a round */
+static char bchd_kunit_byte(int index, int round)
+{
+    return 1 + index * 50 + round % 50;
+}
+
+/* Write whole quanta of the writer's own part of the device, round after round */
+static int bchd_kunit_writer(void *data)
+{
+    struct bchd_kunit_writer *w = data;
+    int quantum_size = w->dev->store.quantum_size;
+    loff_t off;
+    int round, i;
+
+    for (round = 0; round < BCHD_KUNIT_ROUNDS; round++) {
+        memset(w->buf, bchd_kunit_byte(w->index, round), quantum_size);
+        for (i = 0; i < BCHD_KUNIT_QUANTA; i++) {
+            off = ((loff_t) w->index * BCHD_KUNIT_QUANTA + i) * quantum_size;
+            bchd_kunit_write(w->dev, off, w->buf, quantum_size);
+        }
+        cond_resched();
+    }
+    complete(&w->done);
+    return 0;
+}
+
+/* Returns the number of quanta of len bytes in buf that are not all the same byte */
+static int bchd_kunit_torn(const char *buf, size_t len, int quantum_size)
+{
+    size_t i;
+    int torn = 0;
+
+    for (i = 0; i < len; i++) {
+        if (buf[i] != buf[i - i % quantum_size]) {
+            torn++;
+            i += quantum_size - 1 - i % quantum_size;
+        }
+    }
+    return torn;
+}
+
+/*
+ * Writers on several threads and snapshots taken meanwhile: every quantum of a
+ * snapshot is one write, and the store ends up with the last round of every writer.
+ */
+static void bchd_kunit_threads_test(struct kunit *test)
+{
+    int quantum_size = 256;
+    struct bchd_dev *dev = bchd_kunit_dev(test, quantum_size, 16, NULL);
+    size_t size = (size_t) BCHD_KUNIT_THREADS * BCHD_KUNIT_QUANTA * quantum_size;
+    struct bchd_kunit_writer *w;
+    struct task_struct *task;
+    struct bchd_store snap;
+    char *buf = bchd_kunit_buf(test, size);
+    int nr, i, snaps = 0;
+    bool done;
+
+    w = kunit_kcalloc(test, BCHD_KUNIT_THREADS, sizeof(*w), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, w);
+    for (nr = 0; nr < BCHD_KUNIT_THREADS; nr++) {
+        w[nr].dev = dev;
+        w[nr].index = nr;
+        w[nr].buf = bchd_kunit_buf(test, quantum_size);
+        init_completion(&w[nr].done);
+        task = kthread_run(bchd_kunit_writer, &w[nr], "bchd-kunit-%d", nr);
+        if (IS_ERR(task)) {
+            break;
+        }
+    }
+
+    do {
+        for (done = true, i = 0; i < nr; i++) {
+            done = done && completion_done(&w[i].done);
+        }
+        __bchd_lock(dev, BCHD_LOCK_SNAP, false);
+        bchd_store_snapshot(&dev->store, &snap);
+        bchd_unlock(dev);
+        KUNIT_EXPECT_EQ(test, bchd_kunit_torn(buf, bchd_kunit_read(dev, &snap, 0, buf, size),
+                                              quantum_size), 0);
+        __bchd_lock(dev, BCHD_LOCK_SNAP, false);
+        bchd_store_trim(&snap);
+        bchd_unlock(dev);
+        snaps++;
+        cond_resched();
+    } while (!done);
+
+    /* They are done before the checks can fail and end the test */
+    for (i = 0; i < nr; i++) {
+        wait_for_completion(&w[i].done);
+    }
+    KUNIT_ASSERT_EQ(test, nr, BCHD_KUNIT_THREADS);
+    kunit_info(test, "%d snapshots taken while writing\n", snaps);
+
+    KUNIT_EXPECT_EQ(test, bchd_kunit_read(dev, &dev->store, 0, buf, size), size);
+    for (i = 0; i < size; i += quantum_size) {
+        KUNIT_EXPECT_EQ_MSG(test, buf[i], bchd_kunit_byte(i / quantum_size / BCHD_KUNIT_QUANTA,
+                                                          BCHD_KUNIT_ROUNDS - 1), "quantum %d",
+                            i / quantum_size);
+    }
+    KUNIT_EXPECT_EQ(test, bchd_kunit_torn(buf, size, quantum_size), 0);
+    bchd_kunit_trim(dev);
+    KUNIT_EXPECT_EQ(test, bchd_stat_sum(dev, BCHD_STAT_QUANTUM_FREES),
+                    bchd_stat_sum(dev, BCHD_STAT_QUANTUM_ALLOCS));
+}
+
+/* Restore a new device from the snapshot file with the prefix */
+static struct bchd_dev * bchd_kunit_restore(struct kunit *test, int quantum_size, int qset_size,
+                                            const struct bchd_kunit_params *p, char *prefix)
+{
+    struct bchd_dev *dev = bchd_kunit_dev(test, quantum_size, qset_size, p);
+    char *snapshot = bchd_snapshot;
+    int result;
+
+    bchd_snapshot = prefix;
+    result = bchd_snapshot_restore(dev, 0);
+    bchd_snapshot = snapshot;
+    KUNIT_ASSERT_EQ(test, result, 0);
+    KUNIT_EXPECT_TRUE(test, dev->snapshot);
+    return dev;
+}
+
+/* Save dev to the snapshot file with the prefix; returns the restored copy */
+static struct bchd_dev * bchd_kunit_save_restore(struct kunit *test, struct bchd_dev *dev,
+                                                 char *prefix)
+{
+    static const struct bchd_kunit_params shmem = { .shmem = true };
+    char *snapshot = bchd_snapshot;
+
+    /* Keeps the tiering work out, which does not run on unload */
+    __bchd_lock(dev, BCHD_LOCK_SNAP, false);
+    bchd_snapshot = prefix;
+    dev->snapshot = true;
+    bchd_snapshot_save(dev, 0);
+    bchd_snapshot = snapshot;
+    bchd_unlock(dev);
+    return bchd_kunit_restore(test, dev->store.quantum_size, dev->store.qset_size,
+                              dev->shmem != NULL ? &shmem : NULL, prefix);
+}
+
+/* Saving a device with holes and restoring it, and restoring without a snapshot */
+static void bchd_kunit_snapshot_test(struct kunit *test)
+{
+    char *prefix = bchd_kunit_prefix(test, "snapshot");
+    int quantum_size = bchd_quantum_size;
+    struct bchd_dev *dev = bchd_kunit_dev(test, quantum_size, bchd_qset_size, NULL);
+    size_t size = 3 * quantum_size + quantum_size / 2;
+    char *model = bchd_kunit_buf(test, size);
+    char *buf = bchd_kunit_buf(test, size);
+    struct bchd_dev *copy;
+    char *path;
+
+    /* The second and third quanta are a hole, the last one ends in the middle */
+    bchd_kunit_text(model, quantum_size, 1);
+    bchd_kunit_text(model + 3 * quantum_size, quantum_size / 2, 2);
+    KUNIT_ASSERT_EQ(test, bchd_kunit_write(dev, 0, model, quantum_size), quantum_size);
+    KUNIT_ASSERT_EQ(test, bchd_kunit_write(dev, 3 * quantum_size, model + 3 * quantum_size,
+                                           quantum_size / 2), quantum_size / 2);
+
+    copy = bchd_kunit_save_restore(test, dev, prefix);
+    KUNIT_EXPECT_EQ(test, copy->store.size, size);
+    KUNIT_EXPECT_EQ(test, bchd_kunit_read(copy, &copy->store, 0, buf, size), size);
+    KUNIT_EXPECT_MEMEQ(test, buf, model, size);
+
+    /* It was renamed into place */
+    path = bchd_kunit_buf(test, PATH_MAX);
+    snprintf(path, PATH_MAX, "%s0.tmp", prefix);
+    KUNIT_EXPECT_EQ(test, bchd_kunit_read_file(path, buf, size), -ENOENT);
+    snprintf(path, PATH_MAX, "%s0", prefix);
+    KUNIT_EXPECT_EQ(test, bchd_kunit_read_file(path, buf, size), size);
+    KUNIT_EXPECT_MEMEQ(test, buf, model, size);
+
+    /* An empty device saves as an empty file */
+    bchd_kunit_trim(dev);
+    copy = bchd_kunit_save_restore(test, dev, prefix);
+    KUNIT_EXPECT_EQ(test, copy->store.size, 0);
+    KUNIT_EXPECT_EQ(test, bchd_kunit_read_file(path, buf, size), 0);
+
+    /* Without a snapshot the device starts empty and is saved on unload */
+    bchd_kunit_unlink(path);
+    copy = bchd_kunit_restore(test, quantum_size, bchd_qset_size, NULL, prefix);
+    KUNIT_EXPECT_EQ(test, copy->store.size, 0);
+}
+
+/* The same with bchd_shmem, through the shmem file */
+static void bchd_kunit_shmem_snapshot_test(struct kunit *test)
+{
+    static const struct bchd_kunit_params p = { .shmem = true };
+    char *prefix = bchd_kunit_prefix(test, "shmem");
+    struct bchd_dev *dev = bchd_kunit_dev(test, bchd_quantum_size, bchd_qset_size, &p);
+    size_t len = PAGE_SIZE, hole = 4 << 20;
+    char *model = bchd_kunit_buf(test, len);
+    char *buf = bchd_kunit_buf(test, len);
+    struct bchd_dev *copy;
+    loff_t off;
+
+    /* A page, a hole of several copied chunks and half a page */
+    bchd_kunit_text(model, len, 3);
+    KUNIT_ASSERT_EQ(test, bchd_kunit_shmem_write(dev, 0, model, len), len);
+    KUNIT_ASSERT_EQ(test, bchd_kunit_shmem_write(dev, len + hole, model, len / 2), len / 2);
+
+    copy = bchd_kunit_save_restore(test, dev, prefix);
+    KUNIT_ASSERT_NOT_NULL(test, copy->shmem);
+    KUNIT_EXPECT_EQ(test, copy->store.size, len + hole + len / 2);
+    off = 0;
+    KUNIT_EXPECT_EQ(test, kernel_read(copy->shmem, buf, len, &off), len);
+    KUNIT_EXPECT_MEMEQ(test, buf, model, len);
+    off = len + hole;
+    KUNIT_EXPECT_EQ(test, kernel_read(copy->shmem, buf, len, &off), len / 2);
+    KUNIT_EXPECT_MEMEQ(test, buf, model, len / 2);
+    /* The chunks of zeros in the hole were not written */
+    KUNIT_EXPECT_LT(test, bchd_shmem_resident(copy), hole);
+
+    /* An empty device saves as an empty file */
+    bchd_kunit_trim(dev);
+    copy = bchd_kunit_save_restore(test, dev, prefix);
+    KUNIT_EXPECT_EQ(test, copy->store.size, 0);
+}
+
+/* Writeback, fsync, truncation and reloading through the backing file */
+static void bchd_kunit_writeback_test(struct kunit *test)
+{
+    struct bchd_kunit_params p = { .backing = bchd_kunit_prefix(test, "backing") };
+    int quantum_size = bchd_quantum_size;
+    struct bchd_dev *dev = bchd_kunit_dev(test, quantum_size, bchd_qset_size, &p);
+    size_t size = 2 * quantum_size + quantum_size / 3;
+    char *model = bchd_kunit_buf(test, size);
+    char *buf = bchd_kunit_buf(test, size);
+    char *path = bchd_kunit_buf(test, PATH_MAX);
+    u64 flushes;
+
+    snprintf(path, PATH_MAX, "%s0", p.backing);
+    KUNIT_ASSERT_NOT_NULL(test, dev->backing.file);
+    KUNIT_EXPECT_EQ(test, dev->store.size, 0);
+
+    /* The second quantum is a hole */
+    bchd_kunit_text(model, quantum_size, 1);
+    bchd_kunit_text(model + 2 * quantum_size, quantum_size / 3, 2);
+    KUNIT_ASSERT_EQ(test, bchd_kunit_write(dev, 0, model, quantum_size), quantum_size);
+    KUNIT_ASSERT_EQ(test, bchd_kunit_write(dev, 2 * quantum_size, model + 2 * quantum_size,
+                                           quantum_size / 3), quantum_size / 3);
+    KUNIT_EXPECT_EQ(test, bchd_backing_fsync(dev, 0), 0);
+    KUNIT_EXPECT_EQ(test, bchd_kunit_read_file(path, buf, size), size);
+    KUNIT_EXPECT_MEMEQ(test, buf, model, size);
+    KUNIT_EXPECT_GT(test, bchd_stat_sum(dev, BCHD_STAT_WRITEBACK_WRITES), 0);
+
+    /* Nothing was written since, so the pass of the last fsync covers the next one */
+    flushes = bchd_stat_sum(dev, BCHD_STAT_FSYNC_FLUSHES);
+    KUNIT_EXPECT_EQ(test, bchd_backing_fsync(dev, 0), 0);
+    KUNIT_EXPECT_EQ(test, bchd_stat_sum(dev, BCHD_STAT_FSYNC_FLUSHES), flushes);
+
+    /* Trimming and writing less truncates the file */
+    bchd_kunit_trim(dev);
+    size = quantum_size / 2;
+    bchd_kunit_text(model, size, 3);
+    KUNIT_ASSERT_EQ(test, bchd_kunit_write(dev, 0, model, size), size);
+    KUNIT_EXPECT_EQ(test, bchd_backing_fsync(dev, 0), 0);
+    KUNIT_EXPECT_EQ(test, bchd_kunit_read_file(path, buf, size), size);
+    KUNIT_EXPECT_MEMEQ(test, buf, model, size);
+
+    /* What is written after the last fsync is written back on unload */
+    KUNIT_ASSERT_EQ(test, bchd_kunit_write(dev, size, model, size), size);
+    memcpy(model + size, model, size);
+    size *= 2;
+    kunit_release_action(test, bchd_kunit_dev_free, dev);
+
+    dev = bchd_kunit_dev(test, quantum_size, bchd_qset_size, &p);
+    KUNIT_EXPECT_EQ(test, dev->store.size, size);
+    KUNIT_EXPECT_EQ(test, bchd_kunit_read(dev, &dev->store, 0, buf, size), size);
+    KUNIT_EXPECT_MEMEQ(test, buf, model, size);
+    KUNIT_EXPECT_GT(test, bchd_stat_sum(dev, BCHD_STAT_FILLS), 0);
+}
+
+/* Drop the files of dev without writing anything back or checkpointing, like a crash */
+static void bchd_kunit_crash(struct bchd_dev *dev)
+{
+    struct bchd_backing *b = &dev->backing;
+
+    cancel_delayed_work_sync(&b->ws);
+    if (b->journal != NULL) {
+        filp_close(b->journal, NULL);
+        b->journal = NULL;
+    }
+    filp_close(b->file, NULL);
+    b->file = NULL;
+    vfree(b->buf);
+    b->buf = NULL;
+    /* Its quanta would be filled from the closed file */
+    bchd_store_trim(&dev->store);
+    dev->init_step = BCHD_INIT_TIER;
+}
+
+/* Replaying the committed transactions of the journal after a crash, but not the tail */
+static void bchd_kunit_journal_test(struct kunit *test)
+{
+    struct bchd_kunit_params p = { .backing = bchd_kunit_prefix(test, "journal"),
+                                   .journal = true };
+    int quantum_size = bchd_quantum_size;
+    struct bchd_dev *dev = bchd_kunit_dev(test, quantum_size, bchd_qset_size, &p);
+    struct bchd_backing *b = &dev->backing;
+    size_t size = 2 * quantum_size + quantum_size / 2;
+    char *model = bchd_kunit_buf(test, size);
+    char *data = bchd_kunit_buf(test, size);
+    char *buf = bchd_kunit_buf(test, size);
+    static const char torn[] = "BCHJ\x01";
+    loff_t pos;
+    int result;
+
+    KUNIT_ASSERT_NOT_NULL(test, b->journal);
+    bchd_kunit_text(model, size, 1);
+    KUNIT_ASSERT_EQ(test, bchd_kunit_write(dev, 0, model, size), size);
+    KUNIT_EXPECT_EQ(test, bchd_backing_fsync(dev, 0), 0);
+    KUNIT_EXPECT_GT(test, bchd_stat_sum(dev, BCHD_STAT_JOURNAL_COMMITS), 0);
+
+    /* A transaction that was not committed when it crashed, and a record torn by the crash */
+    cancel_delayed_work_sync(&b->ws);
+    bchd_kunit_text(data, quantum_size, 2);
+    mutex_lock(&b->lock);
+    bchd_journal_begin(dev);
+    result = bchd_journal_data(dev, 0, data, quantum_size);
+    pos = b->journal_pos;
+    mutex_unlock(&b->lock);
+    KUNIT_ASSERT_EQ(test, result, 0);
+    KUNIT_ASSERT_EQ(test, kernel_write(b->journal, torn, sizeof(torn) - 1, &pos),
+                    (ssize_t) sizeof(torn) - 1);
+    bchd_kunit_crash(dev);
+
+    dev = bchd_kunit_dev(test, quantum_size, bchd_qset_size, &p);
+    KUNIT_EXPECT_EQ(test, dev->store.size, size);
+    KUNIT_EXPECT_EQ(test, bchd_kunit_read(dev, &dev->store, 0, buf, size), size);
+    KUNIT_EXPECT_MEMEQ(test, buf, model, size);
+    KUNIT_EXPECT_EQ(test, i_size_read(file_inode(dev->backing.journal)), 0);
+    KUNIT_EXPECT_GT(test, bchd_stat_sum(dev, BCHD_STAT_CHECKPOINTS), 0);
+}
+
+/* Run a tiering pass over dev and wait for it */
+static void bchd_kunit_tier_pass(struct bchd_dev *dev, bool dedup)
+{
+    bool saved = bchd_dedup;
+
+    bchd_dedup = dedup;
+    mod_delayed_work(bchd_wq, &dev->tier.ws, 0);
+    flush_delayed_work(&dev->tier.ws);
+    bchd_dedup = saved;
+}
+
+/*
+ * Dedup, compression and swap of cold quanta: they move down the tiers, read
+ * back as they were (also when a snapshot is saved) and are copied on write
+ */
+static void bchd_kunit_tier_test(struct kunit *test)
+{
+    static char * const algs[] = { "lzo", "lz4", "deflate" };
+    struct bchd_kunit_params p = { .tier_swap = true, .dedup = true };
+    char *prefix = bchd_kunit_prefix(test, "tier");
+    int quantum_size = bchd_quantum_size;
+    size_t size = 5 * quantum_size + quantum_size / 2;
+    char *model = bchd_kunit_buf(test, size);
+    char *old = bchd_kunit_buf(test, size);
+    char *buf = bchd_kunit_buf(test, size);
+    struct bchd_dev *dev, *copy;
+    struct bchd_store snap;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(algs) && p.compress == NULL; i++) {
+        if (crypto_has_comp(algs[i], 0, 0)) {
+            p.compress = algs[i];
+        }
+    }
+    if (p.compress == NULL) {
+        kunit_info(test, "no compression algorithm, testing dedup and swap only\n");
+    }
+    dev = bchd_kunit_dev(test, quantum_size, 4, &p);
+    if (!dev->store.track_access) {
+        kunit_skip(test, "no tiering with bchd_shmem");
+    }
+
+    /*
+     * Text that compresses, random data that goes to swap, two identical
+     * quanta that are shared, a hole and text that ends in the middle
+     */
+    bchd_kunit_text(model, quantum_size, 1);
+    get_random_bytes(model + quantum_size, quantum_size);
+    bchd_kunit_text(model + 2 * quantum_size, quantum_size, 2);
+    memcpy(model + 3 * quantum_size, model + 2 * quantum_size, quantum_size);
+    bchd_kunit_text(model + 5 * quantum_size, quantum_size / 2, 3);
+    KUNIT_ASSERT_EQ(test, bchd_kunit_write(dev, 0, model, 4 * quantum_size), 4 * quantum_size);
+    KUNIT_ASSERT_EQ(test, bchd_kunit_write(dev, 5 * quantum_size, model + 5 * quantum_size,
+                                           quantum_size / 2), quantum_size / 2);
+
+    for (i = 0; i < BCHD_KUNIT_PASSES; i++) {
+        bchd_kunit_tier_pass(dev, true);
+    }
+    KUNIT_EXPECT_GT(test, bchd_stat_sum(dev, BCHD_STAT_DEDUP_HITS), 0);
+    KUNIT_EXPECT_GT(test, bchd_stat_sum(dev, BCHD_STAT_SWAP_OUTS), 0);
+    if (p.compress != NULL) {
+        KUNIT_EXPECT_GT(test, bchd_stat_sum(dev, BCHD_STAT_COMPRESSIONS), 0);
+    }
+
+    /* Saving copies the compressed and swapped quanta out without moving them */
+    copy = bchd_kunit_save_restore(test, dev, prefix);
+    KUNIT_EXPECT_EQ(test, copy->store.size, size);
+    KUNIT_EXPECT_EQ(test, bchd_kunit_read(copy, &copy->store, 0, buf, size), size);
+    KUNIT_EXPECT_MEMEQ(test, buf, model, size);
+    KUNIT_EXPECT_EQ(test, bchd_stat_sum(dev, BCHD_STAT_SWAP_INS), 0);
+
+    KUNIT_EXPECT_EQ(test, bchd_kunit_read(dev, &dev->store, 0, buf, size), size);
+    KUNIT_EXPECT_MEMEQ(test, buf, model, size);
+    KUNIT_EXPECT_GT(test, bchd_stat_sum(dev, BCHD_STAT_SWAP_INS), 0);
+    if (p.compress != NULL) {
+        KUNIT_EXPECT_GT(test, bchd_stat_sum(dev, BCHD_STAT_DECOMPRESSIONS), 0);
+    }
+
+    /* Writing one of the shared quanta leaves the other alone */
+    bchd_kunit_text(model + 2 * quantum_size, quantum_size / 4, 4);
+    KUNIT_ASSERT_EQ(test, bchd_kunit_write(dev, 2 * quantum_size, model + 2 * quantum_size,
+                                           quantum_size / 4), quantum_size / 4);
+    KUNIT_EXPECT_GT(test, bchd_stat_sum(dev, BCHD_STAT_DEDUP_COWS), 0);
+    KUNIT_EXPECT_EQ(test, bchd_kunit_read(dev, &dev->store, 0, buf, size), size);
+    KUNIT_EXPECT_MEMEQ(test, buf, model, size);
+
+    /*
+     * With a snapshot: the quanta of the list item the write copied stay where they
+     * are, the ones of the list item both share move down the tiers for both
+     */
+    memcpy(old, model, size);
+    __bchd_lock(dev, BCHD_LOCK_SNAP, false);
+    bchd_store_snapshot(&dev->store, &snap);
+    bchd_unlock(dev);
+    bchd_kunit_text(model, quantum_size / 4, 5);
+    KUNIT_ASSERT_EQ(test, bchd_kunit_write(dev, 0, model, quantum_size / 4), quantum_size / 4);
+    for (i = 0; i < BCHD_KUNIT_PASSES + 2; i++) {
+        bchd_kunit_tier_pass(dev, true);
+    }
+    KUNIT_EXPECT_EQ(test, bchd_kunit_read(dev, &snap, 0, buf, size), size);
+    KUNIT_EXPECT_MEMEQ(test, buf, old, size);
+    KUNIT_EXPECT_EQ(test, bchd_kunit_read(dev, &dev->store, 0, buf, size), size);
+    KUNIT_EXPECT_MEMEQ(test, buf, model, size);
+    __bchd_lock(dev, BCHD_LOCK_SNAP, false);
+    bchd_store_trim(&snap);
+    bchd_unlock(dev);
+}
+
+/* The generation, the delta log and no signals without a registered eventfd */
+static void bchd_kunit_gen_test(struct kunit *test)
+{
+    struct bchd_dev *dev = bchd_kunit_dev(test, 100, 10, NULL);
+    struct bchd_changes *c = &dev->changes;
+    char data[50];
+
+    KUNIT_EXPECT_EQ(test, dev->gen, 1);
+    KUNIT_EXPECT_EQ(test, c->since, 1);
+    memset(data, 'x', sizeof(data));
+    KUNIT_ASSERT_EQ(test, bchd_kunit_write(dev, 0, data, sizeof(data)), sizeof(data));
+    KUNIT_ASSERT_EQ(test, bchd_kunit_write(dev, 50, data, sizeof(data)), sizeof(data));
+    KUNIT_EXPECT_EQ(test, dev->gen, 3);
+    KUNIT_ASSERT_EQ(test, bchd_kunit_write(dev, 1000, data, sizeof(data)), sizeof(data));
+    KUNIT_EXPECT_EQ(test, dev->gen, 4);
+
+    if (c->log != NULL && bchd_delta_log >= 2) {
+        /* The second write touches the range of the first one, the third does not */
+        KUNIT_EXPECT_EQ(test, c->nr, 2);
+        KUNIT_EXPECT_EQ(test, c->since, 1);
+        KUNIT_EXPECT_EQ(test, c->log[c->head].start, 0);
+        KUNIT_EXPECT_EQ(test, c->log[c->head].end, 100);
+        KUNIT_EXPECT_EQ(test, c->log[c->head].gen, 3);
+        KUNIT_EXPECT_EQ(test, c->log[(c->head + 1) % bchd_delta_log].start, 1000);
+        KUNIT_EXPECT_EQ(test, c->log[(c->head + 1) % bchd_delta_log].end, 1100);
+    }
+
+    /* A trim changes all of the contents */
+    bchd_kunit_trim(dev);
+    KUNIT_EXPECT_EQ(test, dev->gen, 5);
+    KUNIT_EXPECT_EQ(test, c->nr, 0);
+    KUNIT_EXPECT_EQ(test, c->since, 5);
+
+    KUNIT_EXPECT_TRUE(test, list_empty(&dev->notifiers));
+    KUNIT_EXPECT_EQ(test, bchd_stat_sum(dev, BCHD_STAT_NOTIFIES), 0);
+}
+
+static void bchd_kunit_bench_done(struct kunit *test, const char *name, u64 ops, u64 start)
+{
+    u64 ns = ktime_get_ns() - start;
+
+    kunit_info(test, "%-6s %10llu ops %8llu ns/op\n", name, ops, ops ? div64_u64(ns, ops) : 0);
+}
+
+/* Timing the storage engine with the configured geometry, like bchd_selfbench */
+static void bchd_kunit_bench_test(struct kunit *test)
+{
+    int quantum_size = bchd_quantum_size;
+    struct bchd_dev *dev = bchd_kunit_dev(test, quantum_size, bchd_qset_size, NULL);
+    struct bchd_store *store = &dev->store;
+    u64 nr_quanta = DIV_ROUND_UP(BCHD_KUNIT_BENCH_BYTES, quantum_size);
+    u64 seed = 0x9e3779b97f4a7c15ULL;
+    char *buf = bchd_kunit_buf(test, quantum_size);
+    struct bchd_store snap;
+    struct bchd_pos pos;
+    u64 start, ops;
+    loff_t off;
+    char *quantum;
+
+    /* Nobody else uses the device, so the lock is left out, like in bchd_selfbench */
+    start = ktime_get_ns();
+    for (ops = 0, off = 0; ops < nr_quanta; ops++, off += quantum_size) {
+        bchd_store_locate(store, off, &pos);
+        quantum = bchd_store_quantum(store, &pos, BCHD_QUANTUM_CREATE);
+        KUNIT_ASSERT_NOT_NULL(test, quantum);
+        bchd_kunit_text(quantum, quantum_size, ops);
+        cond_resched();
+    }
+    store->size = nr_quanta * quantum_size;
+    bchd_kunit_bench_done(test, "alloc", ops, start);
+
+    start = ktime_get_ns();
+    for (ops = 0, off = 0; ops < nr_quanta; ops++, off += quantum_size) {
+        bchd_store_locate(store, off, &pos);
+        memcpy(buf, bchd_store_quantum(store, &pos, 0), quantum_size);
+        cond_resched();
+    }
+    bchd_kunit_bench_done(test, "copy", ops, start);
+
+    start = ktime_get_ns();
+    for (ops = 0; ops < BCHD_KUNIT_BENCH_LOOKUPS; ops++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        bchd_store_locate(store, (u32) seed % (u32) store->size, &pos);
+        KUNIT_ASSERT_NOT_NULL(test, bchd_store_quantum(store, &pos, 0));
+        if (ops % 1024 == 0) {
+            cond_resched();
+        }
+    }
+    bchd_kunit_bench_done(test, "lookup", ops, start);
+
+    /* Every quantum and list item is copied once */
+    bchd_store_snapshot(store, &snap);
+    start = ktime_get_ns();
+    for (ops = 0, off = 0; ops < nr_quanta; ops++, off += quantum_size) {
+        bchd_store_locate(store, off, &pos);
+        quantum = bchd_store_quantum(store, &pos, BCHD_QUANTUM_DIRTY);
+        KUNIT_ASSERT_NOT_NULL(test, quantum);
+        quantum[0] = 'x';
+        cond_resched();
+    }
+    bchd_kunit_bench_done(test, "cow", ops, start);
+    KUNIT_EXPECT_EQ(test, bchd_stat_sum(dev, BCHD_STAT_SNAP_COWS), nr_quanta);
+
+    start = ktime_get_ns();
+    bchd_store_trim(&snap);
+    bchd_store_trim(store);
+    bchd_kunit_bench_done(test, "trim", 2 * nr_quanta, start);
+}
+
+/* The tiering passes and the writeback need the workqueue, which bchd_init may not have set up yet */
+static bool bchd_kunit_own_wq;
+
+static int bchd_kunit_init(struct kunit_suite *suite)
+{
+    if (bchd_wq != NULL) {
+        return 0;
+    }
+    bchd_wq = alloc_workqueue("bchd_kunit", 0, 0);
+    if (bchd_wq == NULL) {
+        return -ENOMEM;
+    }
+    bchd_kunit_own_wq = true;
+    return 0;
+}
+
+static void bchd_kunit_exit(struct kunit_suite *suite)
+{
+    if (bchd_kunit_own_wq) {
+        destroy_workqueue(bchd_wq);
+        bchd_wq = NULL;
+        bchd_kunit_own_wq = false;
+    }
+}
+
+static struct kunit_case bchd_kunit_cases[] = {
+    KUNIT_CASE(bchd_kunit_locate_test),
+    KUNIT_CASE(bchd_kunit_quantum_test),
+    KUNIT_CASE(bchd_kunit_cow_test),
+    KUNIT_CASE(bchd_kunit_threads_test),
+    KUNIT_CASE(bchd_kunit_snapshot_test),
+    KUNIT_CASE(bchd_kunit_shmem_snapshot_test),
+    KUNIT_CASE(bchd_kunit_writeback_test),
+    KUNIT_CASE(bchd_kunit_journal_test),
+    KUNIT_CASE(bchd_kunit_tier_test),
+    KUNIT_CASE(bchd_kunit_gen_test),
+    KUNIT_CASE_SLOW(bchd_kunit_bench_test),
+    {}
+};
+
+static struct kunit_suite bchd_kunit_suite = {
+    .name = "bchd",
+    .suite_init = bchd_kunit_init,
+    .suite_exit = bchd_kunit_exit,
+    .test_cases = bchd_kunit_cases,
+};
+kunit_test_suite(bchd_kunit_suite);
@@ -0,0 +1,576 @@
+/*
+ * bchd -- Basic character device
+ *
+ * Inspired by the "scull" driver as described in
+ * "Linux Device Drivers Third Edition" by Corbet et al.
+ *
+ * This is a kernel module that takes user (text) input written to /dev/bchd
+ * and stores it in a dynamic storage. Whenever a user reads from /dev/bchd,
+ * the text data is transferred back to the user.
+ * Furthermore, this module periodically (1 word per sec) writes the stored text data
+ * into the kernel log.
+ */
+
+#include <linux/module.h>       /* Necessary for all modules */
+#include <linux/moduleparam.h>
+#include <linux/init.h>         /* For module_init and module_exit */
+
+#include <linux/kernel.h>       /* container_of */
+#include <linux/types.h>        /* For dev_t */
+#include <linux/kdev_t.h>       /* For MAJOR,MINOR,MKDEV */
+#include <linux/fs.h>           /* For alloc_chrdev_region etc */
+#include <linux/errno.h>
+#include <linux/cdev.h>
+#include <linux/fcntl.h>        /* O_ACCMODE */
+#include <linux/slab.h>         /* kmalloc, kfree */
+#include <linux/uaccess.h>      /* copy_from_user, copy_to_user */
+#include <linux/workqueue.h> 
+#include <linux/jiffies.h>      /* HZ */
+
+#include "bchd.h"
+#include "bchd_ioctl.h"
+
+MODULE_AUTHOR("Christopher Denker");
+MODULE_DESCRIPTION("Basic character device");
+MODULE_LICENSE("GPL");
+
+int bchd_major = BCHD_MAJOR;
+int bchd_minor = 0;
+int bchd_nr_devs = BCHD_NR_DEVS;
+int bchd_quantum_size = BCHD_QUANTUM;
+int bchd_qset_size = BCHD_QSET;
+int bchd_max_word_len = BCHD_MAX_WORD_LEN;
+
+module_param(bchd_major, int, S_IRUGO);
+module_param(bchd_minor, int, S_IRUGO);
+module_param(bchd_nr_devs, int, S_IRUGO);
+module_param(bchd_quantum_size, int, S_IRUGO);
+module_param(bchd_qset_size, int, S_IRUGO);
+module_param(bchd_max_word_len, int, S_IRUGO);
+
+/*
+ * Flags for the shared logger workqueue.
+ * A freezable workqueue is drained on suspend, a power efficient one
+ * lets the scheduler pick a CPU that is already awake (if enabled via
+ * the workqueue.power_efficient kernel parameter).
+ */
+bool bchd_wq_freezable = false;
+bool bchd_wq_power_efficient = false;
+
+module_param(bchd_wq_freezable, bool, S_IRUGO);
+module_param(bchd_wq_power_efficient, bool, S_IRUGO);
+
+/*
+ * Keep the contents of device N in the file <bchd_backing>N (see bchd_backing.c),
+ * written back bchd_writeback_ms after a write.
+ */
+char *bchd_backing;
+int bchd_writeback_ms = 1000;
+
+module_param(bchd_backing, charp, S_IRUGO);
+module_param(bchd_writeback_ms, int, S_IRUGO);
+
+/*
+ * With bchd_backing, write back through a journal (see bchd_journal.c),
+ * applied to the backing file once it has grown past bchd_checkpoint_mb.
+ */
+bool bchd_journal = false;
+int bchd_checkpoint_mb = 64;
+
+module_param(bchd_journal, bool, S_IRUGO);
+module_param(bchd_checkpoint_mb, int, S_IRUGO);
+
+/*
+ * Save the contents of device N to the file <bchd_snapshot>N on unload
+ * and restore them on load (see bchd_snapshot.c)
+ */
+char *bchd_snapshot;
+
+module_param(bchd_snapshot, charp, S_IRUGO);
+
+/* Keep the data in shmem files, which can be swapped, see bchd_shmem.c */
+bool bchd_shmem = false;
+
+module_param(bchd_shmem, bool, S_IRUGO);
+
+/*
+ * Move quanta nobody used for bchd_tier_ms to a cheaper tier (see bchd_tier.c):
+ * compress them with this algorithm of the crypto API, e.g. lz4 (see bchd_compress.c),
+ * and/or move them to a swappable shmem file
+ */
+char *bchd_compress;
+bool bchd_tier_swap = false;
+int bchd_tier_ms = 10000;
+
+module_param(bchd_compress, charp, S_IRUGO);
+module_param(bchd_tier_swap, bool, S_IRUGO);
+module_param(bchd_tier_ms, int, S_IRUGO);
+
+/* Share identical cold quanta of all devices, see bchd_dedup.c */
+bool bchd_dedup = false;
+
+module_param(bchd_dedup, bool, S_IRUGO);
+
+/* How many changes of the contents each device remembers for BCHD_IOC_DELTA, see bchd_gen.c */
+int bchd_delta_log = 1024;
+
+module_param(bchd_delta_log, int, S_IRUGO);
+
+/*
+ * Replace the contents when a write-only open is closed instead of emptying the device,
+ * see bchd_replace.c
+ */
+bool bchd_replace = false;
+
+module_param(bchd_replace, bool, S_IRUGO);
+
+/* Benchmark the storage engine at load time, see bchd_selfbench.c */
+bool bchd_bench = false;
+
+module_param(bchd_bench, bool, S_IRUGO);
+
+struct bchd_dev *bchd_devices; /* allocated in bchd_init */
+
+/*
+ * All devices queue their logger work on this workqueue.
+ * It is unbound, so the work is not pinned to the CPU that queued it,
+ * and it is created with WQ_SYSFS, so the CPUs it may run on can be
+ * restricted through /sys/devices/virtual/workqueue/bchd_logger/cpumask.
+ */
+struct workqueue_struct *bchd_wq;
+
+
+/*
+ * Empty out the bchd device.
+ *
+ * NOTE:
+ *  -- Device semaphore must be held
+ *  -- We assume dev != NULL
+ */
+void bchd_trim(struct bchd_dev *dev)
+{
+    bchd_store_trim(&dev->store);
+    bchd_tier_trim(dev);
+    bchd_shmem_trim(dev);
+    bchd_backing_trim(dev);
+    dev->log_pos = 0;
+    bchd_gen_bump(dev);
+}
+
+int bchd_open(struct inode *inode, struct file *filp)
+{
+    struct bchd_dev *dev;
+
+    /*
+     * The i_cdev field of inode contains the cdev structure we set up before.
+     * However, we want the bchd_dev struct that contains this cdev struct.
+     */
+    dev = container_of(inode->i_cdev, struct bchd_dev, cdev);
+
+    /* We use this in bchd_read and bchd_write to obtain the bchd_dev struct. */
+    filp->private_data = dev;
+    bchd_stat_inc(dev->stats, BCHD_STAT_OPENS);
+
+    /*
+     * Trim the length of the device to 0 if open was write only.
+     * We do this since overwriting a bchd device with a shorter file
+     * results in a shorter device data area.
+     * This does nothing if the device is opened for reading.
+     * With bchd_replace, the new contents replace the old ones on close instead.
+     */
+    if ( (filp->f_flags & O_ACCMODE) == O_WRONLY) {
+        if (bchd_replace && dev->shmem == NULL && dev->backing.file == NULL) {
+            return bchd_replace_open(dev, filp);
+        }
+        if (bchd_lock(dev, BCHD_LOCK_OPEN)) {
+            return -ERESTARTSYS;
+        }
+        bchd_trim(dev);
+        bchd_unlock(dev);
+    }
+
+    return 0;
+}
+
+int bchd_release(struct inode *inode, struct file *filp)
+{
+    struct bchd_dev *dev = filp->private_data;
+
+    bchd_notify_release(dev, filp);
+    bchd_stat_inc(dev->stats, BCHD_STAT_RELEASES);
+    return 0;
+}
+
+ssize_t bchd_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+{
+    struct bchd_dev *dev = filp->private_data;
+    ssize_t retval;
+    u64 start = ktime_get_ns();
+
+    bchd_stat_inc(dev->stats, BCHD_STAT_READS);
+    if (dev->shmem != NULL) {
+        retval = bchd_shmem_read(dev, buf, count, f_pos);
+        bchd_lat_record(dev->stats, BCHD_LAT_READ, start);
+        return retval;
+    }
+    if (bchd_lock(dev, BCHD_LOCK_READ)) {
+        return -ERESTARTSYS;
+    }
+    retval = bchd_store_read(&dev->store, buf, count, f_pos);
+    bchd_unlock(dev);
+    bchd_lat_record(dev->stats, BCHD_LAT_READ, start);
+    return retval;
+}
+
+ssize_t bchd_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
+{
+    struct bchd_dev *dev = filp->private_data;
+    ssize_t retval;
+    u64 start = ktime_get_ns();
+
+    bchd_stat_inc(dev->stats, BCHD_STAT_WRITES);
+    if (bchd_lock(dev, BCHD_LOCK_WRITE)) {
+        return -ERESTARTSYS;
+    }
+    if (dev->shmem != NULL) {
+        retval = bchd_shmem_write(dev, buf, count, f_pos);
+    } else {
+        retval = bchd_store_write(&dev->store, buf, count, f_pos);
+    }
+    if (retval > 0) {
+        bchd_backing_dirty(dev);
+        bchd_gen_write(dev, *f_pos - retval, retval);
+    }
+    bchd_unlock(dev);
+    bchd_lat_record(dev->stats, BCHD_LAT_WRITE, start);
+    return retval;
+}
+
+/* Seek like in a file of the size of the device */
+loff_t bchd_llseek(struct file *filp, loff_t offset, int whence)
+{
+    struct bchd_dev *dev = filp->private_data;
+
+    return generic_file_llseek_size(filp, offset, whence, MAX_LFS_FILESIZE,
+                                    READ_ONCE(dev->store.size));
+}
+
+/* Make the contents durable in the backing file, if there is one (see bchd_backing.c) */
+int bchd_fsync(struct file *filp, loff_t start, loff_t end, int datasync)
+{
+    struct bchd_dev *dev = filp->private_data;
+
+    return bchd_backing_fsync(dev, datasync);
+}
+
+/*
+ * Only the shmem files can be mapped and spliced from (see bchd_shmem.c),
+ * besides the status page of every device (see bchd_status.c)
+ */
+int bchd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct bchd_dev *dev = filp->private_data;
+
+    if (vma->vm_pgoff == BCHD_STATUS_OFF >> PAGE_SHIFT) {
+        return bchd_status_mmap(dev, vma);
+    }
+    if (dev->shmem == NULL) {
+        return -ENODEV;
+    }
+    return bchd_shmem_mmap(dev, vma);
+}
+
+ssize_t bchd_splice_read(struct file *filp, loff_t *ppos, struct pipe_inode_info *pipe,
+                         size_t len, unsigned int flags)
+{
+    struct bchd_dev *dev = filp->private_data;
+
+    if (dev->shmem == NULL) {
+        return -EINVAL;
+    }
+    bchd_stat_inc(dev->stats, BCHD_STAT_READS);
+    return bchd_shmem_splice_read(dev, ppos, pipe, len, flags);
+}
+
+/* The ioctls of dev through filp, which may be a file of bchd_replace.c, too */
+long bchd_dev_ioctl(struct bchd_dev *dev, struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    switch (cmd) {
+    case BCHD_IOC_SNAP:
+        return bchd_snap_create(dev);
+    case BCHD_IOC_GEN:
+        return bchd_gen_get(dev, (u64 __user *) arg);
+    case BCHD_IOC_CREAD:
+        return bchd_gen_cread(dev, (struct bchd_cread __user *) arg);
+    case BCHD_IOC_DELTA:
+        return bchd_gen_delta(dev, (struct bchd_delta __user *) arg);
+    case BCHD_IOC_NOTIFY:
+        return bchd_notify_ioctl(dev, filp, (struct bchd_notify __user *) arg);
+    default:
+        return -ENOTTY;
+    }
+}
+
+long bchd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    return bchd_dev_ioctl(filp->private_data, filp, cmd, arg);
+}
+
+struct file_operations bchd_fops = {
+    .owner = THIS_MODULE, /* used to prevent module from being unloaded while in use */
+    .llseek = bchd_llseek,
+    .read = bchd_read,
+    .write = bchd_write,
+    .fsync = bchd_fsync,
+    .mmap = bchd_mmap,
+    .splice_read = bchd_splice_read,
+    .unlocked_ioctl = bchd_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+    .open = bchd_open,
+    .release = bchd_release,
+};
+
+/* Set up char device structure for this device */
+static int bchd_setup_cdev(struct bchd_dev *dev, int index)
+{
+    int err;
+    dev_t devno = MKDEV(bchd_major, bchd_minor + index);
+
+    cdev_init(&dev->cdev, &bchd_fops);
+    dev->cdev.owner = THIS_MODULE;
+    dev->cdev.ops = &bchd_fops;
+    err = cdev_add(&dev->cdev, devno, 1);
+    if (err) {
+        printk(KERN_NOTICE "Error %d adding bchd%d", err, index);
+    }
+    return err;
+}
+
+static void bchd_cleanup(void)
+{
+    dev_t dev = MKDEV(bchd_major, bchd_minor);
+    int i;
+
+    /*
+     * Stop the loggers and write back the backing files
+     * before the work items and their queue go away
+     */
+    if (bchd_devices != NULL && bchd_wq != NULL) {
+        for (i = 0; i < bchd_nr_devs; i++) {
+            struct bchd_dev *bdev = &bchd_devices[i];
+
+            if (bdev->init_step >= BCHD_INIT_STATS) {
+                cancel_delayed_work_sync(&bdev->ws_logger);
+            }
+            if (bdev->init_step >= BCHD_INIT_TIER) {
+                bchd_tier_stop(bdev);
+            }
+            if (bdev->init_step >= BCHD_INIT_BACKING) {
+                bchd_backing_exit(bdev);
+            }
+        }
+    }
+    if (bchd_wq != NULL) {
+        destroy_workqueue(bchd_wq);
+    }
+
+    /* The debugfs files refer to the devices, so remove them first */
+    bchd_debugfs_exit();
+
+    /* get rid of char dev entries */
+    if (bchd_devices != NULL) {
+        for (i = 0; i < bchd_nr_devs; i++) {
+            struct bchd_dev *bdev = &bchd_devices[i];
+
+            if (bdev->init_step == BCHD_INIT_NONE) {
+                continue; /* never initialized */
+            }
+            if (bdev->init_step >= BCHD_INIT_CDEV) {
+                cdev_del(&bdev->cdev);
+            }
+            /* A snapshot that was not restored completely must not be overwritten */
+            if (bdev->init_step >= BCHD_INIT_SNAPSHOT) {
+                bchd_snapshot_save(bdev, i);
+            }
+            bchd_trim(bdev);
+            if (bdev->init_step >= BCHD_INIT_STATUS) {
+                bchd_status_exit(bdev);
+            }
+            if (bdev->init_step >= BCHD_INIT_SHMEM) {
+                bchd_shmem_exit(bdev);
+            }
+            if (bdev->init_step >= BCHD_INIT_TIER) {
+                bchd_tier_exit(bdev);
+            }
+            if (bdev->init_step >= BCHD_INIT_GEN) {
+                bchd_gen_exit(bdev);
+            }
+            free_percpu(bdev->stats);
+        }
+        kfree(bchd_devices);
+    }
+
+    /* bchd_cleanup is never called if registering failed */
+    unregister_chrdev_region(dev, bchd_nr_devs);
+
+    printk(KERN_INFO "bchd: MODULE EXIT\n");
+}
+
+/*
+ * Read the next word starting from dev->log_pos from the device
+ * and write it into the kernel log (see bchd_store_next_word).
+ * Only up to BCHD_MAX_WORD_LEN characters are examined.
+ */
+static void bchd_log_word(struct work_struct *ws)
+{
+    struct bchd_dev *dev = container_of(ws, struct bchd_dev, ws_logger.work);
+    char word[BCHD_MAX_WORD_LEN];
+    int len = min_t(int, dev->max_word_len, sizeof(word));
+    unsigned long delay;
+    u64 start = ktime_get_ns();
+
+    if (bchd_lock(dev, BCHD_LOCK_LOGGER)) {
+        goto out_unlocked;
+    }
+    if (dev->store.size == 0) {
+        printk(KERN_INFO "bchd: no text stored in /dev/bchd%d\n",
+               MINOR(dev->cdev.dev) - bchd_minor);
+    } else if ((dev->shmem != NULL ? bchd_shmem_next_word(dev, &dev->log_pos, word, len)
+                : bchd_store_next_word(&dev->store, &dev->log_pos, word, len)) >= 0) {
+        /* Write the word string into the kernel log */
+        printk(KERN_INFO "bchd%d: %s\n", MINOR(dev->cdev.dev) - bchd_minor, word);
+        bchd_stat_inc(dev->stats, BCHD_STAT_LOGGED_WORDS);
+    }
+
+    bchd_status_publish(dev, false);
+
+    /* Reschedule work in the work queue */
+    delay = HZ; /* One second */
+    queue_delayed_work(bchd_wq, &dev->ws_logger, delay);
+    bchd_unlock(dev);
+out_unlocked:
+    bchd_lat_record(dev->stats, BCHD_LAT_LOGGER, start);
+}
+
+static int __init bchd_init(void)
+{
+    int result, i;
+    dev_t dev = 0;
+    unsigned int wq_flags = WQ_UNBOUND | WQ_SYSFS;
+    unsigned long delay;
+
+    if (bchd_nr_devs <= 0) {
+        printk(KERN_WARNING "bchd: bchd_nr_devs must be at least 1, not %d\n", bchd_nr_devs);
+        return -EINVAL;
+    }
+
+    /* Obtain device numbers */
+    result = alloc_chrdev_region(&dev, bchd_minor, bchd_nr_devs, "bchd");
+    bchd_major = MAJOR(dev);
+    if (result < 0) {
+        printk(KERN_WARNING "bchd: can't get major %d\n", bchd_major);
+        return result;
+    }
+
+    /* One logger workqueue for all devices */
+    if (bchd_wq_freezable) {
+        wq_flags |= WQ_FREEZABLE;
+    }
+    if (bchd_wq_power_efficient) {
+        wq_flags |= WQ_POWER_EFFICIENT;
+    }
+    bchd_wq = alloc_workqueue("bchd_logger", wq_flags, 0);
+    if (bchd_wq == NULL) {
+        printk(KERN_WARNING "bchd: failed to create bchd_logger workqueue\n");
+        result = -ENOMEM;
+        goto fail;
+    }
+
+    /* Allocate the devices */
+    bchd_devices = kcalloc(bchd_nr_devs, sizeof(*bchd_devices), GFP_KERNEL);
+    if (bchd_devices == NULL) {
+        result = -ENOMEM;
+        goto fail;
+    }
+
+    bchd_debugfs_init();
+
+    /* Measure the storage engine before the devices go live; the module works without */
+    if (bchd_bench) {
+        result = bchd_selfbench();
+        if (result < 0) {
+            printk(KERN_WARNING "bchd: selfbench failed: %d\n", result);
+        }
+    }
+
+    /* Initialize each device */
+    delay = HZ; /* One second ... HZ denotes the jiffies per second*/
+    for (i = 0; i < bchd_nr_devs; i++) {
+        struct bchd_dev *bdev = &bchd_devices[i];
+
+        bdev->stats = alloc_percpu(struct bchd_stats);
+        if (bdev->stats == NULL) {
+            result = -ENOMEM;
+            goto fail;
+        }
+        /* What cleanup needs of every device that got this far */
+        mutex_init(&bdev->lock);
+        INIT_DELAYED_WORK(&bdev->ws_logger, bchd_log_word);
+        bchd_store_init(&bdev->store, bchd_quantum_size, bchd_qset_size, bdev->stats);
+        bchd_notify_init(bdev);
+        bdev->max_word_len = bchd_max_word_len;
+        bdev->log_pos = 0;
+        bdev->init_step = BCHD_INIT_STATS;
+
+        result = bchd_gen_init(bdev);
+        if (result < 0) {
+            goto fail;
+        }
+        bdev->init_step = BCHD_INIT_GEN;
+        result = bchd_tier_init(bdev, i);
+        if (result < 0) {
+            goto fail;
+        }
+        bdev->init_step = BCHD_INIT_TIER;
+        result = bchd_shmem_init(bdev, i);
+        if (result < 0) {
+            goto fail;
+        }
+        bdev->init_step = BCHD_INIT_SHMEM;
+        result = bchd_backing_init(bdev, i);
+        if (result < 0) {
+            goto fail;
+        }
+        bdev->init_step = BCHD_INIT_BACKING;
+        result = bchd_snapshot_restore(bdev, i);
+        if (result < 0) {
+            goto fail;
+        }
+        bdev->init_step = BCHD_INIT_SNAPSHOT;
+        result = bchd_status_init(bdev);
+        if (result < 0) {
+            goto fail;
+        }
+        bdev->init_step = BCHD_INIT_STATUS;
+        result = bchd_setup_cdev(bdev, i);
+        if (result < 0) {
+            goto fail;
+        }
+        bdev->init_step = BCHD_INIT_CDEV;
+        bchd_debugfs_add_dev(bdev, i);
+
+        /* Each second a word from the stored text data is written into the kernel log */
+        queue_delayed_work(bchd_wq, &bdev->ws_logger, delay);
+    }
+
+    printk(KERN_INFO "bchd: MODULE INIT -- device major: %d; device minors: %d-%d\n",
+           MAJOR(dev), MINOR(dev), MINOR(dev) + bchd_nr_devs - 1);
+    return 0;   /* success */
+
+fail:
+    bchd_cleanup();
+    return result;
+}
+
+module_init(bchd_init);
+module_exit(bchd_cleanup);
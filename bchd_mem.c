@@ -0,0 +1,293 @@
+/*
+ * bchd_mem -- kernel memory counters around writes to /dev/bchd
+ *
+ * Writes payloads of the given sizes into an empty device and reports how
+ * the memory counters of the kernel changed, read before and after each write:
+ *  -- MemFree and Slab of /proc/meminfo (all memory, including the page allocator,
+ *     which kmalloc uses for requests larger than its biggest cache),
+ *  -- the pages of the kmalloc-* slab caches and the bytes of their objects
+ *     (/proc/slabinfo, needs root),
+ *  -- the allocation counters and mem_bytes of the debugfs stats file
+ *     of the device, if it has one (bchd_simple has none).
+ * Only the debugfs counters belong to the device; the others are system wide,
+ * so they are what the payload cost only if nothing else allocated meanwhile.
+ * Small payloads are best judged by the allocation counters.
+ * The device has to be a character device that opening O_WRONLY empties,
+ * like bchd and bchd_simple; a regular file is refused.
+ *
+ * The geometry is a load time parameter, so compare geometries
+ * (and bchd_simple) by reloading the module between runs, see README.md.
+ *
+ * Usage: see bchd_mem -h
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define MEM_MAX_LIST 16
+
+/* The debugfs counters we report the change of */
+enum mem_stat { QUANTUM_ALLOCS, QSET_ALLOCS, PTRS_ALLOCS, MEM_BYTES, NR_MEM_STATS };
+
+static const char * const mem_stat_names[NR_MEM_STATS] = {
+    "quantum_allocs", "qset_allocs", "ptrs_allocs", "mem_bytes",
+};
+
+struct mem_counters {
+    long long mem_free;         /* bytes */
+    long long slab;             /* bytes */
+    long long kmalloc_pages;    /* bytes of the pages of the kmalloc caches, -1 if unknown */
+    long long kmalloc_objs;     /* bytes of the objects in them, -1 if unknown */
+    long long stat[NR_MEM_STATS];       /* -1 if unknown */
+};
+
+static const char *device = "/dev/bchd";
+static const char *debugfs = "/sys/kernel/debug/bchd/bchd0";
+
+static long long meminfo(const char *name)
+{
+    char line[256];
+    long long kb = -1;
+    size_t len = strlen(name);
+    FILE *f = fopen("/proc/meminfo", "r");
+
+    if (f == NULL) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (strncmp(line, name, len) == 0 && line[len] == ':') {
+            kb = strtoll(line + len + 1, NULL, 10);
+            break;
+        }
+    }
+    fclose(f);
+    return kb < 0 ? -1 : kb * 1024;
+}
+
+static void read_counters(struct mem_counters *c)
+{
+    long long active, objsize, pages_per_slab, slabs;
+    long page_size = sysconf(_SC_PAGESIZE);
+    char line[512], name[64], path[256];
+    FILE *f;
+    int i;
+
+    sync();
+    c->mem_free = meminfo("MemFree");
+    c->slab = meminfo("Slab");
+
+    c->kmalloc_pages = c->kmalloc_objs = -1;
+    f = fopen("/proc/slabinfo", "r");
+    if (f != NULL) {
+        c->kmalloc_pages = c->kmalloc_objs = 0;
+        while (fgets(line, sizeof(line), f) != NULL) {
+            /* name active_objs num_objs objsize objperslab pagesperslab : tunables ... : slabdata active num ... */
+            if (sscanf(line, "%63s %lld %*d %lld %*d %lld : tunables %*d %*d %*d : slabdata %*d %lld",
+                       name, &active, &objsize, &pages_per_slab, &slabs) == 5
+                && strncmp(name, "kmalloc-", 8) == 0) {
+                c->kmalloc_pages += slabs * pages_per_slab * page_size;
+                c->kmalloc_objs += active * objsize;
+            }
+        }
+        fclose(f);
+    }
+
+    for (i = 0; i < NR_MEM_STATS; i++) {
+        c->stat[i] = -1;
+    }
+    snprintf(path, sizeof(path), "%s/stats", debugfs);
+    f = fopen(path, "r");
+    if (f != NULL) {
+        long long value;
+
+        while (fgets(line, sizeof(line), f) != NULL) {
+            if (sscanf(line, "%63s %lld", name, &value) != 2) {
+                continue;
+            }
+            for (i = 0; i < NR_MEM_STATS; i++) {
+                if (strcmp(name, mem_stat_names[i]) == 0) {
+                    c->stat[i] = value;
+                }
+            }
+        }
+        fclose(f);
+    }
+}
+
+/* Open the device O_WRONLY, which empties it, and write bytes of text */
+static int write_payload(size_t bytes)
+{
+    static const char text[] = "Write in C, write in C, everything is fine.\n";
+    static char buf[65536];
+    size_t done = 0, i;
+    ssize_t ret;
+    int fd;
+
+    for (i = 0; i < sizeof(buf); i++) {
+        buf[i] = text[i % (sizeof(text) - 1)];
+    }
+    fd = open(device, O_WRONLY);
+    if (fd < 0) {
+        return -errno;
+    }
+    while (done < bytes) {
+        ret = write(fd, buf, bytes - done < sizeof(buf) ? bytes - done : sizeof(buf));
+        if (ret <= 0) {
+            close(fd);
+            return ret < 0 ? -errno : -EIO;
+        }
+        done += ret;
+    }
+    close(fd);
+    return 0;
+}
+
+/* Print "name": value, or null if either counter is unknown */
+static void print_delta(const char *name, long long before, long long after)
+{
+    if (before < 0 || after < 0) {
+        printf(", \"%s\": null", name);
+    } else {
+        printf(", \"%s\": %lld", name, after - before);
+    }
+}
+
+static long read_param(const char *module, const char *param)
+{
+    char path[256];
+    long n = -1;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/sys/module/%s/parameters/%s", module, param);
+    f = fopen(path, "r");
+    if (f != NULL) {
+        if (fscanf(f, "%ld", &n) != 1) {
+            n = -1;
+        }
+        fclose(f);
+    }
+    return n;
+}
+
+static int parse_sizes(char *s, size_t *sizes)
+{
+    char *tok, *end;
+    int n = 0;
+
+    for (tok = strtok(s, ","); tok != NULL && n < MEM_MAX_LIST; tok = strtok(NULL, ",")) {
+        sizes[n] = strtoull(tok, &end, 0);
+        switch (*end) {
+        case 'k': case 'K':
+            sizes[n] <<= 10;
+            break;
+        case 'm': case 'M':
+            sizes[n] <<= 20;
+            break;
+        case 'g': case 'G':
+            sizes[n] <<= 30;
+            break;
+        }
+        if (sizes[n] == 0) {
+            return -1;
+        }
+        n++;
+    }
+    return n;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-d device] [-l debugfs dir] [-s payload sizes]\n"
+            "  -d  device to test (default /dev/bchd)\n"
+            "  -l  debugfs directory of the device (default /sys/kernel/debug/bchd/bchd0)\n"
+            "  -s  payload sizes, e.g. 1,4k,1m,1g (default 1,1k,4000,64k,1m,64m)\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    size_t sizes[MEM_MAX_LIST] = { 1, 1024, 4000, 65536, 1 << 20, 64 << 20 };
+    int nr_sizes = 6, opt, i, s, ret;
+    struct mem_counters before, after;
+    struct stat st;
+    long long cost;
+
+    while ((opt = getopt(argc, argv, "d:l:s:h")) != -1) {
+        switch (opt) {
+        case 'd':
+            device = optarg;
+            break;
+        case 'l':
+            debugfs = optarg;
+            break;
+        case 's':
+            nr_sizes = parse_sizes(optarg, sizes);
+            if (nr_sizes <= 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return opt != 'h';
+        }
+    }
+
+    /* Opening anything else O_WRONLY does not empty it, and it does not allocate like a device */
+    if (stat(device, &st) < 0) {
+        fprintf(stderr, "%s: %s\n", device, strerror(errno));
+        return 1;
+    }
+    if (!S_ISCHR(st.st_mode)) {
+        fprintf(stderr, "%s: not a character device\n", device);
+        return 1;
+    }
+
+    if (read_param("bchd", "bchd_quantum_size") > 0) {
+        printf("{\"device\": \"%s\", \"backend\": \"qset list\", \"quantum_size\": %ld, "
+               "\"qset_size\": %ld, \"payloads\": [\n", device,
+               read_param("bchd", "bchd_quantum_size"), read_param("bchd", "bchd_qset_size"));
+    } else if (read_param("bchd_simple", "bchd_buf_size") > 0) {
+        printf("{\"device\": \"%s\", \"backend\": \"bchd_simple\", \"buf_size\": %ld, "
+               "\"payloads\": [\n", device, read_param("bchd_simple", "bchd_buf_size"));
+    } else {
+        printf("{\"device\": \"%s\", \"backend\": \"unknown\", \"payloads\": [\n", device);
+    }
+
+    for (s = 0; s < nr_sizes; s++) {
+        /* Empty the device, so the first counters see no data */
+        ret = write_payload(0);
+        if (ret == 0) {
+            read_counters(&before);
+            ret = write_payload(sizes[s]);
+        }
+        if (ret < 0) {
+            fprintf(stderr, "%s: %s\n", device, strerror(-ret));
+            return 1;
+        }
+        read_counters(&after);
+
+        cost = before.mem_free - after.mem_free;
+        printf("%s  {\"payload\": %zu, \"mem_free_drop\": %lld, \"overhead_ratio\": %.3f",
+               s ? ",\n" : "", sizes[s], cost, (double) cost / sizes[s]);
+        print_delta("slab_bytes", before.slab, after.slab);
+        print_delta("kmalloc_page_bytes", before.kmalloc_pages, after.kmalloc_pages);
+        print_delta("kmalloc_obj_bytes", before.kmalloc_objs, after.kmalloc_objs);
+        for (i = 0; i < NR_MEM_STATS; i++) {
+            print_delta(mem_stat_names[i], before.stat[i], after.stat[i]);
+        }
+        printf("}");
+    }
+    printf("\n]}\n");
+
+    /* Leave the device empty */
+    write_payload(0);
+    return 0;
+}
@@ -0,0 +1,149 @@
+/*
+ * bchd_notify.c -- eventfd notifications of changes
+ *
+ * With the BCHD_IOC_NOTIFY ioctl (see bchd_ioctl.h), an open file of a device
+ * registers an eventfd, which is signaled whenever the contents change, that
+ * is whenever the generation is bumped (see bchd_gen.c): by a write, a trim or
+ * a replacement of the contents. Consumers with an event loop can wait for
+ * changes this way instead of keeping a thread blocked per device.
+ *
+ * With a coalescing interval, the first change queues a delayed work on bchd_wq
+ * that signals the eventfd once after the interval. Further changes meanwhile
+ * find the work queued already, so a burst of writes makes one wakeup.
+ *
+ * Each open file has at most one eventfd registered; registering another one
+ * replaces it, and closing the file drops it. The list of the registered ones
+ * is protected by the device lock.
+ */
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/eventfd.h>
+#include <linux/fs.h>
+#include <linux/jiffies.h>
+#include <linux/list.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/workqueue.h>
+
+#include "bchd.h"
+#include "bchd_ioctl.h"
+
+struct bchd_notifier {
+    struct list_head node;      /* in dev->notifiers */
+    struct bchd_dev *dev;
+    struct file *owner;         /* the open file that registered it */
+    struct eventfd_ctx *ctx;
+    unsigned long delay;        /* the coalescing interval in jiffies, 0 for none */
+    struct delayed_work ws;     /* signals ctx at the end of the interval */
+};
+
+static void bchd_notify_work(struct work_struct *ws)
+{
+    struct bchd_notifier *n = container_of(ws, struct bchd_notifier, ws.work);
+
+    eventfd_signal(n->ctx);
+    bchd_stat_inc(n->dev->stats, BCHD_STAT_NOTIFIES);
+}
+
+/* Free a notifier that is not on the list anymore */
+static void bchd_notifier_free(struct bchd_notifier *n)
+{
+    cancel_delayed_work_sync(&n->ws);
+    eventfd_ctx_put(n->ctx);
+    kfree(n);
+}
+
+/* Take the notifier of filp (if any) off the list; called with the device lock held */
+static struct bchd_notifier * bchd_notifier_remove(struct bchd_dev *dev, struct file *filp)
+{
+    struct bchd_notifier *n;
+
+    list_for_each_entry(n, &dev->notifiers, node) {
+        if (n->owner == filp) {
+            list_del(&n->node);
+            return n;
+        }
+    }
+    return NULL;
+}
+
+void bchd_notify_init(struct bchd_dev *dev)
+{
+    INIT_LIST_HEAD(&dev->notifiers);
+}
+
+/* The contents changed; called with the device lock held */
+void bchd_notify(struct bchd_dev *dev)
+{
+    struct bchd_notifier *n;
+
+    list_for_each_entry(n, &dev->notifiers, node) {
+        if (n->delay == 0) {
+            eventfd_signal(n->ctx);
+            bchd_stat_inc(dev->stats, BCHD_STAT_NOTIFIES);
+        } else {
+            /* Does nothing if it is queued already: that is the coalescing */
+            queue_delayed_work(bchd_wq, &n->ws, n->delay);
+        }
+    }
+}
+
+/* BCHD_IOC_NOTIFY */
+long bchd_notify_ioctl(struct bchd_dev *dev, struct file *filp, struct bchd_notify __user *argp)
+{
+    struct bchd_notify arg;
+    struct bchd_notifier *n = NULL, *old;
+    struct eventfd_ctx *ctx;
+
+    if (copy_from_user(&arg, argp, sizeof(arg))) {
+        return -EFAULT;
+    }
+    if (arg.fd >= 0) {
+        ctx = eventfd_ctx_fdget(arg.fd);
+        if (IS_ERR(ctx)) {
+            return PTR_ERR(ctx);
+        }
+        n = kzalloc(sizeof(*n), GFP_KERNEL);
+        if (n == NULL) {
+            eventfd_ctx_put(ctx);
+            return -ENOMEM;
+        }
+        n->dev = dev;
+        n->owner = filp;
+        n->ctx = ctx;
+        n->delay = arg.coalesce_ms > 0 ? msecs_to_jiffies(arg.coalesce_ms) : 0;
+        INIT_DELAYED_WORK(&n->ws, bchd_notify_work);
+    }
+
+    if (bchd_lock(dev, BCHD_LOCK_NOTIFY)) {
+        if (n != NULL) {
+            bchd_notifier_free(n);
+        }
+        return -ERESTARTSYS;
+    }
+    old = bchd_notifier_remove(dev, filp);
+    if (n != NULL) {
+        list_add_tail(&n->node, &dev->notifiers);
+    }
+    bchd_unlock(dev);
+
+    if (old != NULL) {
+        bchd_notifier_free(old);
+    }
+    return 0;
+}
+
+/* filp is closed: drop its notifier */
+void bchd_notify_release(struct bchd_dev *dev, struct file *filp)
+{
+    struct bchd_notifier *n;
+
+    /* Not interruptible: the notifier would leak */
+    __bchd_lock(dev, BCHD_LOCK_NOTIFY, false);
+    n = bchd_notifier_remove(dev, filp);
+    bchd_unlock(dev);
+    if (n != NULL) {
+        bchd_notifier_free(n);
+    }
+}
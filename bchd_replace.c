@@ -0,0 +1,161 @@
+/*
+ * bchd_replace.c -- replacing the contents of a device on close
+ *
+ * Opening a device write-only empties it (see bchd_open), so readers see an
+ * empty or partly written device until the writer is done. With bchd_replace=1,
+ * a write-only open leaves the device alone instead: the writes go to a shadow
+ * store of the open file (bchd_store_shadow), and closing the file exchanges
+ * its contents with those of the device in one go under the device lock.
+ * Readers see either the old or the new contents, never anything in between.
+ *
+ * Only one such open at a time: another one fails with EBUSY until it is
+ * closed, so no writer's contents are silently replaced by another one's.
+ * Seeking works in the new contents; fsync and the ioctls work as they do
+ * on any open file of the device, on its current contents.
+ *
+ * The old contents end up in the shadow store, and a work on bchd_wq frees
+ * them in batches of BCHD_REPLACE_BATCH list items, so the writer does not
+ * wait for that and readers do not wait for longer than a batch.
+ * The lock is still needed there, since snapshots (bchd_snap.c) may share
+ * list items with the old contents.
+ *
+ * Devices with a backing file or with bchd_shmem keep their contents in a file
+ * and are emptied on open as before.
+ */
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/fs.h>
+#include <linux/mutex.h>
+#include <linux/sched.h>        /* cond_resched */
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+
+#include "bchd.h"
+
+#define BCHD_REPLACE_BATCH 4    /* most list items freed per hold of the device lock */
+
+struct bchd_replace {
+    struct bchd_dev *dev;
+    struct mutex lock;          /* serializes the writes to store */
+    struct bchd_store store;    /* the new contents, then the old ones */
+    struct work_struct ws;      /* frees the old ones */
+};
+
+static ssize_t bchd_replace_write(struct file *filp, const char __user *buf, size_t count,
+                                  loff_t *f_pos)
+{
+    struct bchd_replace *r = filp->private_data;
+    struct bchd_dev *dev = r->dev;
+    ssize_t retval;
+    u64 start = ktime_get_ns();
+
+    bchd_stat_inc(dev->stats, BCHD_STAT_WRITES);
+    if (mutex_lock_interruptible(&r->lock)) {
+        return -ERESTARTSYS;
+    }
+    retval = bchd_store_write(&r->store, buf, count, f_pos);
+    mutex_unlock(&r->lock);
+    bchd_lat_record(dev->stats, BCHD_LAT_WRITE, start);
+    return retval;
+}
+
+static loff_t bchd_replace_llseek(struct file *filp, loff_t offset, int whence)
+{
+    struct bchd_replace *r = filp->private_data;
+
+    return generic_file_llseek_size(filp, offset, whence, MAX_LFS_FILESIZE,
+                                    READ_ONCE(r->store.size));
+}
+
+static int bchd_replace_fsync(struct file *filp, loff_t start, loff_t end, int datasync)
+{
+    struct bchd_replace *r = filp->private_data;
+
+    return bchd_backing_fsync(r->dev, datasync);
+}
+
+static long bchd_replace_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct bchd_replace *r = filp->private_data;
+
+    return bchd_dev_ioctl(r->dev, filp, cmd, arg);
+}
+
+static void bchd_replace_free(struct work_struct *ws)
+{
+    struct bchd_replace *r = container_of(ws, struct bchd_replace, ws);
+    struct bchd_dev *dev = r->dev;
+    bool more;
+
+    do {
+        __bchd_lock(dev, BCHD_LOCK_REPLACE, false);
+        more = bchd_store_trim_some(&r->store, BCHD_REPLACE_BATCH);
+        bchd_unlock(dev);
+        cond_resched();
+    } while (more);
+    kfree(r);
+}
+
+static int bchd_replace_release(struct inode *inode, struct file *filp)
+{
+    struct bchd_replace *r = filp->private_data;
+    struct bchd_dev *dev = r->dev;
+
+    bchd_notify_release(dev, filp);
+
+    /* Not interruptible: the new contents would be lost */
+    __bchd_lock(dev, BCHD_LOCK_REPLACE, false);
+    bchd_store_exchange(&dev->store, &r->store);
+    bchd_tier_trim(dev);        /* only the old contents were swapped out */
+    dev->log_pos = 0;
+    bchd_gen_bump(dev);
+    dev->replacing = false;
+    bchd_unlock(dev);
+
+    queue_work(bchd_wq, &r->ws);
+    bchd_stat_inc(dev->stats, BCHD_STAT_REPLACES);
+    bchd_stat_inc(dev->stats, BCHD_STAT_RELEASES);
+    return 0;
+}
+
+static const struct file_operations bchd_replace_fops = {
+    .owner = THIS_MODULE,
+    .llseek = bchd_replace_llseek,
+    .write = bchd_replace_write,
+    .fsync = bchd_replace_fsync,
+    .unlocked_ioctl = bchd_replace_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+    .release = bchd_replace_release,
+};
+
+/* Let the write-only open filp of dev write new contents to replace the old ones on close */
+int bchd_replace_open(struct bchd_dev *dev, struct file *filp)
+{
+    struct bchd_replace *r;
+
+    r = kzalloc(sizeof(*r), GFP_KERNEL);
+    if (r == NULL) {
+        return -ENOMEM;
+    }
+    r->dev = dev;
+    mutex_init(&r->lock);
+    INIT_WORK(&r->ws, bchd_replace_free);
+
+    if (bchd_lock(dev, BCHD_LOCK_REPLACE)) {
+        kfree(r);
+        return -ERESTARTSYS;
+    }
+    if (dev->replacing) {
+        bchd_unlock(dev);
+        kfree(r);
+        return -EBUSY;
+    }
+    dev->replacing = true;
+    bchd_store_shadow(&dev->store, &r->store);
+    bchd_unlock(dev);
+
+    filp->private_data = r;
+    replace_fops(filp, fops_get(&bchd_replace_fops));
+    return 0;
+}
@@ -0,0 +1,161 @@
+/*
+ * bchd_selfbench.c -- benchmark of the storage engine at module load
+ *
+ * With bchd_bench=1, bchd_init runs the storage engine over synthetic text
+ * on a private store (with the configured geometry) before the devices go live:
+ *  -- alloc:  allocating every quantum (and the list items and quantum sets),
+ *  -- copy:   copying every quantum out,
+ *  -- hash:   hashing every quantum as bchd_dedup does,
+ *  -- lookup: finding the quantum of random offsets,
+ *  -- words:  one pass of the logger's word splitting,
+ *  -- trim:   freeing everything (per quantum).
+ * The results are printed to the kernel log and kept in
+ * /sys/kernel/debug/bchd/selfbench, so hosts and kernels can be compared
+ * without the userspace benchmarks.
+ */
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/math64.h>       /* div64_u64 */
+#include <linux/percpu.h>
+#include <linux/sched.h>        /* cond_resched */
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "bchd.h"
+
+#define BCHD_SELFBENCH_BYTES (16 << 20)         /* synthetic data */
+#define BCHD_SELFBENCH_LOOKUPS (1 << 20)
+
+struct bchd_selfbench_result bchd_selfbench_results[BCHD_SB_NR] = {
+    [BCHD_SB_ALLOC]     = { .name = "alloc" },
+    [BCHD_SB_COPY]      = { .name = "copy" },
+    [BCHD_SB_HASH]      = { .name = "hash" },
+    [BCHD_SB_LOOKUP]    = { .name = "lookup" },
+    [BCHD_SB_WORDS]     = { .name = "words" },
+    [BCHD_SB_TRIM]      = { .name = "trim" },
+};
+
+static void bchd_selfbench_done(enum bchd_selfbench_item item, u64 ops, u64 start)
+{
+    struct bchd_selfbench_result *r = &bchd_selfbench_results[item];
+
+    r->ops = ops;
+    r->ns = ktime_get_ns() - start;
+    printk(KERN_INFO "bchd: selfbench %-6s %10llu ops %8llu ns/op\n", r->name, r->ops,
+           ops ? div64_u64(r->ns, ops) : 0);
+}
+
+/* xorshift, good enough to pick offsets */
+static u64 bchd_selfbench_rand(u64 *state)
+{
+    u64 x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+int bchd_selfbench(void)
+{
+    static const char text[] = "Write in C, write in C, everything is fine.\n";
+    struct bchd_stats __percpu *stats;
+    struct bchd_store store;
+    struct bchd_pos pos;
+    u64 seed = 0x9e3779b97f4a7c15ULL;
+    u64 start, ops, nr_quanta;
+    char *buf, *quantum;
+    loff_t off;
+    int log_pos, prev, i, result = 0;
+
+    stats = alloc_percpu(struct bchd_stats);
+    buf = kmalloc(max(bchd_quantum_size, bchd_max_word_len), GFP_KERNEL);
+    if (stats == NULL || buf == NULL) {
+        result = -ENOMEM;
+        goto out;
+    }
+    bchd_store_init(&store, bchd_quantum_size, bchd_qset_size, stats);
+    nr_quanta = DIV_ROUND_UP(BCHD_SELFBENCH_BYTES, bchd_quantum_size);
+
+    /* alloc */
+    start = ktime_get_ns();
+    for (ops = 0, off = 0; ops < nr_quanta; ops++, off += bchd_quantum_size) {
+        bchd_store_locate(&store, off, &pos);
+        if (bchd_store_quantum(&store, &pos, BCHD_QUANTUM_CREATE) == NULL) {
+            result = -ENOMEM;
+            goto out_trim;
+        }
+        cond_resched();
+    }
+    bchd_selfbench_done(BCHD_SB_ALLOC, ops, start);
+
+    /* Fill in the text, so the word splitting has something to do */
+    for (i = 0; i < bchd_quantum_size; i++) {
+        buf[i] = text[i % (sizeof(text) - 1)];
+    }
+    for (off = 0; off < nr_quanta * bchd_quantum_size; off += bchd_quantum_size) {
+        bchd_store_locate(&store, off, &pos);
+        memcpy(bchd_store_quantum(&store, &pos, 0), buf, bchd_quantum_size);
+    }
+    store.size = nr_quanta * bchd_quantum_size;
+
+    /* copy */
+    start = ktime_get_ns();
+    for (ops = 0, off = 0; ops < nr_quanta; ops++, off += bchd_quantum_size) {
+        bchd_store_locate(&store, off, &pos);
+        quantum = bchd_store_quantum(&store, &pos, 0);
+        memcpy(buf, quantum, bchd_quantum_size);
+        cond_resched();
+    }
+    bchd_selfbench_done(BCHD_SB_COPY, ops, start);
+
+    /* hash */
+    start = ktime_get_ns();
+    for (ops = 0, off = 0; ops < nr_quanta; ops++, off += bchd_quantum_size) {
+        bchd_store_locate(&store, off, &pos);
+        quantum = bchd_store_quantum(&store, &pos, 0);
+        bchd_dedup_hash(quantum, bchd_quantum_size);      /* in another unit, so not optimized out */
+        cond_resched();
+    }
+    bchd_selfbench_done(BCHD_SB_HASH, ops, start);
+
+    /* lookup */
+    start = ktime_get_ns();
+    for (ops = 0; ops < BCHD_SELFBENCH_LOOKUPS; ops++) {
+        bchd_store_locate(&store, (u32) bchd_selfbench_rand(&seed) % (u32) store.size, &pos);
+        if (bchd_store_quantum(&store, &pos, 0) == NULL) {
+            result = -EIO;
+            goto out_trim;
+        }
+        if (ops % 1024 == 0) {
+            cond_resched();
+        }
+    }
+    bchd_selfbench_done(BCHD_SB_LOOKUP, ops, start);
+
+    /* words: one pass over the text */
+    start = ktime_get_ns();
+    for (ops = 0, log_pos = 0; ; ops++) {
+        prev = log_pos;
+        bchd_store_next_word(&store, &log_pos, buf, bchd_max_word_len);
+        if (log_pos <= prev) {
+            break;  /* wrapped around */
+        }
+        if (ops % 1024 == 0) {
+            cond_resched();
+        }
+    }
+    bchd_selfbench_done(BCHD_SB_WORDS, ops, start);
+
+out_trim:
+    start = ktime_get_ns();
+    bchd_store_trim(&store);
+    if (result == 0) {
+        bchd_selfbench_done(BCHD_SB_TRIM, nr_quanta, start);
+    }
+out:
+    kfree(buf);
+    free_percpu(stats);
+    return result;
+}
@@ -0,0 +1,164 @@
+/*
+ * bchd_shmem.c -- keeping the data of the devices in shmem files
+ *
+ * The quanta of the storage engine are kmalloc memory, which can't be swapped.
+ * With bchd_shmem=1, each device keeps its data in an unlinked in-kernel
+ * shmem file (like a file on tmpfs) instead, so its pages live in the page cache:
+ *  -- they can be swapped out under memory pressure,
+ *  -- reads go through the page cache without the device lock (the page
+ *     cache has its own locking), writes and trims still take it,
+ *  -- mmap maps the pages of the shmem file and splice reads from them.
+ * The size of the device is the size of the file; store.size follows it,
+ * so the logger and debugfs see the same size as with the storage engine.
+ * Backing files only work with the storage engine; snapshot files
+ * (bchd_snapshot.c) are copied to and from the shmem file.
+ */
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/shmem_fs.h>
+#include <linux/uio.h>
+
+#include "bchd.h"
+
+/* Create the shmem file of the device, if bchd_shmem is set */
+int bchd_shmem_init(struct bchd_dev *dev, int index)
+{
+    struct file *file;
+    char name[16];
+
+    if (!bchd_shmem) {
+        return 0;
+    }
+    if (bchd_backing != NULL && bchd_backing[0] != '\0') {
+        printk(KERN_NOTICE "bchd%d: bchd_backing is ignored with bchd_shmem\n", index);
+    }
+    snprintf(name, sizeof(name), "bchd%d", index);
+    /* Pages are accounted when they are allocated, not for the maximum size */
+    file = shmem_file_setup(name, 0, VM_NORESERVE);
+    if (IS_ERR(file)) {
+        printk(KERN_WARNING "bchd%d: can't create shmem file: %ld\n", index, PTR_ERR(file));
+        return PTR_ERR(file);
+    }
+    dev->shmem = file;
+    return 0;
+}
+
+void bchd_shmem_exit(struct bchd_dev *dev)
+{
+    if (dev->shmem != NULL) {
+        fput(dev->shmem);
+        dev->shmem = NULL;
+    }
+}
+
+/* Read from the page cache; needs no device lock */
+ssize_t bchd_shmem_read(struct bchd_dev *dev, char __user *buf, size_t count, loff_t *f_pos)
+{
+    struct iov_iter iter;
+    ssize_t ret;
+
+    ret = import_ubuf(ITER_DEST, buf, count, &iter);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = vfs_iter_read(dev->shmem, &iter, f_pos, 0);
+    if (ret > 0) {
+        bchd_stat_add(dev->stats, BCHD_STAT_READ_BYTES, ret);
+    }
+    return ret;
+}
+
+/* Write to the page cache, growing the file; called with the device lock held */
+ssize_t bchd_shmem_write(struct bchd_dev *dev, const char __user *buf, size_t count,
+                         loff_t *f_pos)
+{
+    struct iov_iter iter;
+    ssize_t ret;
+
+    ret = import_ubuf(ITER_SOURCE, (char __user *) buf, count, &iter);
+    if (ret < 0) {
+        return ret;
+    }
+    file_start_write(dev->shmem);
+    ret = vfs_iter_write(dev->shmem, &iter, f_pos, 0);
+    file_end_write(dev->shmem);
+    if (ret > 0) {
+        bchd_stat_add(dev->stats, BCHD_STAT_WRITE_BYTES, ret);
+    }
+    dev->store.size = i_size_read(file_inode(dev->shmem));
+    return ret;
+}
+
+/* Drop all pages; called with the device lock held */
+void bchd_shmem_trim(struct bchd_dev *dev)
+{
+    int ret;
+
+    if (dev->shmem == NULL) {
+        return;
+    }
+    ret = vfs_truncate(&dev->shmem->f_path, 0);
+    if (ret < 0) {
+        printk_ratelimited(KERN_WARNING "bchd%d: truncating the shmem file failed: %d\n",
+                           MINOR(dev->cdev.dev) - bchd_minor, ret);
+    }
+    dev->store.size = i_size_read(file_inode(dev->shmem));
+}
+
+/*
+ * The logger's bchd_store_next_word for the shmem file: read the word at *pos
+ * (up to len - 1 characters and the ' ' or '\n' ending it) into word and
+ * advance *pos behind it, starting over at the end. Called with the device lock held.
+ */
+int bchd_shmem_next_word(struct bchd_dev *dev, int *pos, char *word, int len)
+{
+    loff_t size = i_size_read(file_inode(dev->shmem));
+    loff_t off;
+    ssize_t n;
+    int i, w = 0;
+
+    if (size == 0) {
+        return -ENODATA;
+    }
+    if (*pos + 1 >= size) {
+        *pos = 0;
+    }
+    off = *pos;
+    n = kernel_read(dev->shmem, word, len - 1, &off);
+    if (n <= 0) {
+        return -ENODATA;
+    }
+    /* Split in place, w never overtakes i */
+    for (i = 0; i < n; i++) {
+        (*pos)++;
+        if (word[i] == ' ' || word[i] == '\n') {
+            word[w++] = ' ';
+            break;
+        }
+        word[w++] = word[i];
+    }
+    word[w] = '\0';
+    return w;
+}
+
+/* Map the pages of the shmem file; from now on the mapping belongs to that file */
+int bchd_shmem_mmap(struct bchd_dev *dev, struct vm_area_struct *vma)
+{
+    vma_set_file(vma, dev->shmem);
+    return call_mmap(dev->shmem, vma);
+}
+
+ssize_t bchd_shmem_splice_read(struct bchd_dev *dev, loff_t *ppos, struct pipe_inode_info *pipe,
+                               size_t len, unsigned int flags)
+{
+    return dev->shmem->f_op->splice_read(dev->shmem, ppos, pipe, len, flags);
+}
+
+/* Bytes of the file in memory (the rest is swapped out or a hole) */
+unsigned long bchd_shmem_resident(struct bchd_dev *dev)
+{
+    return file_inode(dev->shmem)->i_mapping->nrpages << PAGE_SHIFT;
+}
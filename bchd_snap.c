@@ -0,0 +1,107 @@
+/*
+ * bchd_snap.c -- point-in-time snapshots of the devices
+ *
+ * The BCHD_IOC_SNAP ioctl (see bchd_ioctl.h) returns a new read-only file
+ * descriptor with the contents of the device at the time of the call, while
+ * the device goes on changing. Not to be confused with bchd_snapshot.c,
+ * which saves the devices to files on unload.
+ *
+ * Taking a snapshot takes constant time: its store shares all list items with
+ * the store of the device (bchd_store_snapshot). Writing to the device copies
+ * the list items on the way the first time, and each quantum before it is
+ * changed, so the snapshot keeps the old ones. Closing the descriptor drops
+ * whatever only the snapshot still referred to.
+ *
+ * Snapshots need the quanta to be in memory: devices with a backing file,
+ * with bchd_shmem or with bchd_tier_swap keep some of them at their offset
+ * in a file, which the device and its snapshots can't share. The ioctl fails
+ * with EOPNOTSUPP on those.
+ *
+ * The snapshot shares its quanta with the device, so reading it and dropping
+ * it take the device lock.
+ */
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/anon_inodes.h>
+#include <linux/fcntl.h>        /* O_RDONLY, O_CLOEXEC */
+#include <linux/fs.h>
+#include <linux/slab.h>
+
+#include "bchd.h"
+
+struct bchd_snap {
+    struct bchd_dev *dev;
+    struct bchd_store store;
+};
+
+static ssize_t bchd_snap_read(struct file *filp, char __user *buf, size_t count,
+                              loff_t *f_pos)
+{
+    struct bchd_snap *snap = filp->private_data;
+    struct bchd_dev *dev = snap->dev;
+    ssize_t retval;
+    u64 start = ktime_get_ns();
+
+    bchd_stat_inc(dev->stats, BCHD_STAT_READS);
+    if (bchd_lock(dev, BCHD_LOCK_SNAP)) {
+        return -ERESTARTSYS;
+    }
+    retval = bchd_store_read(&snap->store, buf, count, f_pos);
+    bchd_unlock(dev);
+    bchd_lat_record(dev->stats, BCHD_LAT_READ, start);
+    return retval;
+}
+
+static int bchd_snap_release(struct inode *inode, struct file *filp)
+{
+    struct bchd_snap *snap = filp->private_data;
+    struct bchd_dev *dev = snap->dev;
+
+    /* Not interruptible: the snapshot would leak */
+    __bchd_lock(dev, BCHD_LOCK_SNAP, false);
+    bchd_store_trim(&snap->store);
+    bchd_unlock(dev);
+    kfree(snap);
+    return 0;
+}
+
+static const struct file_operations bchd_snap_fops = {
+    .owner = THIS_MODULE,
+    .read = bchd_snap_read,
+    .release = bchd_snap_release,
+};
+
+/* Take a snapshot of the device; returns its file descriptor */
+int bchd_snap_create(struct bchd_dev *dev)
+{
+    struct bchd_snap *snap;
+    int fd;
+
+    if (dev->shmem != NULL || dev->backing.file != NULL || dev->tier.swap != NULL) {
+        return -EOPNOTSUPP;
+    }
+    snap = kzalloc(sizeof(*snap), GFP_KERNEL);
+    if (snap == NULL) {
+        return -ENOMEM;
+    }
+    snap->dev = dev;
+
+    if (bchd_lock(dev, BCHD_LOCK_SNAP)) {
+        kfree(snap);
+        return -ERESTARTSYS;
+    }
+    bchd_store_snapshot(&dev->store, &snap->store);
+    bchd_unlock(dev);
+
+    fd = anon_inode_getfd("[bchd-snap]", &bchd_snap_fops, snap, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        __bchd_lock(dev, BCHD_LOCK_SNAP, false);
+        bchd_store_trim(&snap->store);
+        bchd_unlock(dev);
+        kfree(snap);
+        return fd;
+    }
+    bchd_stat_inc(dev->stats, BCHD_STAT_SNAPS);
+    return fd;
+}
@@ -0,0 +1,363 @@
+/*
+ * bchd_snapshot.c -- saving the devices at unload and restoring them at load
+ *
+ * With bchd_snapshot=/path/prefix, bchd_cleanup saves the contents of device N
+ * to the file /path/prefixN and bchd_init restores them from there, so the
+ * contents survive reloading the module without a backing file (bchd_backing.c).
+ * The snapshot is an image of the device, like a backing file:
+ *  -- Saving writes each run of adjacent quanta with one vfs_iter_write, straight
+ *     out of the quanta (a kvec per quantum, nothing is copied). Holes of the
+ *     device stay holes of the file. Compressed and swapped out quanta
+ *     (bchd_tier.c) are copied into a buffer and written on their own.
+ *  -- Restoring builds the whole list with bchd_store_reserve in one pass and
+ *     reads the quanta with one vfs_iter_read per batch, straight into the quanta.
+ *     They come zeroed, so the end of the last one past the size reads as zeros.
+ *  -- Saving writes to /path/prefixN.tmp, syncs it and renames it over the
+ *     snapshot, so a failure (or a crash) leaves the old snapshot as it was.
+ *  -- With bchd_shmem, the data is the shmem file (bchd_shmem.c): saving and
+ *     restoring copy between the two files in chunks with kernel_read and
+ *     kernel_write. Chunks of zeros are skipped, so holes stay holes there too.
+ * Devices with a backing file keep their contents anyway and are left alone.
+ * If restoring fails, loading fails, so the snapshot is not overwritten by an
+ * empty device on unload.
+ */
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/dcache.h>
+#include <linux/fs.h>
+#include <linux/math64.h>       /* div_u64 */
+#include <linux/mount.h>
+#include <linux/namei.h>
+#include <linux/slab.h>
+#include <linux/string.h>       /* kbasename */
+#include <linux/uio.h>
+
+#include "bchd.h"
+
+#define BCHD_SNAPSHOT_BATCH 256 /* most quanta per vfs_iter_read/vfs_iter_write */
+#define BCHD_SNAPSHOT_CHUNK (1 << 20)   /* bytes per kernel_read/kernel_write of a shmem file */
+
+/* Write the first n quanta of vec (bytes in total) at *pos */
+static int bchd_snapshot_write(struct file *file, struct kvec *vec, int n, size_t bytes,
+                               loff_t *pos)
+{
+    struct iov_iter iter;
+    ssize_t ret;
+
+    iov_iter_kvec(&iter, ITER_SOURCE, vec, n, bytes);
+    ret = vfs_iter_write(file, &iter, pos, 0);
+    if (ret != (ssize_t) bytes) {
+        return ret < 0 ? ret : -EIO;
+    }
+    return 0;
+}
+
+/* Read the first n quanta of vec (bytes in total) from *pos */
+static int bchd_snapshot_read(struct file *file, struct kvec *vec, int n, size_t bytes,
+                              loff_t *pos)
+{
+    struct iov_iter iter;
+    ssize_t ret;
+
+    iov_iter_kvec(&iter, ITER_DEST, vec, n, bytes);
+    ret = vfs_iter_read(file, &iter, pos, 0);
+    if (ret != (ssize_t) bytes) {
+        return ret < 0 ? ret : -EIO;    /* the file was cut short under us */
+    }
+    return 0;
+}
+
+/* Copy the first size bytes of from to the empty file to, skipping chunks of zeros */
+static int bchd_snapshot_copy_file(struct file *from, struct file *to, loff_t size)
+{
+    loff_t off = 0, pos;
+    ssize_t ret;
+    size_t len;
+    char *buf;
+    int result = 0;
+
+    buf = kvmalloc(BCHD_SNAPSHOT_CHUNK, GFP_KERNEL);
+    if (buf == NULL) {
+        return -ENOMEM;
+    }
+    while (off < size) {
+        len = min_t(loff_t, BCHD_SNAPSHOT_CHUNK, size - off);
+        pos = off;
+        ret = kernel_read(from, buf, len, &pos);
+        if (ret != (ssize_t) len) {
+            result = ret < 0 ? ret : -EIO;
+            break;
+        }
+        if (memchr_inv(buf, 0, len) != NULL) {
+            pos = off;
+            ret = kernel_write(to, buf, len, &pos);
+            if (ret != (ssize_t) len) {
+                result = ret < 0 ? ret : -EIO;
+                break;
+            }
+        }
+        off += len;
+        cond_resched();
+    }
+    kvfree(buf);
+    return result;
+}
+
+/* Rename the written file over path, which is in the same directory */
+static int bchd_snapshot_rename(struct file *file, const char *path)
+{
+    const char *name = kbasename(path);
+    struct dentry *dentry = file->f_path.dentry;
+    struct dentry *dir, *trap, *target;
+    struct renamedata rd = { };
+    int result;
+
+    result = mnt_want_write(file->f_path.mnt);
+    if (result < 0) {
+        return result;
+    }
+    dir = dget_parent(dentry);
+    trap = lock_rename(dir, dir);
+    if (IS_ERR(trap)) {
+        result = PTR_ERR(trap);
+        goto out;
+    }
+    if (dentry->d_parent != dir) {
+        result = -ENOENT;       /* moved away under us */
+        goto out_unlock;
+    }
+    target = lookup_one_len(name, dir, strlen(name));
+    if (IS_ERR(target)) {
+        result = PTR_ERR(target);
+        goto out_unlock;
+    }
+    rd.old_mnt_idmap = mnt_idmap(file->f_path.mnt);
+    rd.old_dir = d_inode(dir);
+    rd.old_dentry = dentry;
+    rd.new_mnt_idmap = rd.old_mnt_idmap;
+    rd.new_dir = d_inode(dir);
+    rd.new_dentry = target;
+    result = vfs_rename(&rd);
+    dput(target);
+out_unlock:
+    unlock_rename(dir, dir);
+out:
+    dput(dir);
+    mnt_drop_write(file->f_path.mnt);
+    return result;
+}
+
+/*
+ * Copy quantum j of qs (at off), which is not in memory as it is, into buf.
+ * Returns false for a hole; a quantum that can't be read back is lost anyway.
+ */
+static bool bchd_snapshot_copy(struct bchd_dev *dev, struct bchd_qset *qs, int j, loff_t off,
+                               void *buf)
+{
+    struct bchd_store *store = &dev->store;
+
+    if (qs->data == NULL || !store->track_access) {
+        return false;
+    }
+    if (test_bit(j, qs->swapped)) {
+        return bchd_tier_read(dev, off, buf) == 0;
+    }
+    return qs->data[j] != NULL && store->decompress(store, qs->data[j], buf) == 0;
+}
+
+/* Restore device index from its snapshot, if there is one; called before the device goes live */
+int bchd_snapshot_restore(struct bchd_dev *dev, int index)
+{
+    struct bchd_store *store = &dev->store;
+    u64 start = ktime_get_ns();
+    struct bchd_qset *qs;
+    struct kvec *vec = NULL;
+    struct file *file;
+    unsigned long size;
+    size_t bytes = 0;
+    loff_t off = 0, pos = 0;
+    char *path;
+    int result = 0, n = 0, j;
+
+    if (bchd_snapshot == NULL || bchd_snapshot[0] == '\0' || dev->backing.file != NULL) {
+        return 0;
+    }
+    path = kasprintf(GFP_KERNEL, "%s%d", bchd_snapshot, index);
+    if (path == NULL) {
+        return -ENOMEM;
+    }
+    file = filp_open(path, O_RDONLY | O_LARGEFILE, 0);
+    if (IS_ERR(file)) {
+        result = PTR_ERR(file);
+        if (result == -ENOENT) {
+            dev->snapshot = true;       /* nothing saved yet */
+            result = 0;
+        } else {
+            printk(KERN_WARNING "bchd: can't open snapshot %s: %d\n", path, result);
+        }
+        goto out;
+    }
+
+    size = i_size_read(file_inode(file));
+    if (dev->shmem != NULL) {
+        result = bchd_snapshot_copy_file(file, dev->shmem, size);
+        /* A hole at the end only exists as the size of the file */
+        if (result == 0) {
+            result = vfs_truncate(&dev->shmem->f_path, size);
+        }
+        if (result < 0) {
+            goto out_trim;
+        }
+        store->size = size;
+        goto out_restored;
+    }
+    vec = kmalloc_array(BCHD_SNAPSHOT_BATCH, sizeof(*vec), GFP_KERNEL);
+    if (vec == NULL) {
+        result = -ENOMEM;
+        goto out_close;
+    }
+    result = bchd_store_reserve(store, size);
+    if (result < 0) {
+        goto out_trim;
+    }
+
+    for (qs = store->data; qs != NULL && off < size; qs = qs->next) {
+        for (j = 0; j < store->qset_size && off < size; j++) {
+            vec[n].iov_base = qs->data[j];
+            vec[n].iov_len = min_t(u64, store->quantum_size, size - off);
+            bytes += vec[n].iov_len;
+            off += vec[n].iov_len;
+            if (++n == BCHD_SNAPSHOT_BATCH || off == size) {
+                result = bchd_snapshot_read(file, vec, n, bytes, &pos);
+                if (result < 0) {
+                    goto out_trim;
+                }
+                n = 0;
+                bytes = 0;
+            }
+        }
+    }
+out_restored:
+    dev->snapshot = true;
+    printk(KERN_INFO "bchd%d: restored %lu bytes from %s in %llu ms\n", index, size, path,
+           div_u64(ktime_get_ns() - start, 1000000));
+
+out_trim:
+    if (result < 0) {
+        printk(KERN_WARNING "bchd: can't restore snapshot %s: %d\n", path, result);
+        bchd_store_trim(store);
+        bchd_shmem_trim(dev);
+    }
+    kfree(vec);
+out_close:
+    filp_close(file, NULL);
+out:
+    kfree(path);
+    return result;
+}
+
+/* Save device index to its snapshot; nobody may use the device anymore */
+void bchd_snapshot_save(struct bchd_dev *dev, int index)
+{
+    struct bchd_store *store = &dev->store;
+    unsigned long size = dev->shmem != NULL ? i_size_read(file_inode(dev->shmem)) : store->size;
+    u64 start = ktime_get_ns();
+    struct bchd_qset *qs;
+    struct kvec *vec;
+    struct file *file;
+    size_t bytes = 0;
+    loff_t off = 0, pos = 0;
+    char *path, *tmp = NULL, *buf = NULL;
+    int result = 0, n = 0, j;
+
+    if (!dev->snapshot) {
+        return;
+    }
+    path = kasprintf(GFP_KERNEL, "%s%d", bchd_snapshot, index);
+    if (path != NULL) {
+        tmp = kasprintf(GFP_KERNEL, "%s.tmp", path);
+    }
+    vec = kmalloc_array(BCHD_SNAPSHOT_BATCH, sizeof(*vec), GFP_KERNEL);
+    if (store->track_access) {
+        buf = kmalloc(store->quantum_size, GFP_KERNEL);
+    }
+    if (tmp == NULL || vec == NULL || (store->track_access && buf == NULL)) {
+        printk(KERN_WARNING "bchd%d: no memory to save a snapshot\n", index);
+        goto out;
+    }
+    file = filp_open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0600);
+    if (IS_ERR(file)) {
+        printk(KERN_WARNING "bchd: can't open snapshot %s: %ld\n", tmp, PTR_ERR(file));
+        goto out;
+    }
+
+    if (dev->shmem != NULL) {
+        result = bchd_snapshot_copy_file(dev->shmem, file, size);
+        goto out_sync;
+    }
+
+    /* Runs of adjacent quanta; a hole (or the end of a batch) ends a run */
+    for (qs = store->data; qs != NULL && off < size; qs = qs->next) {
+        for (j = 0; j < store->qset_size && off < size; j++, off += store->quantum_size) {
+            if (qs->data == NULL || qs->data[j] == NULL
+                || (store->track_access && test_bit(j, qs->compressed))) {
+                if (n > 0) {
+                    result = bchd_snapshot_write(file, vec, n, bytes, &pos);
+                    n = 0;
+                    bytes = 0;
+                }
+                if (result == 0 && bchd_snapshot_copy(dev, qs, j, off, buf)) {
+                    vec[0].iov_base = buf;
+                    vec[0].iov_len = min_t(u64, store->quantum_size, size - off);
+                    pos = off;
+                    result = bchd_snapshot_write(file, vec, 1, vec[0].iov_len, &pos);
+                }
+            } else {
+                if (n == 0) {
+                    pos = off;
+                }
+                vec[n].iov_base = qs->data[j];
+                vec[n].iov_len = min_t(u64, store->quantum_size, size - off);
+                bytes += vec[n].iov_len;
+                if (++n == BCHD_SNAPSHOT_BATCH) {
+                    result = bchd_snapshot_write(file, vec, n, bytes, &pos);
+                    n = 0;
+                    bytes = 0;
+                }
+            }
+            if (result < 0) {
+                goto out_close;
+            }
+        }
+    }
+    if (n > 0) {
+        result = bchd_snapshot_write(file, vec, n, bytes, &pos);
+    }
+out_sync:
+    /* A hole at the end only exists as the size of the file */
+    if (result == 0 && i_size_read(file_inode(file)) != size) {
+        result = vfs_truncate(&file->f_path, size);
+    }
+    if (result == 0) {
+        result = vfs_fsync(file, 0);
+    }
+    if (result == 0) {
+        result = bchd_snapshot_rename(file, path);
+    }
+    if (result == 0) {
+        printk(KERN_INFO "bchd%d: saved %lu bytes to %s in %llu ms\n", index, size, path,
+               div_u64(ktime_get_ns() - start, 1000000));
+    }
+
+out_close:
+    if (result < 0) {
+        printk(KERN_WARNING "bchd: can't save snapshot %s, kept the old one: %d\n", path, result);
+    }
+    filp_close(file, NULL);
+out:
+    kfree(buf);
+    kfree(vec);
+    kfree(tmp);
+    kfree(path);
+}
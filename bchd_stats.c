@@ -0,0 +1,480 @@
+/*
+ * bchd_stats.c -- statistics of the bchd devices, exported via debugfs
+ *
+ * Each device gets a directory /sys/kernel/debug/bchd/bchdN containing
+ *  -- stats: event counters and the current memory usage
+ *  -- qsets: the layout of the list of quantum sets (like scullmem)
+ *  -- latency: latency histograms and percentiles, writing to it resets them
+ *  -- lock: wait and hold times of the device lock per call site,
+ *           worst offenders first, writing to it resets them
+ * and, if the module was loaded with bchd_bench=1, the file
+ * /sys/kernel/debug/bchd/selfbench holds the results of bchd_selfbench.c.
+ * With bchd_dedup=1, /sys/kernel/debug/bchd/dedup shows the table of shared
+ * quanta of all devices (see bchd_dedup.c).
+ */
+
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/math64.h>       /* div_u64 */
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/sort.h>
+
+#include "bchd.h"
+
+static struct dentry *bchd_debugfs_root;   /* /sys/kernel/debug/bchd */
+
+static const char * const bchd_stat_names[BCHD_STAT_NR] = {
+    [BCHD_STAT_OPENS]           = "opens",
+    [BCHD_STAT_RELEASES]        = "releases",
+    [BCHD_STAT_READS]           = "reads",
+    [BCHD_STAT_READ_BYTES]      = "read_bytes",
+    [BCHD_STAT_WRITES]          = "writes",
+    [BCHD_STAT_WRITE_BYTES]     = "write_bytes",
+    [BCHD_STAT_TRIMS]           = "trims",
+    [BCHD_STAT_QSET_ALLOCS]     = "qset_allocs",
+    [BCHD_STAT_QSET_FREES]      = "qset_frees",
+    [BCHD_STAT_PTRS_ALLOCS]     = "ptrs_allocs",
+    [BCHD_STAT_PTRS_FREES]      = "ptrs_frees",
+    [BCHD_STAT_QUANTUM_ALLOCS]  = "quantum_allocs",
+    [BCHD_STAT_QUANTUM_FREES]   = "quantum_frees",
+    [BCHD_STAT_ALLOC_FAILS]     = "alloc_fails",
+    [BCHD_STAT_LOGGED_WORDS]    = "logged_words",
+    [BCHD_STAT_FILLS]           = "fills",
+    [BCHD_STAT_WRITEBACK_WRITES] = "writeback_writes",
+    [BCHD_STAT_WRITEBACK_BYTES] = "writeback_bytes",
+    [BCHD_STAT_WRITEBACK_ERRORS] = "writeback_errors",
+    [BCHD_STAT_FSYNCS]          = "fsyncs",
+    [BCHD_STAT_FSYNC_FLUSHES]   = "fsync_flushes",
+    [BCHD_STAT_JOURNAL_BYTES]   = "journal_bytes",
+    [BCHD_STAT_JOURNAL_COMMITS] = "journal_commits",
+    [BCHD_STAT_CHECKPOINTS]     = "checkpoints",
+    [BCHD_STAT_CHECKPOINT_BYTES] = "checkpoint_bytes",
+    [BCHD_STAT_COMPRESSIONS]    = "compressions",
+    [BCHD_STAT_COMPRESSED_BYTES] = "compressed_bytes",
+    [BCHD_STAT_COMPRESS_REJECTS] = "compress_rejects",
+    [BCHD_STAT_DECOMPRESSIONS]  = "decompressions",
+    [BCHD_STAT_CQUANTUM_FREES]  = "cquantum_frees",
+    [BCHD_STAT_CQUANTUM_FREE_BYTES] = "cquantum_free_bytes",
+    [BCHD_STAT_SWAP_OUTS]       = "swap_outs",
+    [BCHD_STAT_SWAP_INS]        = "swap_ins",
+    [BCHD_STAT_SWAP_FREES]      = "swap_frees",
+    [BCHD_STAT_DEDUP_REFS]      = "dedup_refs",
+    [BCHD_STAT_DEDUP_HITS]      = "dedup_hits",
+    [BCHD_STAT_DEDUP_UNREFS]    = "dedup_unrefs",
+    [BCHD_STAT_DEDUP_COWS]      = "dedup_cows",
+    [BCHD_STAT_SNAPS]           = "snaps",
+    [BCHD_STAT_SNAP_COPIES]     = "snap_copies",
+    [BCHD_STAT_SNAP_COWS]       = "snap_cows",
+    [BCHD_STAT_REPLACES]        = "replaces",
+    [BCHD_STAT_CREADS]          = "creads",
+    [BCHD_STAT_CREAD_UNCHANGED] = "cread_unchanged",
+    [BCHD_STAT_DELTAS]          = "deltas",
+    [BCHD_STAT_DELTA_ALLS]      = "delta_alls",
+    [BCHD_STAT_NOTIFIES]        = "notifies",
+};
+
+static const char * const bchd_lat_names[BCHD_LAT_NR] = {
+    [BCHD_LAT_READ]         = "read",
+    [BCHD_LAT_WRITE]        = "write",
+    [BCHD_LAT_TRIM]         = "trim",
+    [BCHD_LAT_FOLLOW]       = "follow",
+    [BCHD_LAT_LOCK_WAIT]    = "lock_wait",
+    [BCHD_LAT_LOGGER]       = "logger",
+    [BCHD_LAT_WRITEBACK]    = "writeback",
+    [BCHD_LAT_FSYNC]        = "fsync",
+    [BCHD_LAT_CHECKPOINT]   = "checkpoint",
+    [BCHD_LAT_TIER]         = "tier",
+    [BCHD_LAT_DECOMPRESS]   = "decompress",
+    [BCHD_LAT_SWAP_IN]      = "swap_in",
+};
+
+static const char * const bchd_lock_names[BCHD_LOCK_NR] = {
+    [BCHD_LOCK_READ]        = "read",
+    [BCHD_LOCK_WRITE]       = "write",
+    [BCHD_LOCK_OPEN]        = "open",
+    [BCHD_LOCK_LOGGER]      = "logger",
+    [BCHD_LOCK_DEBUGFS]     = "debugfs",
+    [BCHD_LOCK_WRITEBACK]   = "writeback",
+    [BCHD_LOCK_FSYNC]       = "fsync",
+    [BCHD_LOCK_TIER]        = "tier",
+    [BCHD_LOCK_SNAP]        = "snap",
+    [BCHD_LOCK_REPLACE]     = "replace",
+    [BCHD_LOCK_GEN]         = "gen",
+    [BCHD_LOCK_NOTIFY]      = "notify",
+};
+
+/* Sum up a counter over all CPUs */
+u64 bchd_stat_sum(struct bchd_dev *dev, enum bchd_stat_item item)
+{
+    u64 sum = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        sum += per_cpu_ptr(dev->stats, cpu)->count[item];
+    }
+    return sum;
+}
+
+static int bchd_stats_show(struct seq_file *s, void *unused)
+{
+    struct bchd_dev *dev = s->private;
+    u64 count[BCHD_STAT_NR];
+    u64 qsets, ptrs, quanta, cquanta, cbytes, squanta, used, gen;
+    unsigned long size;
+    int quantum_size, qset_size;
+    int i;
+
+    for (i = 0; i < BCHD_STAT_NR; i++) {
+        count[i] = bchd_stat_sum(dev, i);
+        seq_printf(s, "%-20s %llu\n", bchd_stat_names[i], count[i]);
+    }
+
+    if (bchd_lock(dev, BCHD_LOCK_DEBUGFS)) {
+        return -ERESTARTSYS;
+    }
+    size = dev->store.size;
+    quantum_size = dev->store.quantum_size;
+    qset_size = dev->store.qset_size;
+    gen = dev->gen;
+    bchd_unlock(dev);
+
+    /*
+     * The number of allocated items follows from the counters,
+     * so we do not have to walk the list here.
+     */
+    qsets = count[BCHD_STAT_QSET_ALLOCS] - count[BCHD_STAT_QSET_FREES];
+    ptrs = count[BCHD_STAT_PTRS_ALLOCS] - count[BCHD_STAT_PTRS_FREES];
+    quanta = count[BCHD_STAT_QUANTUM_ALLOCS] - count[BCHD_STAT_QUANTUM_FREES];
+    cquanta = count[BCHD_STAT_COMPRESSIONS] - count[BCHD_STAT_CQUANTUM_FREES];
+    cbytes = count[BCHD_STAT_COMPRESSED_BYTES] - count[BCHD_STAT_CQUANTUM_FREE_BYTES];
+    squanta = count[BCHD_STAT_SWAP_OUTS] - count[BCHD_STAT_SWAP_INS] - count[BCHD_STAT_SWAP_FREES];
+    used = qsets * sizeof(struct bchd_qset) + ptrs * qset_size * sizeof(void *)
+           + quanta * quantum_size + cbytes;
+
+    seq_printf(s, "%-20s %lu\n", "size", size);
+    seq_printf(s, "%-20s %llu\n", "generation", gen);
+    seq_printf(s, "%-20s %d\n", "quantum_size", quantum_size);
+    seq_printf(s, "%-20s %d\n", "qset_size", qset_size);
+    seq_printf(s, "%-20s %llu\n", "qsets", qsets);
+    seq_printf(s, "%-20s %llu\n", "quanta", quanta);
+    seq_printf(s, "%-20s %llu\n", "compressed_quanta", cquanta);
+    seq_printf(s, "%-20s %llu\n", "compressed_mem_bytes", cbytes);
+    seq_printf(s, "%-20s %llu\n", "compress_saved_bytes", cquanta * quantum_size - cbytes);
+    seq_printf(s, "%-20s %llu\n", "swapped_quanta", squanta);
+    seq_printf(s, "%-20s %llu\n", "shared_quanta",
+               count[BCHD_STAT_DEDUP_REFS] - count[BCHD_STAT_DEDUP_UNREFS]);
+    seq_printf(s, "%-20s %llu\n", "mem_bytes", used);
+    seq_printf(s, "%-20s %lld\n", "mem_overhead_bytes", (long long) (used - size));
+    if (dev->shmem != NULL) {
+        seq_printf(s, "%-20s %lu\n", "shmem_resident_bytes", bchd_shmem_resident(dev));
+    }
+    if (dev->tier.swap != NULL) {
+        seq_printf(s, "%-20s %lu\n", "swap_resident_bytes", bchd_tier_swap_resident(dev));
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(bchd_stats);
+
+/*
+ * Return the upper bound (in ns) of the bucket that contains
+ * the permille-th value of a histogram with total values.
+ */
+static u64 bchd_lat_percentile(const u64 *hist, u64 total, int permille)
+{
+    u64 rank = div_u64(total * permille + 999, 1000);
+    u64 seen = 0;
+    int b;
+
+    for (b = 0; b < BCHD_LAT_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen >= rank) {
+            break;
+        }
+    }
+    return 2ULL << min(b, BCHD_LAT_BUCKETS - 1);
+}
+
+static int bchd_latency_show(struct seq_file *s, void *unused)
+{
+    struct bchd_dev *dev = s->private;
+    u64 hist[BCHD_LAT_BUCKETS];
+    u64 total;
+    int i, b, cpu;
+
+    seq_printf(s, "%-10s %12s %12s %12s %12s %12s\n",
+               "op", "count", "p50_ns", "p99_ns", "p999_ns", "max_ns");
+    for (i = 0; i < BCHD_LAT_NR; i++) {
+        memset(hist, 0, sizeof(hist));
+        for_each_possible_cpu(cpu) {
+            for (b = 0; b < BCHD_LAT_BUCKETS; b++) {
+                hist[b] += per_cpu_ptr(dev->stats, cpu)->lat[i][b];
+            }
+        }
+        total = 0;
+        for (b = 0; b < BCHD_LAT_BUCKETS; b++) {
+            total += hist[b];
+        }
+        if (total == 0) {
+            seq_printf(s, "%-10s %12d %12s %12s %12s %12s\n", bchd_lat_names[i], 0, "-", "-", "-", "-");
+            continue;
+        }
+        seq_printf(s, "%-10s %12llu %12llu %12llu %12llu %12llu\n", bchd_lat_names[i], total,
+                   bchd_lat_percentile(hist, total, 500),
+                   bchd_lat_percentile(hist, total, 990),
+                   bchd_lat_percentile(hist, total, 999),
+                   bchd_lat_percentile(hist, total, 1000));
+
+        /* The buckets itself, "<upper bound in ns>:<count>" */
+        seq_puts(s, "          ");
+        for (b = 0; b < BCHD_LAT_BUCKETS; b++) {
+            if (hist[b] != 0) {
+                seq_printf(s, " %llu:%llu", 2ULL << b, hist[b]);
+            }
+        }
+        seq_putc(s, '\n');
+    }
+    return 0;
+}
+
+static int bchd_latency_open(struct inode *inode, struct file *filp)
+{
+    return single_open(filp, bchd_latency_show, inode->i_private);
+}
+
+/*
+ * Any write resets the histograms.
+ * Operations running concurrently on other CPUs might get lost,
+ * which is fine for statistics.
+ */
+static ssize_t bchd_latency_write(struct file *filp, const char __user *buf,
+                                  size_t count, loff_t *f_pos)
+{
+    struct bchd_dev *dev = ((struct seq_file *) filp->private_data)->private;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        memset(per_cpu_ptr(dev->stats, cpu)->lat, 0, sizeof(dev->stats->lat));
+    }
+    return count;
+}
+
+static const struct file_operations bchd_latency_fops = {
+    .owner = THIS_MODULE,
+    .open = bchd_latency_open,
+    .read = seq_read,
+    .write = bchd_latency_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+/* The lock statistics of one site summed up over all CPUs */
+struct bchd_lock_sum {
+    int site;
+    struct bchd_lock_stats st;
+};
+
+static void bchd_lock_stats_sum(struct bchd_dev *dev, int site, struct bchd_lock_sum *sum)
+{
+    struct bchd_lock_stats *ls;
+    int b, cpu;
+
+    memset(sum, 0, sizeof(*sum));
+    sum->site = site;
+    for_each_possible_cpu(cpu) {
+        ls = &per_cpu_ptr(dev->stats, cpu)->lock[site];
+        sum->st.acquired += ls->acquired;
+        sum->st.contended += ls->contended;
+        sum->st.wait_ns += ls->wait_ns;
+        sum->st.hold_ns += ls->hold_ns;
+        sum->st.wait_max_ns = max(sum->st.wait_max_ns, ls->wait_max_ns);
+        sum->st.hold_max_ns = max(sum->st.hold_max_ns, ls->hold_max_ns);
+        for (b = 0; b < BCHD_LAT_BUCKETS; b++) {
+            sum->st.wait[b] += ls->wait[b];
+            sum->st.hold[b] += ls->hold[b];
+        }
+    }
+}
+
+/* Sort by total wait time, descending */
+static int bchd_lock_sum_cmp(const void *a, const void *b)
+{
+    const struct bchd_lock_sum *x = a, *y = b;
+
+    if (x->st.wait_ns == y->st.wait_ns) {
+        return 0;
+    }
+    return x->st.wait_ns < y->st.wait_ns ? 1 : -1;
+}
+
+static int bchd_lock_show(struct seq_file *s, void *unused)
+{
+    struct bchd_dev *dev = s->private;
+    struct bchd_lock_sum *sums;
+    int i;
+
+    /* Too large for the stack */
+    sums = kmalloc_array(BCHD_LOCK_NR, sizeof(*sums), GFP_KERNEL);
+    if (sums == NULL) {
+        return -ENOMEM;
+    }
+    for (i = 0; i < BCHD_LOCK_NR; i++) {
+        bchd_lock_stats_sum(dev, i, &sums[i]);
+    }
+    sort(sums, BCHD_LOCK_NR, sizeof(*sums), bchd_lock_sum_cmp, NULL);
+
+    seq_printf(s, "%-8s %10s %10s %14s %12s %12s %14s %12s %12s\n", "site",
+               "acquired", "contended", "wait_ns", "wait_p99", "wait_max",
+               "hold_ns", "hold_p99", "hold_max");
+    for (i = 0; i < BCHD_LOCK_NR; i++) {
+        struct bchd_lock_stats *st = &sums[i].st;
+
+        if (st->acquired == 0) {
+            continue;
+        }
+        seq_printf(s, "%-8s %10llu %10llu %14llu %12llu %12llu %14llu %12llu %12llu\n",
+                   bchd_lock_names[sums[i].site], st->acquired, st->contended,
+                   st->wait_ns, bchd_lat_percentile(st->wait, st->acquired, 990), st->wait_max_ns,
+                   st->hold_ns, bchd_lat_percentile(st->hold, st->acquired, 990), st->hold_max_ns);
+    }
+    kfree(sums);
+    return 0;
+}
+
+static int bchd_lock_open(struct inode *inode, struct file *filp)
+{
+    return single_open(filp, bchd_lock_show, inode->i_private);
+}
+
+/* Any write resets the lock statistics, see bchd_latency_write */
+static ssize_t bchd_lock_write(struct file *filp, const char __user *buf,
+                               size_t count, loff_t *f_pos)
+{
+    struct bchd_dev *dev = ((struct seq_file *) filp->private_data)->private;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        memset(per_cpu_ptr(dev->stats, cpu)->lock, 0, sizeof(dev->stats->lock));
+    }
+    return count;
+}
+
+static const struct file_operations bchd_lock_fops = {
+    .owner = THIS_MODULE,
+    .open = bchd_lock_open,
+    .read = seq_read,
+    .write = bchd_lock_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+/* Dump the list of quantum sets, like scullmem does for scull */
+static int bchd_qsets_show(struct seq_file *s, void *unused)
+{
+    struct bchd_dev *dev = s->private;
+    struct bchd_qset *qs;
+    int item, j, quanta;
+
+    if (bchd_lock(dev, BCHD_LOCK_DEBUGFS)) {
+        return -ERESTARTSYS;
+    }
+    seq_printf(s, "qset %i, q %i, sz %li\n", dev->store.qset_size, dev->store.quantum_size,
+               dev->store.size);
+    for (qs = dev->store.data, item = 0; qs != NULL; qs = qs->next, item++) {
+        quanta = 0;
+        if (qs->data != NULL) {
+            for (j = 0; j < dev->store.qset_size; j++) {
+                if (qs->data[j] != NULL) {
+                    quanta++;
+                }
+            }
+        }
+        seq_printf(s, "  item %i at %p, qset at %p, %i quanta\n", item, qs, qs->data, quanta);
+
+        /* Like scullmem, only the quanta of the last item are listed */
+        if (qs->data != NULL && qs->next == NULL) {
+            for (j = 0; j < dev->store.qset_size; j++) {
+                if (qs->data[j] != NULL) {
+                    seq_printf(s, "    % 4i: %8p\n", j, qs->data[j]);
+                }
+            }
+        }
+    }
+    bchd_unlock(dev);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(bchd_qsets);
+
+static int bchd_selfbench_show(struct seq_file *s, void *v)
+{
+    struct bchd_selfbench_result *r;
+    int i;
+
+    seq_printf(s, "quantum_size %d, qset_size %d\n", bchd_quantum_size, bchd_qset_size);
+    seq_printf(s, "%-10s %12s %14s %10s\n", "test", "ops", "ns", "ns/op");
+    for (i = 0; i < BCHD_SB_NR; i++) {
+        r = &bchd_selfbench_results[i];
+        if (r->ops == 0) {
+            seq_printf(s, "%-10s %12s %14s %10s\n", r->name, "-", "-", "-");
+            continue;
+        }
+        seq_printf(s, "%-10s %12llu %14llu %10llu\n", r->name, r->ops, r->ns,
+                   div64_u64(r->ns, r->ops));
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(bchd_selfbench);
+
+static int bchd_dedup_show(struct seq_file *s, void *v)
+{
+    unsigned long entries, refs;
+    u64 ratio;
+
+    bchd_dedup_counts(&entries, &refs);
+    ratio = entries ? div_u64((u64) refs * 100, entries) : 0;
+    seq_printf(s, "%-20s %lu\n", "entries", entries);
+    seq_printf(s, "%-20s %lu\n", "refs", refs);
+    seq_printf(s, "%-20s %llu\n", "saved_bytes", (u64) (refs - entries) * bchd_quantum_size);
+    seq_printf(s, "%-20s %llu.%02llu\n", "ratio", div_u64(ratio, 100), ratio % 100);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(bchd_dedup);
+
+void bchd_debugfs_add_dev(struct bchd_dev *dev, int index)
+{
+    char name[16];
+
+    if (bchd_debugfs_root == NULL) {
+        return;
+    }
+    snprintf(name, sizeof(name), "bchd%d", index);
+    dev->debugfs = debugfs_create_dir(name, bchd_debugfs_root);
+    debugfs_create_file("stats", S_IRUSR, dev->debugfs, dev, &bchd_stats_fops);
+    debugfs_create_file("qsets", S_IRUSR, dev->debugfs, dev, &bchd_qsets_fops);
+    debugfs_create_file("latency", S_IRUSR | S_IWUSR, dev->debugfs, dev, &bchd_latency_fops);
+    debugfs_create_file("lock", S_IRUSR | S_IWUSR, dev->debugfs, dev, &bchd_lock_fops);
+}
+
+/*
+ * Failing to set up debugfs is not fatal, the devices work without it.
+ * The debugfs functions accept error pointers as parent, so we do not check them.
+ */
+void bchd_debugfs_init(void)
+{
+    bchd_debugfs_root = debugfs_create_dir("bchd", NULL);
+    if (bchd_bench) {
+        debugfs_create_file("selfbench", S_IRUSR, bchd_debugfs_root, NULL, &bchd_selfbench_fops);
+    }
+    if (bchd_dedup) {
+        debugfs_create_file("dedup", S_IRUSR, bchd_debugfs_root, NULL, &bchd_dedup_fops);
+    }
+}
+
+void bchd_debugfs_exit(void)
+{
+    debugfs_remove_recursive(bchd_debugfs_root);
+    bchd_debugfs_root = NULL;
+}
@@ -0,0 +1,165 @@
+/*
+ * bchd_stats.h -- statistics counters and latency histograms
+ *
+ * The counters are kept per CPU and updated without locks.
+ * This header is shared with the userspace build of the storage engine
+ * (see bchd_user.h), where all counters live on a single "CPU".
+ */
+
+#ifndef _BCHD_STATS_H_
+#define _BCHD_STATS_H_
+
+#ifdef BCHD_USERSPACE
+#include "bchd_user.h"
+#else
+#include <linux/types.h>
+#include <linux/percpu.h>
+#include <linux/bitops.h>       /* fls64 */
+#include <linux/timekeeping.h>  /* ktime_get_ns */
+#endif
+
+/*
+ * Event counters of a device.
+ * They are kept per CPU, so counting in the read and write paths
+ * does not bounce a shared cache line between CPUs.
+ * Readers sum up the values of all CPUs (see bchd_stats.c).
+ */
+enum bchd_stat_item {
+    BCHD_STAT_OPENS,
+    BCHD_STAT_RELEASES,
+    BCHD_STAT_READS,
+    BCHD_STAT_READ_BYTES,
+    BCHD_STAT_WRITES,
+    BCHD_STAT_WRITE_BYTES,
+    BCHD_STAT_TRIMS,
+    BCHD_STAT_QSET_ALLOCS,      /* list items */
+    BCHD_STAT_QSET_FREES,
+    BCHD_STAT_PTRS_ALLOCS,      /* pointer arrays of the list items */
+    BCHD_STAT_PTRS_FREES,
+    BCHD_STAT_QUANTUM_ALLOCS,
+    BCHD_STAT_QUANTUM_FREES,
+    BCHD_STAT_ALLOC_FAILS,
+    BCHD_STAT_LOGGED_WORDS,
+    BCHD_STAT_FILLS,            /* quanta read from the backing file */
+    BCHD_STAT_WRITEBACK_WRITES, /* kernel_writes to the backing file */
+    BCHD_STAT_WRITEBACK_BYTES,
+    BCHD_STAT_WRITEBACK_ERRORS,
+    BCHD_STAT_FSYNCS,
+    BCHD_STAT_FSYNC_FLUSHES,    /* fsyncs that had to flush, the others shared one */
+    BCHD_STAT_JOURNAL_BYTES,    /* appended to the journal */
+    BCHD_STAT_JOURNAL_COMMITS,
+    BCHD_STAT_CHECKPOINTS,
+    BCHD_STAT_CHECKPOINT_BYTES, /* data applied to the backing file */
+    BCHD_STAT_COMPRESSIONS,     /* quanta compressed ... */
+    BCHD_STAT_COMPRESSED_BYTES, /* ... into this many bytes */
+    BCHD_STAT_COMPRESS_REJECTS, /* quanta that did not compress well enough */
+    BCHD_STAT_DECOMPRESSIONS,
+    BCHD_STAT_CQUANTUM_FREES,   /* compressed quanta freed (decompressed or trimmed) ... */
+    BCHD_STAT_CQUANTUM_FREE_BYTES,  /* ... and their bytes */
+    BCHD_STAT_SWAP_OUTS,        /* quanta moved to the swap tier ... */
+    BCHD_STAT_SWAP_INS,         /* ... read back on access ... */
+    BCHD_STAT_SWAP_FREES,       /* ... and trimmed there */
+    BCHD_STAT_DEDUP_REFS,       /* quanta replaced by a shared copy ... */
+    BCHD_STAT_DEDUP_HITS,       /* ... of them the ones another quantum had already */
+    BCHD_STAT_DEDUP_UNREFS,     /* shared quanta dropped (copied on write, trimmed or moved on) */
+    BCHD_STAT_DEDUP_COWS,       /* shared quanta copied on write */
+    BCHD_STAT_SNAPS,            /* snapshots taken */
+    BCHD_STAT_SNAP_COPIES,      /* list items shared with a snapshot copied on write ... */
+    BCHD_STAT_SNAP_COWS,        /* ... and their quanta */
+    BCHD_STAT_REPLACES,         /* contents replaced on closing a write-only open */
+    BCHD_STAT_CREADS,           /* conditional reads ... */
+    BCHD_STAT_CREAD_UNCHANGED,  /* ... of them the ones that found the generation unchanged */
+    BCHD_STAT_DELTAS,           /* delta reads ... */
+    BCHD_STAT_DELTA_ALLS,       /* ... of them the ones that went back further than the log */
+    BCHD_STAT_NOTIFIES,         /* eventfds signaled */
+    BCHD_STAT_NR                /* must be last */
+};
+
+/*
+ * Latency histograms of the operations of a device.
+ * Bucket b counts the operations that took [2^b, 2^(b+1)) ns,
+ * bucket 0 also counts the ones that took less than 1 ns
+ * and the last bucket also counts everything above.
+ */
+enum bchd_lat_item {
+    BCHD_LAT_READ,
+    BCHD_LAT_WRITE,
+    BCHD_LAT_TRIM,
+    BCHD_LAT_FOLLOW,
+    BCHD_LAT_LOCK_WAIT,
+    BCHD_LAT_LOGGER,
+    BCHD_LAT_WRITEBACK,         /* a writeback pass */
+    BCHD_LAT_FSYNC,
+    BCHD_LAT_CHECKPOINT,
+    BCHD_LAT_TIER,              /* a tiering pass */
+    BCHD_LAT_DECOMPRESS,        /* decompressing a quantum on access */
+    BCHD_LAT_SWAP_IN,           /* reading a swapped out quantum on access */
+    BCHD_LAT_NR                 /* must be last */
+};
+
+#define BCHD_LAT_BUCKETS 36     /* 2^35 ns is about 34 seconds */
+
+/*
+ * The places that take the device lock.
+ * The time spent waiting for and holding the lock is accounted per site.
+ */
+enum bchd_lock_site {
+    BCHD_LOCK_READ,
+    BCHD_LOCK_WRITE,
+    BCHD_LOCK_OPEN,             /* trim in bchd_open */
+    BCHD_LOCK_LOGGER,
+    BCHD_LOCK_DEBUGFS,
+    BCHD_LOCK_WRITEBACK,
+    BCHD_LOCK_FSYNC,
+    BCHD_LOCK_TIER,
+    BCHD_LOCK_SNAP,             /* taking, reading and dropping snapshots */
+    BCHD_LOCK_REPLACE,          /* replacing the contents and freeing the old ones */
+    BCHD_LOCK_GEN,              /* the generation ioctls */
+    BCHD_LOCK_NOTIFY,           /* registering and dropping eventfds */
+    BCHD_LOCK_NR                /* must be last */
+};
+
+struct bchd_lock_stats {
+    u64 acquired;
+    u64 contended;              /* the lock was not free */
+    u64 wait_ns;                /* total time spent waiting */
+    u64 hold_ns;                /* total time the lock was held */
+    u64 wait_max_ns;
+    u64 hold_max_ns;
+    u64 wait[BCHD_LAT_BUCKETS]; /* histograms, see enum bchd_lat_item */
+    u64 hold[BCHD_LAT_BUCKETS];
+};
+
+struct bchd_stats {
+    u64 count[BCHD_STAT_NR];
+    u64 lat[BCHD_LAT_NR][BCHD_LAT_BUCKETS];
+    struct bchd_lock_stats lock[BCHD_LOCK_NR];
+};
+
+static inline void bchd_stat_add(struct bchd_stats __percpu *stats, enum bchd_stat_item item, u64 val)
+{
+    this_cpu_add(stats->count[item], val);
+}
+
+static inline void bchd_stat_inc(struct bchd_stats __percpu *stats, enum bchd_stat_item item)
+{
+    this_cpu_inc(stats->count[item]);
+}
+
+static inline int bchd_lat_bucket(u64 ns)
+{
+    int bucket = ns ? fls64(ns) - 1 : 0;
+
+    return bucket < BCHD_LAT_BUCKETS ? bucket : BCHD_LAT_BUCKETS - 1;
+}
+
+/*
+ * Add the time elapsed since start (from ktime_get_ns) to a latency histogram.
+ * Like the counters, the histograms are per CPU, so this needs no lock.
+ */
+static inline void bchd_lat_record(struct bchd_stats __percpu *stats, enum bchd_lat_item item, u64 start)
+{
+    this_cpu_inc(stats->lat[item][bchd_lat_bucket(ktime_get_ns() - start)]);
+}
+
+#endif /* _BCHD_STATS_H_ */
@@ -0,0 +1,74 @@
+/*
+ * bchd_status.c -- the status page of the devices
+ *
+ * Each device has a page with a struct bchd_status (see bchd_ioctl.h): its size,
+ * generation, number of writes and the position of the logger. Mapping the
+ * device read-only at BCHD_STATUS_OFF maps this page, so monitoring agents can
+ * watch a device without system calls and without taking the device lock.
+ *
+ * The page is published like the vDSO data: whoever changes one of the values
+ * calls bchd_status_publish with the device lock held, which makes the sequence
+ * count odd, copies the values into the page and makes it even again. A reader
+ * that sees the same even count before and after copying has a consistent copy.
+ */
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/compiler.h>     /* WRITE_ONCE */
+#include <linux/gfp.h>
+#include <linux/mm.h>
+
+#include "bchd.h"
+#include "bchd_ioctl.h"
+
+/* Copy the values into the status page; called with the device lock held */
+void bchd_status_publish(struct bchd_dev *dev, bool write)
+{
+    struct bchd_status *st = dev->status;
+
+    if (st == NULL) {
+        return;         /* not set up yet */
+    }
+    WRITE_ONCE(st->seq, st->seq + 1);
+    smp_wmb();
+    WRITE_ONCE(st->size, dev->store.size);
+    WRITE_ONCE(st->gen, dev->gen);
+    if (write) {
+        WRITE_ONCE(st->writes, st->writes + 1);
+    }
+    WRITE_ONCE(st->log_pos, dev->log_pos);
+    smp_wmb();
+    WRITE_ONCE(st->seq, st->seq + 1);
+}
+
+/* Map the status page of the device, read-only */
+int bchd_status_mmap(struct bchd_dev *dev, struct vm_area_struct *vma)
+{
+    if (vma->vm_end - vma->vm_start != PAGE_SIZE) {
+        return -EINVAL;
+    }
+    if (vma->vm_flags & VM_WRITE) {
+        return -EPERM;
+    }
+    vm_flags_clear(vma, VM_MAYWRITE);
+    vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+    return vm_insert_page(vma, vma->vm_start, virt_to_page(dev->status));
+}
+
+/* Set up the status page of the device with its current values; called before it is used */
+int bchd_status_init(struct bchd_dev *dev)
+{
+    dev->status = (struct bchd_status *) get_zeroed_page(GFP_KERNEL);
+    if (dev->status == NULL) {
+        return -ENOMEM;
+    }
+    bchd_status_publish(dev, false);
+    return 0;
+}
+
+/* The mappings keep the page until they go */
+void bchd_status_exit(struct bchd_dev *dev)
+{
+    free_page((unsigned long) dev->status);
+    dev->status = NULL;
+}
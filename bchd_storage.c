@@ -0,0 +1,828 @@
+/*
+ * bchd_storage.c -- the storage engine of bchd
+ *
+ * Manages the list of quantum sets of a device: following the list,
+ * copying data in and out of the quanta, trimming, and splitting the
+ * stored text into words for the logger.
+ *
+ * NOTE: The caller must serialize all calls on a store (bchd_main.c holds the device lock).
+ */
+
+#ifdef BCHD_USERSPACE
+#include "bchd_user.h"
+#else
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/slab.h>         /* kmalloc, kfree */
+#include <linux/string.h>
+#include <linux/uaccess.h>      /* copy_from_user, copy_to_user */
+#endif
+
+#include "bchd_storage.h"
+
+void bchd_store_init(struct bchd_store *store, int quantum_size, int qset_size,
+                     struct bchd_stats __percpu *stats)
+{
+    store->data = NULL;
+    store->quantum_size = quantum_size;
+    store->qset_size = qset_size;
+    store->size = 0;
+    store->stats = stats;
+    store->track_dirty = false;
+    store->fill_size = 0;
+    store->fill = NULL;
+    store->track_access = false;
+    store->decompress = NULL;
+    store->swap_in = NULL;
+    store->release = NULL;
+    store->parent = NULL;
+}
+
+/* Free the pointer array of a list item and its bitmaps */
+static void bchd_free_ptrs(struct bchd_qset *dptr)
+{
+    kfree(dptr->data);
+    dptr->data = NULL;
+    kfree(dptr->dirty);
+    dptr->dirty = NULL;
+    kfree(dptr->accessed);
+    dptr->accessed = NULL;
+    kfree(dptr->compressed);
+    dptr->compressed = NULL;
+    kfree(dptr->swapped);
+    dptr->swapped = NULL;
+    kfree(dptr->shared);
+    dptr->shared = NULL;
+    kfree(dptr->cow);
+    dptr->cow = NULL;
+}
+
+/* The store whose callbacks to use: a snapshot uses the ones of the store it was taken of */
+static inline struct bchd_store * bchd_store_cb(struct bchd_store *store)
+{
+    return store->parent != NULL ? store->parent : store;
+}
+
+/* Free the list item dptr and the quanta it owns (not the ones of its origin) */
+static void bchd_qset_free(struct bchd_store *store, struct bchd_qset *dptr)
+{
+    int qset_size = store->qset_size;
+    int i;
+
+    if (dptr->data != NULL) {
+        /* Free all quanta */
+        for (i = 0; i < qset_size; i++) {
+            if (dptr->data[i] == NULL) {
+                if (dptr->swapped != NULL && test_bit(i, dptr->swapped)) {
+                    bchd_stat_inc(store->stats, BCHD_STAT_SWAP_FREES);
+                }
+                continue;
+            }
+            if (dptr->cow != NULL && test_bit(i, dptr->cow)) {
+                continue;
+            }
+            if (dptr->shared != NULL && test_bit(i, dptr->shared)) {
+                store->release(bchd_store_cb(store), dptr->data[i]);
+                bchd_stat_inc(store->stats, BCHD_STAT_DEDUP_UNREFS);
+                continue;
+            }
+            if (dptr->compressed != NULL && test_bit(i, dptr->compressed)) {
+                bchd_stat_inc(store->stats, BCHD_STAT_CQUANTUM_FREES);
+                bchd_stat_add(store->stats, BCHD_STAT_CQUANTUM_FREE_BYTES,
+                              ((struct bchd_cquantum *) dptr->data[i])->len);
+            } else {
+                bchd_stat_inc(store->stats, BCHD_STAT_QUANTUM_FREES);
+            }
+            kfree(dptr->data[i]);
+        }
+        bchd_free_ptrs(dptr);
+        bchd_stat_inc(store->stats, BCHD_STAT_PTRS_FREES);
+    }
+    kfree(dptr);
+    bchd_stat_inc(store->stats, BCHD_STAT_QSET_FREES);
+}
+
+/*
+ * The list item dptr is only kept for its copy: hand the quanta it owns
+ * and the copy still refers to over to the copy, so dptr can go.
+ */
+static void bchd_qset_merge(struct bchd_store *store, struct bchd_qset *dptr)
+{
+    struct bchd_qset *copy = dptr->copy;
+    int j;
+
+    if (dptr->data != NULL && copy->cow != NULL) {
+        for (j = 0; j < store->qset_size; j++) {
+            if (test_bit(j, copy->cow) && !(dptr->cow != NULL && test_bit(j, dptr->cow))) {
+                __clear_bit(j, copy->cow);
+                dptr->data[j] = NULL;
+            }
+        }
+    }
+    /* The quanta that stay cow belong to the origin of dptr */
+    copy->origin = dptr->origin;
+    if (copy->origin != NULL) {
+        copy->origin->copy = copy;
+    }
+    dptr->origin = NULL;
+    dptr->copy = NULL;
+    dptr->refs = 0;
+}
+
+/* Drop a reference to dptr and put it on the list dead if nothing else needs it */
+static void bchd_qset_unref(struct bchd_store *store, struct bchd_qset *dptr,
+                            struct bchd_qset **dead)
+{
+    if (dptr == NULL) {
+        return;
+    }
+    dptr->refs--;
+    if (dptr->refs == 1 && dptr->copy != NULL) {
+        bchd_qset_merge(store, dptr);   /* only the copy refers to it */
+    }
+    if (dptr->refs == 0) {
+        dptr->copy = *dead;
+        *dead = dptr;
+    }
+}
+
+/*
+ * Drop a reference to the list item dptr. Items nobody refers to anymore are
+ * freed and drop their references to the next item and to their origin in turn.
+ * This iterates instead of recursing, since both chains can be long.
+ */
+static void bchd_qset_put(struct bchd_store *store, struct bchd_qset *dptr)
+{
+    struct bchd_qset *dead = NULL;      /* linked by copy, which they do not need anymore */
+    struct bchd_qset *next, *origin;
+
+    bchd_qset_unref(store, dptr, &dead);
+    while (dead != NULL) {
+        dptr = dead;
+        dead = dptr->copy;
+        next = dptr->next;
+        origin = dptr->origin;
+        if (origin != NULL) {
+            origin->copy = NULL;        /* that was dptr */
+        }
+        bchd_qset_free(store, dptr);
+        bchd_qset_unref(store, next, &dead);
+        bchd_qset_unref(store, origin, &dead);
+    }
+}
+
+/*
+ * Empty out the store.
+ * Here, we walk through the entire list and free any quantum and quantum sets we find,
+ * except for the ones a snapshot still refers to.
+ */
+void bchd_store_trim(struct bchd_store *store)
+{
+    u64 start = ktime_get_ns();
+
+    bchd_qset_put(store, store->data);
+
+    store->size = 0;
+    store->data = NULL;
+    store->fill_size = 0;       /* The backing store is emptied too */
+    bchd_stat_inc(store->stats, BCHD_STAT_TRIMS);
+    bchd_lat_record(store->stats, BCHD_LAT_TRIM, start);
+}
+
+/*
+ * Free the first n list items of the store, or all of them if it is shorter.
+ * Returns whether there are items left, so a large store can be trimmed in steps;
+ * until it is empty, the store is only good for trimming.
+ */
+bool bchd_store_trim_some(struct bchd_store *store, int n)
+{
+    struct bchd_qset *dptr;
+
+    while (n-- > 0 && store->data != NULL) {
+        dptr = store->data;
+        store->data = dptr->next;
+        if (store->data != NULL) {
+            store->data->refs++;        /* the store refers to it instead */
+        }
+        bchd_qset_put(store, dptr);
+    }
+    if (store->data != NULL) {
+        return true;
+    }
+    store->size = 0;
+    store->fill_size = 0;
+    bchd_stat_inc(store->stats, BCHD_STAT_TRIMS);
+    return false;
+}
+
+/* Allocate the pointer array of a list item (and the bitmaps the store keeps) */
+static int bchd_alloc_ptrs(struct bchd_store *store, struct bchd_qset *dptr)
+{
+    int qset_size = store->qset_size;
+    size_t bitmap = BITS_TO_LONGS(qset_size) * sizeof(long);
+
+    dptr->data = kmalloc(qset_size * sizeof(char *), GFP_KERNEL);
+    if (dptr->data == NULL) {
+        goto fail;
+    }
+    memset(dptr->data, 0, qset_size * sizeof(char *));
+    if (store->track_dirty) {
+        dptr->dirty = kzalloc(bitmap, GFP_KERNEL);
+        if (dptr->dirty == NULL) {
+            goto fail;
+        }
+    }
+    if (store->track_access) {
+        dptr->accessed = kzalloc(bitmap, GFP_KERNEL);
+        dptr->compressed = kzalloc(bitmap, GFP_KERNEL);
+        dptr->swapped = kzalloc(bitmap, GFP_KERNEL);
+        dptr->shared = kzalloc(bitmap, GFP_KERNEL);
+        if (dptr->accessed == NULL || dptr->compressed == NULL || dptr->swapped == NULL
+            || dptr->shared == NULL) {
+            goto fail;
+        }
+    }
+    bchd_stat_inc(store->stats, BCHD_STAT_PTRS_ALLOCS);
+    return 0;
+
+fail:
+    bchd_free_ptrs(dptr);
+    bchd_stat_inc(store->stats, BCHD_STAT_ALLOC_FAILS);
+    return -ENOMEM;
+}
+
+/*
+ * Give the store its own copy of the list item dptr, which a snapshot shares.
+ * The copy refers to the same quanta, marked in its cow bitmap. They still
+ * belong to dptr, which stays as long as the copy refers to it (its origin),
+ * so the reference of the store to dptr becomes the one of the copy.
+ */
+static struct bchd_qset * bchd_qset_copy(struct bchd_store *store, struct bchd_qset *dptr)
+{
+    int qset_size = store->qset_size;
+    size_t bitmap = BITS_TO_LONGS(qset_size) * sizeof(long);
+    struct bchd_qset *copy;
+    int j;
+
+    copy = kzalloc(sizeof(*copy), GFP_KERNEL);
+    if (copy == NULL) {
+        bchd_stat_inc(store->stats, BCHD_STAT_ALLOC_FAILS);
+        return NULL;
+    }
+    if (dptr->data != NULL) {
+        if (bchd_alloc_ptrs(store, copy) < 0) {
+            kfree(copy);
+            return NULL;
+        }
+        copy->cow = kzalloc(bitmap, GFP_KERNEL);
+        if (copy->cow == NULL) {
+            bchd_free_ptrs(copy);
+            kfree(copy);
+            bchd_stat_inc(store->stats, BCHD_STAT_PTRS_FREES);
+            bchd_stat_inc(store->stats, BCHD_STAT_ALLOC_FAILS);
+            return NULL;
+        }
+        memcpy(copy->data, dptr->data, qset_size * sizeof(char *));
+        for (j = 0; j < qset_size; j++) {
+            if (dptr->data[j] != NULL) {
+                __set_bit(j, copy->cow);
+            }
+        }
+        if (store->track_dirty) {
+            memcpy(copy->dirty, dptr->dirty, bitmap);
+        }
+        if (store->track_access) {
+            memcpy(copy->accessed, dptr->accessed, bitmap);
+            memcpy(copy->compressed, dptr->compressed, bitmap);
+            memcpy(copy->swapped, dptr->swapped, bitmap);
+            memcpy(copy->shared, dptr->shared, bitmap);
+        }
+    }
+    copy->next = dptr->next;
+    if (copy->next != NULL) {
+        copy->next->refs++;
+    }
+    copy->refs = 1;
+    copy->origin = dptr;
+    dptr->copy = copy;
+    bchd_stat_inc(store->stats, BCHD_STAT_QSET_ALLOCS);
+    bchd_stat_inc(store->stats, BCHD_STAT_SNAP_COPIES);
+    return copy;
+}
+
+/*
+ * Follow the list to the index n like bchd_follow, but make sure that only
+ * the store refers to the items on the way, so they can be changed:
+ * items shared with a snapshot are replaced by copies.
+ */
+static struct bchd_qset * bchd_follow_own(struct bchd_store *store, int n)
+{
+    struct bchd_qset **link = &store->data;
+    struct bchd_qset *copy;
+    u64 start = ktime_get_ns();
+    int i;
+
+    for (i = 0; ; i++) {
+        if (*link == NULL) {
+            *link = kzalloc(sizeof(**link), GFP_KERNEL);
+            if (*link == NULL) {
+                bchd_stat_inc(store->stats, BCHD_STAT_ALLOC_FAILS);
+                return NULL;
+            }
+            (*link)->refs = 1;
+            bchd_stat_inc(store->stats, BCHD_STAT_QSET_ALLOCS);
+        } else if ((*link)->refs > 1) {
+            copy = bchd_qset_copy(store, *link);
+            if (copy == NULL) {
+                return NULL;
+            }
+            *link = copy;
+        }
+        if (i == n) {
+            break;
+        }
+        link = &(*link)->next;
+    }
+
+    bchd_lat_record(store->stats, BCHD_LAT_FOLLOW, start);
+    return *link;
+}
+
+/*
+ * Follow the list to the index n and return a pointer to the corresponding item.
+ * This procedure creates new items if necessary.
+ */
+struct bchd_qset * bchd_follow(struct bchd_store *store, int n)
+{
+    struct bchd_qset *qs = store->data;
+    u64 start = ktime_get_ns();
+    int i;
+
+    for (i = 0; qs != NULL && i < n; i++) {
+        qs = qs->next;
+    }
+    if (qs == NULL) {
+        /* Appending changes the list, which may be shared */
+        return bchd_follow_own(store, n);
+    }
+
+    bchd_lat_record(store->stats, BCHD_LAT_FOLLOW, start);
+    return qs;
+}
+
+/*
+ * Replace the compressed quantum j of dptr with a decompressed copy.
+ * Returns the copy, or NULL (and leaves it compressed) if that fails.
+ * The copies of dptr that refer to the compressed quantum refer to the new one instead.
+ * A compressed quantum of the origin (cow) stays, dptr now has its own.
+ */
+static void * bchd_store_inflate(struct bchd_store *store, struct bchd_qset *dptr, int j)
+{
+    struct bchd_cquantum *cq = dptr->data[j];
+    struct bchd_qset *copy;
+    void *quantum;
+    u64 start = ktime_get_ns();
+
+    quantum = kmalloc(store->quantum_size, GFP_KERNEL);
+    if (quantum == NULL) {
+        bchd_stat_inc(store->stats, BCHD_STAT_ALLOC_FAILS);
+        return NULL;
+    }
+    if (store->decompress(bchd_store_cb(store), cq, quantum) < 0) {
+        kfree(quantum);
+        return NULL;
+    }
+    bchd_stat_inc(store->stats, BCHD_STAT_QUANTUM_ALLOCS);
+    bchd_stat_inc(store->stats, BCHD_STAT_DECOMPRESSIONS);
+    dptr->data[j] = quantum;
+    __clear_bit(j, dptr->compressed);
+    for (copy = dptr->copy; copy != NULL; copy = copy->copy) {
+        if (copy->data != NULL && copy->data[j] == cq) {
+            copy->data[j] = quantum;
+            __clear_bit(j, copy->compressed);
+        }
+    }
+    if (dptr->cow != NULL && test_bit(j, dptr->cow)) {
+        __clear_bit(j, dptr->cow);
+    } else {
+        bchd_stat_inc(store->stats, BCHD_STAT_CQUANTUM_FREES);
+        bchd_stat_add(store->stats, BCHD_STAT_CQUANTUM_FREE_BYTES, cq->len);
+        kfree(cq);
+    }
+    bchd_lat_record(store->stats, BCHD_LAT_DECOMPRESS, start);
+    return quantum;
+}
+
+/*
+ * Read the swapped out quantum j of dptr (at off) back in.
+ * Returns it, or NULL (and leaves it swapped out) if that fails.
+ */
+static void * bchd_store_swap_in(struct bchd_store *store, struct bchd_qset *dptr, int j,
+                                 loff_t off)
+{
+    void *quantum;
+    u64 start = ktime_get_ns();
+
+    quantum = kmalloc(store->quantum_size, GFP_KERNEL);
+    if (quantum == NULL) {
+        bchd_stat_inc(store->stats, BCHD_STAT_ALLOC_FAILS);
+        return NULL;
+    }
+    if (store->swap_in(bchd_store_cb(store), off, quantum) < 0) {
+        kfree(quantum);
+        return NULL;
+    }
+    bchd_stat_inc(store->stats, BCHD_STAT_QUANTUM_ALLOCS);
+    bchd_stat_inc(store->stats, BCHD_STAT_SWAP_INS);
+    dptr->data[j] = quantum;
+    __clear_bit(j, dptr->swapped);
+    bchd_lat_record(store->stats, BCHD_LAT_SWAP_IN, start);
+    return quantum;
+}
+
+/*
+ * Replace the shared quantum j of dptr with a private copy (copy-on-write).
+ * Returns the copy, or NULL (and leaves it shared) if that fails.
+ */
+void * bchd_store_unshare(struct bchd_store *store, struct bchd_qset *dptr, int j)
+{
+    void *quantum;
+
+    quantum = kmalloc(store->quantum_size, GFP_KERNEL);
+    if (quantum == NULL) {
+        bchd_stat_inc(store->stats, BCHD_STAT_ALLOC_FAILS);
+        return NULL;
+    }
+    memcpy(quantum, dptr->data[j], store->quantum_size);
+    store->release(bchd_store_cb(store), dptr->data[j]);
+    bchd_stat_inc(store->stats, BCHD_STAT_QUANTUM_ALLOCS);
+    bchd_stat_inc(store->stats, BCHD_STAT_DEDUP_UNREFS);
+    dptr->data[j] = quantum;
+    __clear_bit(j, dptr->shared);
+    return quantum;
+}
+
+/*
+ * Replace quantum j of dptr, which belongs to the origin of dptr, with a private copy.
+ * Returns the copy, or NULL if that fails.
+ */
+static void * bchd_store_cow(struct bchd_store *store, struct bchd_qset *dptr, int j)
+{
+    void *quantum;
+
+    quantum = kmalloc(store->quantum_size, GFP_KERNEL);
+    if (quantum == NULL) {
+        bchd_stat_inc(store->stats, BCHD_STAT_ALLOC_FAILS);
+        return NULL;
+    }
+    memcpy(quantum, dptr->data[j], store->quantum_size);
+    bchd_stat_inc(store->stats, BCHD_STAT_QUANTUM_ALLOCS);
+    bchd_stat_inc(store->stats, BCHD_STAT_SNAP_COWS);
+    dptr->data[j] = quantum;
+    __clear_bit(j, dptr->cow);
+    if (store->track_access) {
+        __clear_bit(j, dptr->shared);   /* the reference is the origin's */
+    }
+    return quantum;
+}
+
+/*
+ * Return the quantum at pos, or NULL if it is a hole (or an allocation failed).
+ * With BCHD_QUANTUM_CREATE, missing quanta (and their quantum set) are allocated, zeroed.
+ * Missing quanta below fill_size are allocated and read from the backing store,
+ * compressed ones are decompressed and swapped out ones read back in.
+ * With BCHD_QUANTUM_DIRTY, a shared quantum is replaced by a private copy.
+ * Following the list to pos allocates missing list items in any case;
+ * with either flag, the list items on the way are copied if a snapshot shares them.
+ */
+void * bchd_store_quantum(struct bchd_store *store, const struct bchd_pos *pos, int flags)
+{
+    struct bchd_qset *dptr;
+    int qset_size = store->qset_size;
+    loff_t off = ((loff_t) pos->item * qset_size + pos->qset_pos) * store->quantum_size;
+    bool fill = off < store->fill_size;
+    void *quantum;
+
+    if (flags & (BCHD_QUANTUM_CREATE | BCHD_QUANTUM_DIRTY)) {
+        dptr = bchd_follow_own(store, pos->item);
+    } else {
+        dptr = bchd_follow(store, pos->item);
+    }
+    if (dptr == NULL) {
+        return NULL;
+    }
+    if (dptr->data == NULL) {
+        if (!(flags & BCHD_QUANTUM_CREATE) && !fill) {
+            return NULL;
+        }
+        if (bchd_alloc_ptrs(store, dptr) < 0) {
+            return NULL;
+        }
+    }
+
+    quantum = dptr->data[pos->qset_pos];
+    if (quantum == NULL && store->track_access && test_bit(pos->qset_pos, dptr->swapped)) {
+        quantum = bchd_store_swap_in(store, dptr, pos->qset_pos, off);
+        if (quantum == NULL) {
+            return NULL;
+        }
+    }
+    if (quantum == NULL && ((flags & BCHD_QUANTUM_CREATE) || fill)) {
+        /* What a write does not cover reads (and is written back) as zeros; fill covers all */
+        quantum = fill ? kmalloc(store->quantum_size, GFP_KERNEL)
+                       : kzalloc(store->quantum_size, GFP_KERNEL);
+        if (quantum == NULL) {
+            bchd_stat_inc(store->stats, BCHD_STAT_ALLOC_FAILS);
+            return NULL;
+        }
+        bchd_stat_inc(store->stats, BCHD_STAT_QUANTUM_ALLOCS);
+        /* If the backing store fails us, this is a hole */
+        if (fill && store->fill(bchd_store_cb(store), off, quantum) < 0) {
+            kfree(quantum);
+            bchd_stat_inc(store->stats, BCHD_STAT_QUANTUM_FREES);
+            return NULL;
+        }
+        dptr->data[pos->qset_pos] = quantum;
+    }
+    if (quantum != NULL && store->track_access) {
+        if (test_bit(pos->qset_pos, dptr->compressed)) {
+            quantum = bchd_store_inflate(store, dptr, pos->qset_pos);
+            if (quantum == NULL) {
+                return NULL;
+            }
+        }
+        __set_bit(pos->qset_pos, dptr->accessed);
+    }
+    if (quantum != NULL && (flags & BCHD_QUANTUM_DIRTY)) {
+        if (dptr->cow != NULL && test_bit(pos->qset_pos, dptr->cow)) {
+            quantum = bchd_store_cow(store, dptr, pos->qset_pos);
+        } else if (store->track_access && test_bit(pos->qset_pos, dptr->shared)) {
+            quantum = bchd_store_unshare(store, dptr, pos->qset_pos);
+            if (quantum != NULL) {
+                bchd_stat_inc(store->stats, BCHD_STAT_DEDUP_COWS);
+            }
+        }
+        if (quantum == NULL) {
+            return NULL;
+        }
+    }
+    if (quantum != NULL && (flags & BCHD_QUANTUM_DIRTY) && store->track_dirty) {
+        __set_bit(pos->qset_pos, dptr->dirty);
+    }
+    return quantum;
+}
+
+/*
+ * Allocate everything the first size bytes of the store need -- list items,
+ * quantum sets and quanta -- in one pass over the list, instead of following
+ * the list from its head for every quantum, and grow the store to size.
+ * Quanta that exist already are kept, new ones are zeroed.
+ * Returns 0 or -ENOMEM; what was allocated stays until the store is trimmed.
+ */
+int bchd_store_reserve(struct bchd_store *store, unsigned long size)
+{
+    int qset_size = store->qset_size;
+    unsigned long nr_quanta = (size + store->quantum_size - 1) / store->quantum_size;
+    struct bchd_qset **link = &store->data;
+    struct bchd_qset *dptr;
+    int i;
+
+    while (nr_quanta > 0) {
+        if (*link == NULL) {
+            *link = kzalloc(sizeof(**link), GFP_KERNEL);
+            if (*link == NULL) {
+                bchd_stat_inc(store->stats, BCHD_STAT_ALLOC_FAILS);
+                return -ENOMEM;
+            }
+            (*link)->refs = 1;
+            bchd_stat_inc(store->stats, BCHD_STAT_QSET_ALLOCS);
+        } else if ((*link)->refs > 1) {
+            dptr = bchd_qset_copy(store, *link);
+            if (dptr == NULL) {
+                return -ENOMEM;
+            }
+            *link = dptr;
+        }
+        dptr = *link;
+        if (dptr->data == NULL && bchd_alloc_ptrs(store, dptr) < 0) {
+            return -ENOMEM;
+        }
+        for (i = 0; i < qset_size && nr_quanta > 0; i++, nr_quanta--) {
+            if (dptr->data[i] != NULL) {
+                continue;
+            }
+            dptr->data[i] = kzalloc(store->quantum_size, GFP_KERNEL);
+            if (dptr->data[i] == NULL) {
+                bchd_stat_inc(store->stats, BCHD_STAT_ALLOC_FAILS);
+                return -ENOMEM;
+            }
+            bchd_stat_inc(store->stats, BCHD_STAT_QUANTUM_ALLOCS);
+        }
+        link = &dptr->next;
+    }
+
+    if (store->size < size) {
+        store->size = size;
+    }
+    return 0;
+}
+
+/*
+ * Make snap a snapshot of store: a store with the same contents that shares
+ * all list items with it, so this takes constant time. Changing the store
+ * copies the list items and quanta it changes from then on, while the
+ * snapshot must not be changed at all; bchd_store_trim drops it.
+ * The snapshot uses the callbacks of the store, so the store may not fill
+ * quanta from or swap them out to places that depend on their offset.
+ */
+void bchd_store_snapshot(struct bchd_store *store, struct bchd_store *snap)
+{
+    *snap = *store;
+    snap->parent = store;
+    if (snap->data != NULL) {
+        snap->data->refs++;
+    }
+}
+
+/*
+ * Make shadow an empty store with the settings of store, to build new contents
+ * in while store keeps its own; bchd_store_exchange swaps them.
+ * Like a snapshot, it uses the callbacks of store.
+ */
+void bchd_store_shadow(struct bchd_store *store, struct bchd_store *shadow)
+{
+    *shadow = *store;
+    shadow->data = NULL;
+    shadow->size = 0;
+    shadow->fill_size = 0;
+    shadow->parent = store;
+}
+
+/* Exchange the contents of store and its shadow */
+void bchd_store_exchange(struct bchd_store *store, struct bchd_store *shadow)
+{
+    struct bchd_qset *data = store->data;
+    unsigned long size = store->size;
+    unsigned long fill_size = store->fill_size;
+
+    store->data = shadow->data;
+    store->size = shadow->size;
+    store->fill_size = shadow->fill_size;
+    shadow->data = data;
+    shadow->size = size;
+    shadow->fill_size = fill_size;
+}
+
+/*
+ * Copy data from the store at *f_pos to the user buffer.
+ * Only up to the end of the quantum *f_pos is in is read,
+ * so the caller has to loop (as read(2) callers do anyway).
+ * Returns the amount read, 0 at the end of the data and for holes.
+ */
+ssize_t bchd_store_read(struct bchd_store *store, char __user *buf, size_t count, loff_t *f_pos)
+{
+    int quantum_size = store->quantum_size;
+    struct bchd_pos pos;
+    char *quantum;
+
+    if (*f_pos >= store->size) {
+        return 0;
+    }
+    if (*f_pos + count > store->size) {
+        count = store->size - *f_pos;
+    }
+
+    bchd_store_locate(store, *f_pos, &pos);
+    quantum = bchd_store_quantum(store, &pos, 0);
+    if (quantum == NULL) {
+        return 0; /* We do not fill holes */
+    }
+
+    /* Read only up to the end of this quantum */
+    if (count > quantum_size - pos.q_pos) {
+        count = quantum_size - pos.q_pos;
+    }
+
+    if (copy_to_user(buf, quantum + pos.q_pos, count)) {
+        return -EFAULT;
+    }
+    *f_pos += count;
+    bchd_stat_add(store->stats, BCHD_STAT_READ_BYTES, count);
+    return count;
+}
+
+/*
+ * Copy data from the user buffer into the store at *f_pos,
+ * allocating the list item, quantum set and quantum if necessary.
+ * Like bchd_store_read, this stops at the end of the quantum.
+ */
+ssize_t bchd_store_write(struct bchd_store *store, const char __user *buf, size_t count,
+                         loff_t *f_pos)
+{
+    int quantum_size = store->quantum_size;
+    struct bchd_pos pos;
+    char *quantum;
+
+    bchd_store_locate(store, *f_pos, &pos);
+    quantum = bchd_store_quantum(store, &pos, BCHD_QUANTUM_CREATE | BCHD_QUANTUM_DIRTY);
+    if (quantum == NULL) {
+        return -ENOMEM;
+    }
+
+    /* Write only up to the end of this quantum */
+    if (count > quantum_size - pos.q_pos) {
+        count = quantum_size - pos.q_pos;
+    }
+
+    if (copy_from_user(quantum + pos.q_pos, buf, count)) {
+        return -EFAULT;
+    }
+    *f_pos += count;
+    bchd_stat_add(store->stats, BCHD_STAT_WRITE_BYTES, count);
+
+    /* Update the size */
+    if (store->size < *f_pos) {
+        store->size = *f_pos;
+    }
+    return count;
+}
+
+/*
+ * Read the next word starting from *pos into word (a buffer of len bytes)
+ * and advance *pos behind it.
+ * A word is a sequence of characters followed by ' ' or '\n'.
+ * Only up to len - 1 characters are examined, since word is terminated with '\0'.
+ * If we already read all stored words, we start again at the beginning.
+ *
+ * Returns the length of the word or -ENODATA if the store is empty or
+ * *pos is in a hole; in the latter case *pos is moved to the next quantum.
+ */
+int bchd_store_next_word(struct bchd_store *store, int *pos, char *word, int len)
+{
+    char *quantum;
+    int quantum_size = store->quantum_size;
+    int max_cnt = len;
+    struct bchd_pos p;
+    int w = 0;  /* index to the word string */
+    int i;      /* index used for counting how many characters we already read */
+
+    if (store->size == 0) {
+        return -ENODATA;
+    }
+    /*
+     * We have +1 here since we read <= max_cnt - 1 characters due to storing '\0' in the
+     * string that we write into the kernel log later.
+     */
+    if (*pos + 1 >= store->size) {
+        *pos = 0;
+    }
+    if (*pos + max_cnt > store->size) {
+        max_cnt = store->size - *pos;
+    }
+
+    bchd_store_locate(store, *pos, &p);
+
+    quantum = bchd_store_quantum(store, &p, 0);
+    if (quantum == NULL) {
+        *pos += quantum_size - p.q_pos;
+        return -ENODATA;
+    }
+
+    /* Read only up to the end of this quantum */
+    if (max_cnt > quantum_size - p.q_pos) {
+        max_cnt = quantum_size - p.q_pos;
+    }
+
+    /*
+     * Read a word (i.e. until we encounter ' ' or '\n')
+     * or until we have advanced max_cnt - 1 (keep '\0' in mind) positions.
+     */
+    for (i = 0; i < max_cnt - 1; i++) {
+        int c = quantum[p.q_pos + i];
+        if (c == ' ' || c == '\n') { /* end of word */
+            word[w] = ' ';
+            w++;
+            (*pos)++;
+            break;
+        }
+        /*
+         * These are the ASCII values we accept as word characters.
+         * ' ' is the integer 32 and '~' is the integer 126,
+         * that is, we accept all ASCII values in between (and including) these two.
+         * We ignore everything else.
+         *
+         * NOTE: This might not work on non-ASCII systems!
+         */
+        if (c >= ' ' || c <= '~') {
+            word[w] = c;
+            w++;
+            (*pos)++;
+        }
+    }
+    word[w] = '\0';
+
+    if (i == max_cnt - 1) {
+        (*pos)++;
+    }
+    return w;
+}
@@ -0,0 +1,104 @@
+/*
+ * bchd_storage.h -- the storage engine of bchd
+ *
+ * The storage engine keeps the data of a device and knows nothing about
+ * files, locking or logging. The caller serializes all calls on a store.
+ * It is compiled into the module and, with BCHD_USERSPACE defined,
+ * into a userspace library (see bchd_user.h).
+ */
+
+#ifndef _BCHD_STORAGE_H_
+#define _BCHD_STORAGE_H_
+
+#include "bchd_stats.h"
+
+/*
+ * The data of a bchd device is represented using a linked list.
+ * Each list item contains an array of pointers, called quantum set,
+ * where each pointer points to a memory area, called a quantum.
+ * The sizes of a quantum set and a quantum are attributes of the bchd_store struct.
+ */
+struct bchd_qset {
+    void **data;
+    unsigned long *dirty;       /* Quanta not written back yet, if the store tracks that */
+    unsigned long *accessed;    /* Quanta used since the bit was cleared ... */
+    unsigned long *compressed;  /* ... the ones that are a bchd_cquantum ... */
+    unsigned long *swapped;     /* ... the ones swapped out, their slot is NULL ... */
+    unsigned long *shared;      /* ... and the ones shared with other quanta (if it tracks that) */
+    struct bchd_qset *next;
+
+    /* Sharing with snapshots, see bchd_store_snapshot */
+    unsigned int refs;          /* Stores and list items whose next or origin it is */
+    unsigned long *cow;         /* Quanta that belong to origin (NULL if none ever did) */
+    struct bchd_qset *origin;   /* The item this one is a copy of ... */
+    struct bchd_qset *copy;     /* ... and the other way round */
+};
+
+/* A compressed quantum (see bchd_compress.c) */
+struct bchd_cquantum {
+    u32 len;                    /* of data */
+    u8 data[];
+};
+
+struct bchd_store {
+    struct bchd_qset *data;     /* Pointer to first quantum set */
+    int quantum_size;           /* Amount of bytes per quantum */
+    int qset_size;              /* Amount of pointers in a quantum set */
+    unsigned long size;         /* Amount of data (in bytes) stored here */
+    struct bchd_stats __percpu *stats;  /* Where we count allocations etc. */
+
+    /* An optional backing store (see bchd_backing.c), all off after bchd_store_init */
+    bool track_dirty;           /* Keep the dirty bitmaps of the quantum sets */
+    unsigned long fill_size;    /* Missing quanta below this offset ... */
+    int (*fill)(struct bchd_store *store, loff_t off, void *quantum);  /* ... are read by fill */
+
+    /* Optional tiering of cold quanta (see bchd_tier.c), all off after bchd_store_init */
+    bool track_access;          /* Keep the accessed, compressed, swapped and shared bitmaps */
+    int (*decompress)(struct bchd_store *store, const struct bchd_cquantum *cq, void *quantum);
+    int (*swap_in)(struct bchd_store *store, loff_t off, void *quantum);
+    void (*release)(struct bchd_store *store, void *quantum);   /* Drop a shared quantum */
+
+    struct bchd_store *parent;  /* A snapshot or shadow: the store it belongs to, whose callbacks it uses */
+};
+
+/* Flags of bchd_store_quantum */
+#define BCHD_QUANTUM_CREATE 0x1 /* Allocate the quantum if it is missing */
+#define BCHD_QUANTUM_DIRTY 0x2  /* It is modified: mark it dirty (if the store tracks that), unshare it */
+
+/* The position of a byte in the list, see bchd_store_locate */
+struct bchd_pos {
+    int item;                   /* Index of the list item */
+    int qset_pos;               /* Index of the quantum in the quantum set */
+    int q_pos;                  /* Offset in the quantum */
+};
+
+/* Find list item, qset index and quantum index (i.e. offset in the quantum) */
+static inline void bchd_store_locate(const struct bchd_store *store, loff_t off,
+                                     struct bchd_pos *pos)
+{
+    long item_size = (long) store->quantum_size * store->qset_size;
+    long rest;
+
+    pos->item = (long) off / item_size;
+    rest = (long) off % item_size;
+    pos->qset_pos = rest / store->quantum_size;
+    pos->q_pos = rest % store->quantum_size;
+}
+
+void bchd_store_init(struct bchd_store *store, int quantum_size, int qset_size,
+                     struct bchd_stats __percpu *stats);
+void bchd_store_trim(struct bchd_store *store);
+bool bchd_store_trim_some(struct bchd_store *store, int n);
+struct bchd_qset * bchd_follow(struct bchd_store *store, int n);
+void * bchd_store_quantum(struct bchd_store *store, const struct bchd_pos *pos, int flags);
+int bchd_store_reserve(struct bchd_store *store, unsigned long size);
+void * bchd_store_unshare(struct bchd_store *store, struct bchd_qset *dptr, int j);
+void bchd_store_snapshot(struct bchd_store *store, struct bchd_store *snap);
+void bchd_store_shadow(struct bchd_store *store, struct bchd_store *shadow);
+void bchd_store_exchange(struct bchd_store *store, struct bchd_store *shadow);
+ssize_t bchd_store_read(struct bchd_store *store, char __user *buf, size_t count, loff_t *f_pos);
+ssize_t bchd_store_write(struct bchd_store *store, const char __user *buf, size_t count,
+                         loff_t *f_pos);
+int bchd_store_next_word(struct bchd_store *store, int *pos, char *word, int len);
+
+#endif /* _BCHD_STORAGE_H_ */
@@ -0,0 +1,444 @@
+/*
+ * bchd_stress -- concurrent stress and latency benchmark for /dev/bchd
+ *
+ * Runs a mix of actors against one device for a while:
+ *  -- readers:    pread whole quanta at random quantum-aligned offsets,
+ *  -- writers:    pwrite whole quanta at random offsets (opened O_RDWR, no trim),
+ *  -- truncators: open the device O_WRONLY (which trims it), write a few quanta
+ *                 from the start and close it again,
+ * while the logger of the module keeps splitting the contents into words.
+ * Each actor reports its throughput and latency percentiles (for truncators,
+ * the latency of the trimming open). If the debugfs directory of the device
+ * is readable, the latency of the logger work during the run is reported too.
+ *
+ * Every quantum is written with a single write, which the module does
+ * under the device lock, so a read sees either a hole (0 bytes) or a
+ * whole quantum as some actor wrote it. Each quantum carries its index
+ * and a tag the rest of its bytes are derived from; readers check both.
+ * The exit status is 1 if any check failed.
+ *
+ * Usage: see bchd_stress -h
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+enum stress_actor { READER, WRITER, TRUNCATOR, NR_ACTORS };
+
+static const char * const actor_names[NR_ACTORS] = {
+    "reader", "writer", "truncator",
+};
+
+struct stress_thread {
+    pthread_t tid;
+    enum stress_actor actor;
+    int index;
+    uint64_t *lat;              /* latency of each operation in ns */
+    size_t nr_lat;
+    size_t max_lat;
+    uint64_t bytes;             /* bytes transferred */
+    uint64_t holes;             /* reads that found no data */
+    uint64_t errors;            /* failed operations and integrity checks */
+};
+
+static const char *device = "/dev/bchd";
+static const char *debugfs = "/sys/kernel/debug/bchd/bchd0";
+static size_t quantum_size;
+static size_t area = 4 << 20;   /* bytes the actors work on */
+static int truncate_blocks = 4; /* quanta a truncator writes after opening */
+static int truncate_interval = 100;     /* ms between truncating opens */
+static volatile int stop;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* xorshift, good enough to pick offsets */
+static uint64_t next_rand(uint64_t *state)
+{
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static void add_lat(struct stress_thread *t, uint64_t ns)
+{
+    if (t->nr_lat == t->max_lat) {
+        t->max_lat = t->max_lat ? 2 * t->max_lat : 4096;
+        t->lat = realloc(t->lat, t->max_lat * sizeof(uint64_t));
+        if (t->lat == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    t->lat[t->nr_lat++] = ns;
+}
+
+/*
+ * The contents of quantum idx written with tag:
+ * the index and the tag, then bytes derived from the tag.
+ */
+static void fill_quantum(unsigned char *buf, uint32_t idx, uint32_t tag)
+{
+    size_t i;
+
+    memcpy(buf, &idx, sizeof(idx));
+    memcpy(buf + sizeof(idx), &tag, sizeof(tag));
+    for (i = 2 * sizeof(uint32_t); i < quantum_size; i++) {
+        buf[i] = (tag >> (i % 4 * 8)) + i;
+    }
+}
+
+static int check_quantum(const unsigned char *buf, uint32_t idx)
+{
+    uint32_t got_idx, tag;
+    size_t i;
+
+    memcpy(&got_idx, buf, sizeof(got_idx));
+    memcpy(&tag, buf + sizeof(got_idx), sizeof(tag));
+    if (got_idx != idx) {
+        return -1;
+    }
+    for (i = 2 * sizeof(uint32_t); i < quantum_size; i++) {
+        if (buf[i] != (unsigned char) ((tag >> (i % 4 * 8)) + i)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void *stress_thread_fn(void *arg)
+{
+    struct stress_thread *t = arg;
+    uint64_t seed = 0x9e3779b97f4a7c15ULL * (t->index + 1) + t->actor;
+    size_t nr_quanta = area / quantum_size;
+    unsigned char *buf = malloc(quantum_size);
+    uint64_t start;
+    uint32_t idx;
+    ssize_t ret;
+    int fd = -1, i;
+
+    if (buf == NULL) {
+        t->errors++;
+        return NULL;
+    }
+    if (t->actor != TRUNCATOR) {
+        fd = open(device, t->actor == READER ? O_RDONLY : O_RDWR);
+        if (fd < 0) {
+            t->errors++;
+            free(buf);
+            return NULL;
+        }
+    }
+
+    while (!stop) {
+        idx = next_rand(&seed) % nr_quanta;
+        switch (t->actor) {
+        case READER:
+            start = now_ns();
+            ret = pread(fd, buf, quantum_size, (off_t) idx * quantum_size);
+            add_lat(t, now_ns() - start);
+            if (ret == 0) {
+                t->holes++;
+            } else if (ret != (ssize_t) quantum_size || check_quantum(buf, idx) != 0) {
+                if (t->errors++ == 0) {
+                    fprintf(stderr, "reader %d: quantum %u is corrupt (read %zd)\n", t->index, idx, ret);
+                }
+            } else {
+                t->bytes += ret;
+            }
+            break;
+        case WRITER:
+            fill_quantum(buf, idx, next_rand(&seed));
+            start = now_ns();
+            ret = pwrite(fd, buf, quantum_size, (off_t) idx * quantum_size);
+            add_lat(t, now_ns() - start);
+            if (ret != (ssize_t) quantum_size) {
+                t->errors++;
+            } else {
+                t->bytes += ret;
+            }
+            break;
+        case TRUNCATOR:
+            start = now_ns();
+            fd = open(device, O_WRONLY);
+            add_lat(t, now_ns() - start);
+            if (fd < 0) {
+                t->errors++;
+                break;
+            }
+            for (i = 0; i < truncate_blocks && (size_t) i < nr_quanta; i++) {
+                fill_quantum(buf, i, next_rand(&seed));
+                if (write(fd, buf, quantum_size) != (ssize_t) quantum_size) {
+                    t->errors++;
+                    break;
+                }
+                t->bytes += quantum_size;
+            }
+            close(fd);
+            fd = -1;
+            usleep(truncate_interval * 1000);
+            break;
+        default:
+            break;
+        }
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(buf);
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(const uint64_t *v, size_t n, int permille)
+{
+    size_t i = (n * permille + 999) / 1000;
+
+    if (n == 0) {
+        return 0;
+    }
+    return v[i == 0 ? 0 : i - 1];
+}
+
+/* Read a number from a file, e.g. a module parameter; returns 0 if that fails */
+static long read_number(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    long n = 0;
+
+    if (f != NULL) {
+        if (fscanf(f, "%ld", &n) != 1) {
+            n = 0;
+        }
+        fclose(f);
+    }
+    return n;
+}
+
+/* Reset the latency histograms of the device; fails silently without debugfs */
+static void reset_logger_latency(void)
+{
+    char path[256];
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s/latency", debugfs);
+    f = fopen(path, "w");
+    if (f != NULL) {
+        fputs("reset\n", f);
+        fclose(f);
+    }
+}
+
+/* Print the logger line of the latency file of the device as JSON, or null */
+static void print_logger_latency(void)
+{
+    unsigned long long total, p50, p99, p999, max;
+    char path[256], line[512];
+    int found = 0;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s/latency", debugfs);
+    f = fopen(path, "r");
+    if (f != NULL) {
+        while (!found && fgets(line, sizeof(line), f) != NULL) {
+            found = sscanf(line, "logger %llu %llu %llu %llu %llu",
+                           &total, &p50, &p99, &p999, &max) == 5;
+        }
+        fclose(f);
+    }
+    if (!found) {
+        printf("null");
+        return;
+    }
+    printf("{\"runs\": %llu, \"lat_ns\": {\"p50\": %llu, \"p99\": %llu, \"p999\": %llu, "
+           "\"max\": %llu}}", total, p50, p99, p999, max);
+}
+
+static int parse_size(const char *s, size_t *size)
+{
+    char *end;
+
+    *size = strtoull(s, &end, 0);
+    switch (*end) {
+    case 'k': case 'K':
+        *size <<= 10;
+        end++;
+        break;
+    case 'm': case 'M':
+        *size <<= 20;
+        end++;
+        break;
+    case 'g': case 'G':
+        *size <<= 30;
+        end++;
+        break;
+    }
+    return *end == '\0' && *size > 0 ? 0 : -1;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-d device] [-l debugfs dir] [-q quantum] [-a area] [-D seconds]\n"
+            "          [-r readers] [-w writers] [-T truncators] [-n quanta] [-i ms]\n"
+            "  -d  device to test (default /dev/bchd)\n"
+            "  -l  debugfs directory of the device, for the logger latency\n"
+            "      (default /sys/kernel/debug/bchd/bchd0)\n"
+            "  -q  quantum size of the device (default bchd_quantum_size of the module)\n"
+            "  -a  bytes the actors work on, e.g. 4m (default 4m)\n"
+            "  -D  duration in seconds (default 10)\n"
+            "  -r, -w, -T  number of readers, writers and truncators (default 4, 2, 1)\n"
+            "  -n  quanta a truncator writes after opening (default 4)\n"
+            "  -i  ms a truncator waits between opens (default 100)\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    int nr[NR_ACTORS] = { 4, 2, 1 };
+    int seconds = 10, nr_threads, opt, a, i, first = 1;
+    struct stress_thread *threads, *t;
+    uint64_t start, elapsed, errors = 0;
+
+    quantum_size = read_number("/sys/module/bchd/parameters/bchd_quantum_size");
+
+    while ((opt = getopt(argc, argv, "d:l:q:a:D:r:w:T:n:i:h")) != -1) {
+        switch (opt) {
+        case 'd':
+            device = optarg;
+            break;
+        case 'l':
+            debugfs = optarg;
+            break;
+        case 'q':
+            quantum_size = atol(optarg);
+            break;
+        case 'a':
+            if (parse_size(optarg, &area) != 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'D':
+            seconds = atoi(optarg);
+            break;
+        case 'r':
+            nr[READER] = atoi(optarg);
+            break;
+        case 'w':
+            nr[WRITER] = atoi(optarg);
+            break;
+        case 'T':
+            nr[TRUNCATOR] = atoi(optarg);
+            break;
+        case 'n':
+            truncate_blocks = atoi(optarg);
+            break;
+        case 'i':
+            truncate_interval = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return opt != 'h';
+        }
+    }
+    if (quantum_size < 2 * sizeof(uint32_t) || area < quantum_size || seconds <= 0
+        || nr[READER] < 0 || nr[WRITER] < 0 || nr[TRUNCATOR] < 0) {
+        fprintf(stderr, "%s: invalid arguments (is the module loaded? otherwise use -q)\n", argv[0]);
+        return 1;
+    }
+
+    nr_threads = nr[READER] + nr[WRITER] + nr[TRUNCATOR];
+    threads = calloc(nr_threads, sizeof(*threads));
+    if (threads == NULL) {
+        return 1;
+    }
+    reset_logger_latency();
+
+    start = now_ns();
+    for (a = 0, t = threads; a < NR_ACTORS; a++) {
+        for (i = 0; i < nr[a]; i++, t++) {
+            t->actor = a;
+            t->index = i;
+            pthread_create(&t->tid, NULL, stress_thread_fn, t);
+        }
+    }
+    sleep(seconds);
+    stop = 1;
+    for (i = 0; i < nr_threads; i++) {
+        pthread_join(threads[i].tid, NULL);
+    }
+    elapsed = now_ns() - start;
+
+    printf("{\"device\": \"%s\", \"quantum_size\": %zu, \"area\": %zu, \"seconds\": %.6f, "
+           "\"actors\": [\n", device, quantum_size, area, elapsed / 1e9);
+    for (a = 0; a < NR_ACTORS; a++) {
+        uint64_t *lat, bytes = 0, holes = 0, errs = 0;
+        size_t nr_lat = 0;
+
+        if (nr[a] == 0) {
+            continue;
+        }
+        for (i = 0; i < nr_threads; i++) {
+            if (threads[i].actor == (enum stress_actor) a) {
+                nr_lat += threads[i].nr_lat;
+            }
+        }
+        lat = malloc((nr_lat + 1) * sizeof(uint64_t));
+        for (i = 0, nr_lat = 0; i < nr_threads; i++) {
+            t = &threads[i];
+            if (t->actor == (enum stress_actor) a) {
+                memcpy(lat + nr_lat, t->lat, t->nr_lat * sizeof(uint64_t));
+                nr_lat += t->nr_lat;
+                bytes += t->bytes;
+                holes += t->holes;
+                errs += t->errors;
+            }
+        }
+        qsort(lat, nr_lat, sizeof(uint64_t), cmp_u64);
+        printf("%s  {\"actor\": \"%s\", \"threads\": %d, \"ops\": %zu, \"bytes\": %llu, "
+               "\"mib_per_s\": %.2f, \"ops_per_s\": %.0f, \"holes\": %llu, \"errors\": %llu, "
+               "\"lat_ns\": {\"p50\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu}}",
+               first ? "" : ",\n", actor_names[a], nr[a], nr_lat, (unsigned long long) bytes,
+               bytes / (elapsed / 1e9) / (1 << 20), nr_lat / (elapsed / 1e9),
+               (unsigned long long) holes, (unsigned long long) errs,
+               (unsigned long long) percentile(lat, nr_lat, 500),
+               (unsigned long long) percentile(lat, nr_lat, 990),
+               (unsigned long long) percentile(lat, nr_lat, 999),
+               (unsigned long long) (nr_lat ? lat[nr_lat - 1] : 0));
+        first = 0;
+        errors += errs;
+        free(lat);
+    }
+    printf("\n], \"logger\": ");
+    print_logger_latency();
+    printf(", \"errors\": %llu}\n", (unsigned long long) errors);
+
+    for (i = 0; i < nr_threads; i++) {
+        free(threads[i].lat);
+    }
+    free(threads);
+    return errors != 0;
+}
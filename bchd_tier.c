@@ -0,0 +1,250 @@
+/*
+ * bchd_tier.c -- moving cold quanta to cheaper tiers
+ *
+ * A quantum is in one of these tiers:
+ *  -- hot: a kmalloc'ed quantum, as always,
+ *  -- shared: a reference to an identical quantum (with bchd_dedup, see bchd_dedup.c),
+ *  -- compressed: a bchd_cquantum in its place (with bchd_compress, see bchd_compress.c),
+ *  -- swap: in the swap file of the device, an unlinked shmem file whose pages
+ *     can be swapped out, at the offset of the quantum in the device
+ *     (with bchd_tier_swap=1); the slot of the quantum is empty.
+ * A tiering work goes over the quanta of each device every bchd_tier_ms,
+ * like the clock algorithm of page reclaim:
+ *  -- bchd_store_quantum sets the accessed bit of every quantum it returns
+ *     and brings compressed and swapped quanta back to the hot tier,
+ *  -- the work clears the bit of accessed quanta and moves the ones whose
+ *     bit is already clear, that is, quanta nobody touched for a whole
+ *     interval, one tier down. A quantum that moved gets its bit set again,
+ *     so it spends at least another interval in its new tier.
+ * Quanta that do not compress well go to swap directly. Dirty quanta of a backing file
+ * are left alone until they are written back, since the writeback copies them as they are.
+ *
+ * Everything runs under the device lock, which also protects struct bchd_tier.
+ * The work drops the lock every BCHD_TIER_BATCH quanta, so reads and writes
+ * do not wait for a whole pass.
+ */
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#include <linux/jiffies.h>
+#include <linux/mm.h>
+#include <linux/sched.h>        /* cond_resched */
+#include <linux/shmem_fs.h>
+#include <linux/slab.h>
+
+#include "bchd.h"
+
+#define BCHD_TIER_BATCH 64      /* most quanta per hold of the device lock */
+
+/* Read the swapped quantum at off into buf */
+int bchd_tier_read(struct bchd_dev *dev, loff_t off, void *buf)
+{
+    ssize_t ret;
+
+    ret = kernel_read(dev->tier.swap, buf, dev->store.quantum_size, &off);
+    if (ret != dev->store.quantum_size) {
+        printk_ratelimited(KERN_WARNING "bchd%d: reading the swap file failed: %zd\n",
+                           MINOR(dev->cdev.dev) - bchd_minor, ret);
+        return ret < 0 ? ret : -EIO;
+    }
+    return 0;
+}
+
+/* The swap_in callback of the store: read the quantum back and free its place */
+static int bchd_tier_swap_in(struct bchd_store *store, loff_t off, void *quantum)
+{
+    struct bchd_dev *dev = container_of(store, struct bchd_dev, store);
+    int ret;
+
+    ret = bchd_tier_read(dev, off, quantum);
+    if (ret == 0) {
+        vfs_fallocate(dev->tier.swap, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off,
+                      store->quantum_size);
+    }
+    return ret;
+}
+
+/* Move quantum j of qs (at off in the device) from the hot or the compressed tier to swap */
+static void bchd_tier_swap_out(struct bchd_dev *dev, struct bchd_qset *qs, int j, loff_t off)
+{
+    struct bchd_store *store = &dev->store;
+    bool compressed = test_bit(j, qs->compressed);
+    void *data = qs->data[j];
+    ssize_t ret;
+
+    if (compressed) {
+        if (store->decompress(store, qs->data[j], dev->tier.buf) < 0) {
+            return;
+        }
+        data = dev->tier.buf;
+    }
+    ret = kernel_write(dev->tier.swap, data, store->quantum_size, &off);
+    if (ret != store->quantum_size) {
+        printk_ratelimited(KERN_WARNING "bchd%d: writing the swap file failed: %zd\n",
+                           MINOR(dev->cdev.dev) - bchd_minor, ret);
+        return;
+    }
+
+    if (compressed) {
+        bchd_stat_inc(dev->stats, BCHD_STAT_CQUANTUM_FREES);
+        bchd_stat_add(dev->stats, BCHD_STAT_CQUANTUM_FREE_BYTES,
+                      ((struct bchd_cquantum *) qs->data[j])->len);
+        __clear_bit(j, qs->compressed);
+    } else {
+        bchd_stat_inc(dev->stats, BCHD_STAT_QUANTUM_FREES);
+    }
+    kfree(qs->data[j]);
+    qs->data[j] = NULL;
+    __set_bit(j, qs->swapped);
+    bchd_stat_inc(dev->stats, BCHD_STAT_SWAP_OUTS);
+}
+
+/* Give quantum j of qs a second chance if it was accessed, move it down a tier otherwise */
+static void bchd_tier_quantum(struct bchd_dev *dev, struct bchd_qset *qs, int j, loff_t off)
+{
+    if (qs->data == NULL || qs->data[j] == NULL) {
+        return;         /* a hole or swapped already */
+    }
+    if (__test_and_clear_bit(j, qs->accessed)) {
+        return;
+    }
+    if (qs->dirty != NULL && test_bit(j, qs->dirty)) {
+        return;
+    }
+    if (qs->cow != NULL && test_bit(j, qs->cow)) {
+        return;         /* a snapshot's, see bchd_snap.c */
+    }
+    if (test_bit(j, qs->shared)) {
+        /* Stay shared, unless nobody else wanted it and there is a tier below */
+        if ((dev->tier.tfm == NULL && dev->tier.swap == NULL) || !bchd_dedup_alone(qs->data[j])
+            || bchd_store_unshare(&dev->store, qs, j) == NULL) {
+            return;
+        }
+    } else if (bchd_dedup && !test_bit(j, qs->compressed) && bchd_dedup_quantum(dev, qs, j)) {
+        __set_bit(j, qs->accessed);
+        return;
+    }
+    if (!test_bit(j, qs->compressed) && dev->tier.tfm != NULL
+        && bchd_compress_quantum(dev, qs, j)) {
+        __set_bit(j, qs->accessed);
+        return;
+    }
+    if (dev->tier.swap != NULL) {
+        bchd_tier_swap_out(dev, qs, j, off);
+    }
+}
+
+static void bchd_tier_work(struct work_struct *ws)
+{
+    struct bchd_dev *dev = container_of(ws, struct bchd_dev, tier.ws.work);
+    struct bchd_store *store = &dev->store;
+    long item_size = (long) store->quantum_size * store->qset_size;
+    struct bchd_qset *qs;
+    u64 start = ktime_get_ns();
+    int item = 0, j = 0, i, n;
+
+    for (;;) {
+        if (bchd_lock(dev, BCHD_LOCK_TIER)) {
+            break;
+        }
+        /* Find our place again, the list may have been trimmed meanwhile */
+        for (qs = store->data, i = 0; qs != NULL && i < item; i++) {
+            qs = qs->next;
+        }
+        for (n = 0; qs != NULL && n < BCHD_TIER_BATCH; n++) {
+            bchd_tier_quantum(dev, qs, j, item * item_size + (loff_t) j * store->quantum_size);
+            if (++j == store->qset_size) {
+                j = 0;
+                item++;
+                qs = qs->next;
+            }
+        }
+        bchd_unlock(dev);
+        if (qs == NULL) {
+            break;
+        }
+        cond_resched();
+    }
+    bchd_lat_record(dev->stats, BCHD_LAT_TIER, start);
+    queue_delayed_work(bchd_wq, &dev->tier.ws, msecs_to_jiffies(bchd_tier_ms));
+}
+
+/* Set up the tiers of the device (if any tier besides hot is on); called before it is used */
+int bchd_tier_init(struct bchd_dev *dev, int index)
+{
+    struct bchd_store *store = &dev->store;
+    struct file *file;
+    char name[24];
+    int result;
+
+    INIT_DELAYED_WORK(&dev->tier.ws, bchd_tier_work);
+    if ((bchd_compress == NULL || bchd_compress[0] == '\0') && !bchd_tier_swap && !bchd_dedup) {
+        return 0;
+    }
+    if (bchd_shmem) {
+        return 0;       /* all of it is swappable anyway */
+    }
+
+    /* Compressed quanta are decompressed into buf on their way to swap, too */
+    dev->tier.buf = kmalloc(store->quantum_size, GFP_KERNEL);
+    if (dev->tier.buf == NULL) {
+        return -ENOMEM;
+    }
+    result = bchd_compress_init(dev, index);
+    if (result < 0) {
+        goto fail;
+    }
+    bchd_dedup_init(dev);
+    if (bchd_tier_swap) {
+        snprintf(name, sizeof(name), "bchd%d-swap", index);
+        file = shmem_file_setup(name, 0, VM_NORESERVE);
+        if (IS_ERR(file)) {
+            printk(KERN_WARNING "bchd%d: can't create swap file: %ld\n", index, PTR_ERR(file));
+            result = PTR_ERR(file);
+            goto fail;
+        }
+        dev->tier.swap = file;
+        store->swap_in = bchd_tier_swap_in;
+    }
+    store->track_access = true;
+    queue_delayed_work(bchd_wq, &dev->tier.ws, msecs_to_jiffies(bchd_tier_ms));
+    return 0;
+
+fail:
+    bchd_tier_exit(dev);
+    return result;
+}
+
+/* The device was trimmed, so is the swap file; called with the device lock held */
+void bchd_tier_trim(struct bchd_dev *dev)
+{
+    if (dev->tier.swap != NULL) {
+        vfs_truncate(&dev->tier.swap->f_path, 0);
+    }
+}
+
+/* Stop moving quanta; the ones moved already still come back on access */
+void bchd_tier_stop(struct bchd_dev *dev)
+{
+    cancel_delayed_work_sync(&dev->tier.ws);
+}
+
+/* Free the tiers; the store must be trimmed */
+void bchd_tier_exit(struct bchd_dev *dev)
+{
+    bchd_compress_exit(dev);
+    if (dev->tier.swap != NULL) {
+        fput(dev->tier.swap);
+        dev->tier.swap = NULL;
+    }
+    kfree(dev->tier.buf);
+    dev->tier.buf = NULL;
+}
+
+/* Bytes of the swap file in memory (the rest is swapped out) */
+unsigned long bchd_tier_swap_resident(struct bchd_dev *dev)
+{
+    return file_inode(dev->tier.swap)->i_mapping->nrpages << PAGE_SHIFT;
+}
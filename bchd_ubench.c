@@ -0,0 +1,177 @@
+/*
+ * bchd_ubench -- microbenchmark of the bchd storage engine in userspace
+ *
+ * Runs the storage engine (bchd_storage.c built with BCHD_USERSPACE, see bchd_user.h)
+ * without the module, so it can be profiled with perf or checked with valgrind:
+ *  -- write:    filling the store with requests of the given size
+ *  -- seqread:  reading it back sequentially
+ *  -- randread: reading at random offsets (dominated by following the list)
+ *  -- locate:   decoding random offsets into list item, quantum and offset
+ *  -- follow:   bchd_follow to random list items
+ *  -- words:    splitting the contents into words like the logger does
+ *  -- trim:     freeing everything
+ * The results are printed as JSON, like bchd_bench does.
+ *
+ * Usage: bchd_ubench [-q quantum] [-Q qset] [-b bytes] [-s request size] [-n rounds]
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include "bchd_storage.h"
+
+static volatile u64 sink;
+
+static u64 now_ns(void)
+{
+    return ktime_get_ns();
+}
+
+static void report(const char *name, u64 ops, u64 bytes, u64 ns, int *first)
+{
+    printf("%s  {\"name\": \"%s\", \"ops\": %llu, \"ns_per_op\": %.1f, \"mib_per_s\": %.2f}",
+           *first ? "" : ",\n", name, (unsigned long long) ops,
+           ops ? (double) ns / ops : 0.0,
+           ns ? bytes / (ns / 1e9) / (1 << 20) : 0.0);
+    *first = 0;
+}
+
+/* xorshift, good enough to pick offsets */
+static u64 next_rand(u64 *state)
+{
+    u64 x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+int main(int argc, char **argv)
+{
+    static const char text[] = "Write in C, write in C, everything is fine.\n";
+    int quantum_size = 4000, qset_size = 1000;
+    size_t bytes = 64 << 20, size = 4096;
+    int rounds = 1;
+    struct bchd_stats *stats;
+    struct bchd_store store;
+    char *buf, word[20];
+    u64 seed = 0x9e3779b97f4a7c15ULL;
+    u64 start, ops, done;
+    struct bchd_pos p;
+    loff_t pos;
+    ssize_t ret;
+    u64 sum;
+    int opt, r, first = 1, log_pos, nr_items;
+    size_t i;
+
+    while ((opt = getopt(argc, argv, "q:Q:b:s:n:")) != -1) {
+        switch (opt) {
+        case 'q':
+            quantum_size = atoi(optarg);
+            break;
+        case 'Q':
+            qset_size = atoi(optarg);
+            break;
+        case 'b':
+            bytes = strtoull(optarg, NULL, 0);
+            break;
+        case 's':
+            size = strtoull(optarg, NULL, 0);
+            break;
+        case 'n':
+            rounds = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-q quantum] [-Q qset] [-b bytes] [-s request size] "
+                    "[-n rounds]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (quantum_size <= 0 || qset_size <= 0 || bytes == 0 || size == 0 || rounds <= 0) {
+        fprintf(stderr, "%s: invalid arguments\n", argv[0]);
+        return 1;
+    }
+
+    buf = malloc(size);
+    stats = alloc_percpu(struct bchd_stats);
+    if (buf == NULL || stats == NULL) {
+        return 1;
+    }
+    for (i = 0; i < size; i++) {
+        buf[i] = text[i % (sizeof(text) - 1)];
+    }
+    bchd_store_init(&store, quantum_size, qset_size, stats);
+    nr_items = (bytes + (size_t) quantum_size * qset_size - 1) / ((size_t) quantum_size * qset_size);
+
+    printf("{\"quantum_size\": %d, \"qset_size\": %d, \"bytes\": %zu, \"size\": %zu, "
+           "\"results\": [\n", quantum_size, qset_size, bytes, size);
+    for (r = 0; r < rounds; r++) {
+        /* write */
+        start = now_ns();
+        for (pos = 0, ops = 0; pos < (loff_t) bytes; ops++) {
+            ret = bchd_store_write(&store, buf, size, &pos);
+            if (ret < 0) {
+                fprintf(stderr, "write failed: %zd\n", ret);
+                return 1;
+            }
+        }
+        report("write", ops, bytes, now_ns() - start, &first);
+
+        /* seqread */
+        start = now_ns();
+        for (pos = 0, ops = 0; bchd_store_read(&store, buf, size, &pos) > 0; ops++) {
+            ;
+        }
+        report("seqread", ops, bytes, now_ns() - start, &first);
+
+        /* randread */
+        start = now_ns();
+        for (ops = 0, done = 0; done < bytes; ops++) {
+            pos = next_rand(&seed) % bytes;
+            ret = bchd_store_read(&store, buf, size, &pos);
+            done += ret > 0 ? ret : 1;
+        }
+        report("randread", ops, done, now_ns() - start, &first);
+
+        /* locate; keep the results, so the compiler cannot drop the loop */
+        start = now_ns();
+        for (ops = 0, sum = 0; ops < (bytes + size - 1) / size; ops++) {
+            bchd_store_locate(&store, next_rand(&seed) % bytes, &p);
+            sum += p.item + p.qset_pos + p.q_pos;
+        }
+        sink = sum;
+        report("locate", ops, 0, now_ns() - start, &first);
+
+        /* follow, as often as we wrote */
+        start = now_ns();
+        for (ops = 0; ops < (bytes + size - 1) / size; ops++) {
+            if (bchd_follow(&store, next_rand(&seed) % nr_items) == NULL) {
+                return 1;
+            }
+        }
+        report("follow", ops, 0, now_ns() - start, &first);
+
+        /* words: one pass over the contents */
+        start = now_ns();
+        for (ops = 0, log_pos = 0; ; ops++) {
+            int prev = log_pos;
+
+            bchd_store_next_word(&store, &log_pos, word, sizeof(word));
+            if (log_pos <= prev) {
+                break;  /* wrapped around */
+            }
+        }
+        report("words", ops, bytes, now_ns() - start, &first);
+
+        /* trim */
+        start = now_ns();
+        bchd_store_trim(&store);
+        report("trim", 1, bytes, now_ns() - start, &first);
+    }
+    printf("\n]}\n");
+
+    free_percpu(stats);
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,654 @@
+/*
+ * bchd_ufuzz -- fuzz harness for the bchd storage engine in userspace
+ *
+ * Runs random sequences of writes, reads, trims and word lookups, snapshots
+ * and exchanges with a shadow store on a store with a small random geometry
+ * and compares every read with a flat reference copy of the data. Holes
+ * (quanta never written) read as 0 bytes and bytes of a quantum that were
+ * never written read as zeros. Three runs in four also tier the store like
+ * bchd_tier.c, with compression, dedup or both, in between.
+ *
+ * By default the operations come from a pseudo random generator:
+ *     bchd_ufuzz [-s seed] [-n runs] [-e] [-t threads]
+ * Built with -DBCHD_LIBFUZZER (and clang -fsanitize=fuzzer) the operations
+ * are decoded from the fuzzer input instead.
+ *
+ * Before the random runs, -e checks fixed cases at the edges of quanta and
+ * quantum sets and sparse writes for several geometries, and -t runs
+ * threads that share one store (serialized by a mutex, like the device lock),
+ * each checking its own region.
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "bchd_storage.h"
+
+#define FUZZ_MAX_SIZE 4096      /* we stay below this offset */
+#define FUZZ_OPS 2000           /* operations per run */
+#define FUZZ_SNAPS 2            /* snapshots kept at a time */
+
+/* Tiers of a run besides hot */
+#define FUZZ_COMPRESS 0x1
+#define FUZZ_DEDUP 0x2
+
+/* Where the operations come from: fuzzer input or a seed */
+struct fuzz_src {
+    const u8 *data;
+    size_t len;
+    u64 seed;
+};
+
+static u64 fuzz_next(struct fuzz_src *src, u64 range)
+{
+    u64 x;
+
+    if (src->data != NULL) {
+        if (src->len < 2) {
+            return 0;
+        }
+        x = src->data[0] | src->data[1] << 8;
+        src->data += 2;
+        src->len -= 2;
+    } else {
+        x = src->seed;
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        src->seed = x;
+    }
+    return range ? x % range : 0;
+}
+
+static int fuzz_done(struct fuzz_src *src)
+{
+    return src->data != NULL && src->len < 2;
+}
+
+#define FUZZ_CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "bchd_ufuzz: " __VA_ARGS__); \
+        fprintf(stderr, " (quantum %d, qset %d, op %d)\n", quantum_size, qset_size, op); \
+        abort(); \
+    } \
+} while (0)
+
+/* What a store should hold */
+struct fuzz_model {
+    u8 ref[FUZZ_MAX_SIZE];      /* reference copy of the data, zeros if not written */
+    u8 present[FUZZ_MAX_SIZE];  /* is the quantum allocated? (by quantum index) */
+    unsigned long size;
+};
+
+/* Write random data at a random offset of store and to model */
+static void fuzz_write(struct fuzz_src *src, struct bchd_store *store, struct fuzz_model *m,
+                       int op)
+{
+    int quantum_size = store->quantum_size, qset_size = store->qset_size;
+    u8 buf[64];
+    loff_t pos = fuzz_next(src, FUZZ_MAX_SIZE - 64);
+    size_t count = 1 + fuzz_next(src, 64), i, expect;
+    int q = pos / quantum_size;
+    ssize_t ret;
+
+    for (i = 0; i < count; i++) {
+        buf[i] = fuzz_next(src, 256);
+    }
+    expect = quantum_size - pos % quantum_size;
+    expect = count < expect ? count : expect;
+    ret = bchd_store_write(store, (char *) buf, count, &pos);
+    FUZZ_CHECK(ret == (ssize_t) expect, "write returned %zd, expected %zu", ret, expect);
+    memcpy(m->ref + pos - ret, buf, ret);
+    m->present[q] = 1;
+    if (m->size < (unsigned long) pos) {
+        m->size = pos;
+    }
+    FUZZ_CHECK(store->size == m->size, "size %lu, expected %lu", store->size, m->size);
+}
+
+/* Read at a random offset of store and compare with model */
+static void fuzz_read(struct fuzz_src *src, struct bchd_store *store, struct fuzz_model *m,
+                      int op)
+{
+    int quantum_size = store->quantum_size, qset_size = store->qset_size;
+    u8 buf[64];
+    loff_t pos = fuzz_next(src, FUZZ_MAX_SIZE);
+    size_t count = 1 + fuzz_next(src, 64), i, expect;
+    int q = pos / quantum_size;
+    ssize_t ret;
+
+    if ((unsigned long) pos >= m->size || !m->present[q]) {
+        expect = 0;
+    } else {
+        expect = quantum_size - pos % quantum_size;
+        expect = count < expect ? count : expect;
+        expect = m->size - pos < expect ? m->size - pos : expect;
+    }
+    ret = bchd_store_read(store, (char *) buf, count, &pos);
+    FUZZ_CHECK(ret == (ssize_t) expect, "read returned %zd, expected %zu", ret, expect);
+    for (i = 0; i < (size_t) ret; i++) {
+        size_t off = pos - ret + i;
+
+        FUZZ_CHECK(buf[i] == m->ref[off], "data differs at %zu", off);
+    }
+}
+
+/*
+ * Tiering in userspace, in place of bchd_compress.c, bchd_dedup.c and the pass
+ * of bchd_tier.c. The compression is a run-length code, which the zeros the
+ * short writes leave in most quanta make worthwhile. The dedup table holds the
+ * quanta of the current run, which all have its quantum size.
+ */
+struct fuzz_dquantum {
+    struct fuzz_dquantum *next;
+    unsigned long refs;         /* slots referring to it */
+    u8 data[];
+};
+
+static struct fuzz_dquantum *fuzz_dedup_table;
+
+static struct fuzz_dquantum * fuzz_dquantum(void *quantum)
+{
+    return (struct fuzz_dquantum *) ((u8 *) quantum - offsetof(struct fuzz_dquantum, data));
+}
+
+/* The decompress callback of the store */
+static int fuzz_decompress(struct bchd_store *store, const struct bchd_cquantum *cq,
+                           void *quantum)
+{
+    int len = 0;
+    u32 i;
+
+    for (i = 0; i + 1 < cq->len; i += 2) {
+        if (len + cq->data[i] > store->quantum_size) {
+            return -EIO;
+        }
+        memset((u8 *) quantum + len, cq->data[i + 1], cq->data[i]);
+        len += cq->data[i];
+    }
+    return len == store->quantum_size ? 0 : -EIO;
+}
+
+/* Compress quantum j of qs like bchd_compress_quantum; returns whether it was worth it */
+static bool fuzz_compress(struct bchd_store *store, struct bchd_qset *qs, int j)
+{
+    const u8 *quantum = qs->data[j];
+    int max = store->quantum_size - store->quantum_size / 8;
+    struct bchd_cquantum *cq;
+    u8 buf[2 * 17];
+    int i, run, len = 0;
+
+    for (i = 0; i < store->quantum_size; i += run) {
+        for (run = 1; i + run < store->quantum_size && quantum[i + run] == quantum[i]; run++) {
+        }
+        if (len + 2 > max) {
+            return false;
+        }
+        buf[len++] = run;
+        buf[len++] = quantum[i];
+    }
+    cq = kmalloc(sizeof(*cq) + len, GFP_KERNEL);
+    cq->len = len;
+    memcpy(cq->data, buf, len);
+    kfree(qs->data[j]);
+    qs->data[j] = cq;
+    __set_bit(j, qs->compressed);
+    bchd_stat_inc(store->stats, BCHD_STAT_QUANTUM_FREES);
+    bchd_stat_inc(store->stats, BCHD_STAT_COMPRESSIONS);
+    return true;
+}
+
+/* Replace quantum j of qs with a reference into the table like bchd_dedup_quantum */
+static void fuzz_dedup(struct bchd_store *store, struct bchd_qset *qs, int j)
+{
+    struct fuzz_dquantum *dq;
+
+    for (dq = fuzz_dedup_table; dq != NULL; dq = dq->next) {
+        if (memcmp(dq->data, qs->data[j], store->quantum_size) == 0) {
+            break;
+        }
+    }
+    if (dq == NULL) {
+        dq = kmalloc(sizeof(*dq) + store->quantum_size, GFP_KERNEL);
+        dq->refs = 0;
+        memcpy(dq->data, qs->data[j], store->quantum_size);
+        dq->next = fuzz_dedup_table;
+        fuzz_dedup_table = dq;
+    }
+    dq->refs++;
+    kfree(qs->data[j]);
+    qs->data[j] = dq->data;
+    __set_bit(j, qs->shared);
+    bchd_stat_inc(store->stats, BCHD_STAT_QUANTUM_FREES);
+}
+
+/* The release callback of the store: drop a reference, and the quantum with the last one */
+static void fuzz_release(struct bchd_store *store, void *quantum)
+{
+    struct fuzz_dquantum *dq = fuzz_dquantum(quantum), **link;
+
+    if (--dq->refs > 0) {
+        return;
+    }
+    for (link = &fuzz_dedup_table; *link != dq; link = &(*link)->next) {
+    }
+    *link = dq->next;
+    kfree(dq);
+}
+
+/*
+ * A pass of the tiering work over store, quantum by quantum like bchd_tier_quantum
+ * (there is no backing file and no swap here). Quanta of the origin of a copy
+ * are skipped, all the others are changed in place, even in list items that
+ * snapshots still share.
+ */
+static void fuzz_tier(struct bchd_store *store, int tiers)
+{
+    struct bchd_qset *qs;
+    int j;
+
+    for (qs = store->data; qs != NULL; qs = qs->next) {
+        for (j = 0; j < store->qset_size; j++) {
+            if (qs->data == NULL || qs->data[j] == NULL) {
+                continue;
+            }
+            if (test_bit(j, qs->accessed)) {
+                __clear_bit(j, qs->accessed);
+                continue;
+            }
+            if (qs->cow != NULL && test_bit(j, qs->cow)) {
+                continue;
+            }
+            if (test_bit(j, qs->shared)) {
+                if (!(tiers & FUZZ_COMPRESS) || fuzz_dquantum(qs->data[j])->refs != 1
+                    || bchd_store_unshare(store, qs, j) == NULL) {
+                    continue;
+                }
+            } else if ((tiers & FUZZ_DEDUP) && !test_bit(j, qs->compressed)) {
+                fuzz_dedup(store, qs, j);
+                __set_bit(j, qs->accessed);
+                continue;
+            }
+            if (!test_bit(j, qs->compressed) && (tiers & FUZZ_COMPRESS)
+                && fuzz_compress(store, qs, j)) {
+                __set_bit(j, qs->accessed);
+            }
+        }
+    }
+}
+
+static void fuzz_reset(struct fuzz_model *m)
+{
+    memset(m->ref, 0, sizeof(m->ref));
+    memset(m->present, 0, sizeof(m->present));
+    m->size = 0;
+}
+
+/*
+ * Besides the store, a run keeps up to FUZZ_SNAPS snapshots of it and a shadow
+ * store (as bchd_snap.c and bchd_replace.c do), each with its own model.
+ * Exchanging the shadow with the store frees the old contents in random steps
+ * with bchd_store_trim_some, while the snapshots may still share them.
+ * Tiering passes change the store, and the list items it shares, in place;
+ * the snapshots decompress and copy what they read through its callbacks.
+ */
+static void fuzz_run(struct fuzz_src *src)
+{
+    static struct fuzz_model live, snap_models[FUZZ_SNAPS], shadow_model;
+    int quantum_size = 1 + fuzz_next(src, 17);
+    int qset_size = 1 + fuzz_next(src, 5);
+    int tiers = fuzz_next(src, 4);
+    struct bchd_stats *stats = alloc_percpu(struct bchd_stats);
+    struct bchd_store store, snaps[FUZZ_SNAPS], shadow;
+    bool have_snap[FUZZ_SNAPS] = { false }, have_shadow = false;
+    char word[20];
+    ssize_t ret;
+    int op, k, log_pos = 0, len;
+
+    fuzz_reset(&live);
+    bchd_store_init(&store, quantum_size, qset_size, stats);
+    if (tiers != 0) {
+        store.track_access = true;
+        if (tiers & FUZZ_COMPRESS) {
+            store.decompress = fuzz_decompress;
+        }
+        if (tiers & FUZZ_DEDUP) {
+            store.release = fuzz_release;
+        }
+    }
+
+    for (op = 0; op < FUZZ_OPS && !fuzz_done(src); op++) {
+        switch (fuzz_next(src, 13)) {
+        case 0: case 1: case 2:     /* write */
+            fuzz_write(src, &store, &live, op);
+            break;
+        case 3: case 4: case 5:     /* read */
+            fuzz_read(src, &store, &live, op);
+            break;
+        case 6:                     /* word */
+            len = 1 + fuzz_next(src, sizeof(word));
+            ret = bchd_store_next_word(&store, &log_pos, word, len);
+            FUZZ_CHECK(ret == -ENODATA || (ret >= 0 && ret < len && word[ret] == '\0'),
+                       "word returned %zd for length %d", ret, len);
+            FUZZ_CHECK(log_pos >= 0 && (unsigned long) log_pos <= live.size + quantum_size,
+                       "word position %d beyond size %lu", log_pos, live.size);
+            break;
+        case 7:                     /* trim, but not too often */
+            if (fuzz_next(src, 8) == 0) {
+                bchd_store_trim(&store);
+                log_pos = 0;
+                fuzz_reset(&live);
+            }
+            break;
+        case 8:                     /* take a snapshot, dropping the one it replaces */
+            k = fuzz_next(src, FUZZ_SNAPS);
+            if (fuzz_next(src, 4) == 0) {
+                if (have_snap[k]) {
+                    bchd_store_trim(&snaps[k]);
+                }
+                bchd_store_snapshot(&store, &snaps[k]);
+                snap_models[k] = live;
+                have_snap[k] = true;
+            }
+            break;
+        case 9:                     /* read a snapshot */
+            k = fuzz_next(src, FUZZ_SNAPS);
+            if (have_snap[k]) {
+                fuzz_read(src, &snaps[k], &snap_models[k], op);
+            }
+            break;
+        case 10:                    /* drop a snapshot */
+            k = fuzz_next(src, FUZZ_SNAPS);
+            if (have_snap[k] && fuzz_next(src, 2) == 0) {
+                bchd_store_trim(&snaps[k]);
+                have_snap[k] = false;
+            }
+            break;
+        case 11:                    /* start a shadow, write to it or exchange it */
+            if (!have_shadow) {
+                bchd_store_shadow(&store, &shadow);
+                fuzz_reset(&shadow_model);
+                have_shadow = true;
+            } else if (fuzz_next(src, 4) > 0) {
+                fuzz_write(src, &shadow, &shadow_model, op);
+            } else {
+                bchd_store_exchange(&store, &shadow);
+                live = shadow_model;
+                log_pos = 0;
+                while (bchd_store_trim_some(&shadow, 1 + fuzz_next(src, 32))) {
+                    /* the snapshots still read what they had meanwhile */
+                    for (k = 0; k < FUZZ_SNAPS; k++) {
+                        if (have_snap[k] && fuzz_next(src, 4) == 0) {
+                            fuzz_read(src, &snaps[k], &snap_models[k], op);
+                        }
+                    }
+                }
+                FUZZ_CHECK(shadow.size == 0 && shadow.data == NULL,
+                           "trimming the old contents left data behind");
+                have_shadow = false;
+            }
+            break;
+        case 12:                    /* a pass of the tiering work */
+            if (tiers != 0) {
+                fuzz_tier(&store, tiers);
+            }
+            break;
+        }
+    }
+
+    /* The snapshots still have what they had when they were taken */
+    for (k = 0; k < FUZZ_SNAPS; k++) {
+        if (have_snap[k]) {
+            fuzz_read(src, &snaps[k], &snap_models[k], op);
+            bchd_store_trim(&snaps[k]);
+        }
+    }
+    if (have_shadow) {
+        bchd_store_trim(&shadow);
+    }
+    bchd_store_trim(&store);
+    FUZZ_CHECK(stats->count[BCHD_STAT_QUANTUM_ALLOCS] == stats->count[BCHD_STAT_QUANTUM_FREES]
+               && stats->count[BCHD_STAT_QSET_ALLOCS] == stats->count[BCHD_STAT_QSET_FREES],
+               "allocations and frees do not match");
+    FUZZ_CHECK(stats->count[BCHD_STAT_COMPRESSIONS] == stats->count[BCHD_STAT_CQUANTUM_FREES],
+               "compressed quanta leak");
+    FUZZ_CHECK(fuzz_dedup_table == NULL, "shared quanta leak");
+    free_percpu(stats);
+}
+
+/* Write count bytes of value c at off and check the amount written */
+static void edge_write(struct bchd_store *store, loff_t off, size_t count, int c)
+{
+    int quantum_size = store->quantum_size, qset_size = store->qset_size, op = off;
+    size_t expect = quantum_size - off % quantum_size;
+    u8 buf[64];
+    ssize_t ret;
+
+    expect = count < expect ? count : expect;
+    memset(buf, c, count);
+    ret = bchd_store_write(store, (char *) buf, count, &off);
+    FUZZ_CHECK(ret == (ssize_t) expect, "edge write returned %zd, expected %zu", ret, expect);
+}
+
+/* Read count bytes at off and check that we get expect bytes of value c */
+static void edge_read(struct bchd_store *store, loff_t off, size_t count, size_t expect, int c)
+{
+    int quantum_size = store->quantum_size, qset_size = store->qset_size, op = off;
+    u8 buf[64];
+    ssize_t ret;
+    size_t i;
+
+    ret = bchd_store_read(store, (char *) buf, count, &off);
+    FUZZ_CHECK(ret == (ssize_t) expect, "edge read returned %zd, expected %zu", ret, expect);
+    for (i = 0; i < expect; i++) {
+        FUZZ_CHECK(buf[i] == c, "edge read got %d at %zu, expected %d", buf[i], i, c);
+    }
+}
+
+/* Fixed cases at the boundaries of quanta and quantum sets */
+static void fuzz_edges(void)
+{
+    static const int geometries[][2] = {
+        { 1, 1 }, { 1, 3 }, { 2, 1 }, { 3, 2 }, { 7, 5 }, { 64, 1 }, { 4000, 1000 },
+    };
+    struct bchd_stats *stats = alloc_percpu(struct bchd_stats);
+    struct bchd_store store;
+    struct bchd_pos pos;
+    size_t g;
+
+    for (g = 0; g < sizeof(geometries) / sizeof(geometries[0]); g++) {
+        int quantum_size = geometries[g][0], qset_size = geometries[g][1], op = 0;
+        loff_t item_size = (loff_t) quantum_size * qset_size;
+        loff_t offs[] = { 0, quantum_size - 1, quantum_size, item_size - 1, item_size,
+                          item_size + quantum_size, 3 * item_size - 1 };
+        size_t i;
+
+        bchd_store_init(&store, quantum_size, qset_size, stats);
+
+        /* Offset decoding */
+        bchd_store_locate(&store, item_size - 1, &pos);
+        FUZZ_CHECK(pos.item == 0 && pos.qset_pos == qset_size - 1 && pos.q_pos == quantum_size - 1,
+                   "locate(item_size - 1)");
+        bchd_store_locate(&store, item_size, &pos);
+        FUZZ_CHECK(pos.item == 1 && pos.qset_pos == 0 && pos.q_pos == 0, "locate(item_size)");
+
+        /* Empty store */
+        edge_read(&store, 0, 1, 0, 0);
+
+        /* Sparse write far away: size grows, everything before is a hole */
+        edge_write(&store, 3 * item_size - 1, 1, 'z');
+        FUZZ_CHECK(store.size == (unsigned long) (3 * item_size), "size after sparse write");
+        edge_read(&store, 0, 1, 0, 0);
+        edge_read(&store, item_size, 1, 0, 0);
+        edge_read(&store, 3 * item_size - 1, 64, 1, 'z');
+        edge_read(&store, 3 * item_size, 1, 0, 0);
+
+        /* Writes and reads at the edges stop at the end of the quantum */
+        for (i = 0; i < sizeof(offs) / sizeof(offs[0]); i++) {
+            size_t left = quantum_size - offs[i] % quantum_size;
+
+            op = i;
+            edge_write(&store, offs[i], 64 < left ? 64 : left, 'a' + i);
+            edge_read(&store, offs[i], 64, 64 < left ? 64 : left, 'a' + i);
+        }
+
+        bchd_store_trim(&store);
+        FUZZ_CHECK(store.size == 0 && store.data == NULL, "trim left data behind");
+        edge_read(&store, 0, 1, 0, 0);
+    }
+    if (stats->count[BCHD_STAT_QUANTUM_ALLOCS] != stats->count[BCHD_STAT_QUANTUM_FREES]) {
+        fprintf(stderr, "bchd_ufuzz: edge cases leak quanta\n");
+        abort();
+    }
+    free_percpu(stats);
+}
+
+/*
+ * Concurrent access: the threads share one store, but each writes and
+ * reads its own region, so it can check the data it reads.
+ */
+struct fuzz_thread {
+    pthread_t tid;
+    struct bchd_store *store;
+    struct mutex *lock;
+    int index;
+    u64 seed;
+};
+
+#define FUZZ_REGION 1000        /* bytes per thread */
+
+static void *fuzz_thread_fn(void *arg)
+{
+    struct fuzz_thread *t = arg;
+    struct fuzz_src src = { .seed = t->seed };
+    int quantum_size = t->store->quantum_size, qset_size = t->store->qset_size;
+    u8 ref[FUZZ_REGION], buf[64];
+    loff_t base = (loff_t) t->index * FUZZ_REGION, pos;
+    ssize_t ret;
+    size_t count, i;
+    int op;
+
+    /* Fill the region first, so it has no holes */
+    for (pos = base; pos < base + FUZZ_REGION; ) {
+        for (i = 0; i < sizeof(buf); i++) {
+            buf[i] = t->index;
+        }
+        count = base + FUZZ_REGION - pos < (loff_t) sizeof(buf) ? base + FUZZ_REGION - pos : sizeof(buf);
+        mutex_lock(t->lock);
+        ret = bchd_store_write(t->store, (char *) buf, count, &pos);
+        mutex_unlock(t->lock);
+        if (ret <= 0) {
+            abort();
+        }
+    }
+    memset(ref, t->index, sizeof(ref));
+
+    for (op = 0; op < FUZZ_OPS * 10; op++) {
+        pos = base + fuzz_next(&src, FUZZ_REGION);
+        count = 1 + fuzz_next(&src, base + FUZZ_REGION - pos < 64 ? base + FUZZ_REGION - pos : 64);
+        if (fuzz_next(&src, 2)) {
+            for (i = 0; i < count; i++) {
+                buf[i] = fuzz_next(&src, 256);
+            }
+            mutex_lock(t->lock);
+            ret = bchd_store_write(t->store, (char *) buf, count, &pos);
+            mutex_unlock(t->lock);
+            FUZZ_CHECK(ret > 0, "concurrent write returned %zd", ret);
+            memcpy(ref + (pos - ret - base), buf, ret);
+        } else {
+            mutex_lock(t->lock);
+            ret = bchd_store_read(t->store, (char *) buf, count, &pos);
+            mutex_unlock(t->lock);
+            FUZZ_CHECK(ret > 0, "concurrent read returned %zd", ret);
+            FUZZ_CHECK(memcmp(buf, ref + (pos - ret - base), ret) == 0,
+                       "thread %d read data of another thread", t->index);
+        }
+    }
+    return NULL;
+}
+
+static void fuzz_threads(int nr_threads, u64 seed)
+{
+    struct bchd_stats *stats = alloc_percpu(struct bchd_stats);
+    struct fuzz_thread *t = calloc(nr_threads, sizeof(*t));
+    struct bchd_store store;
+    struct mutex lock;
+    int i;
+
+    /* A small geometry, so the threads share quanta and list items */
+    bchd_store_init(&store, 13, 3, stats);
+    mutex_init(&lock);
+    for (i = 0; i < nr_threads; i++) {
+        t[i].store = &store;
+        t[i].lock = &lock;
+        t[i].index = i;
+        t[i].seed = seed + i;
+        pthread_create(&t[i].tid, NULL, fuzz_thread_fn, &t[i]);
+    }
+    for (i = 0; i < nr_threads; i++) {
+        pthread_join(t[i].tid, NULL);
+    }
+    bchd_store_trim(&store);
+    free(t);
+    free_percpu(stats);
+}
+
+#ifdef BCHD_LIBFUZZER
+
+int LLVMFuzzerTestOneInput(const u8 *data, size_t len)
+{
+    struct fuzz_src src = { .data = data, .len = len };
+
+    fuzz_run(&src);
+    return 0;
+}
+
+#else
+
+int main(int argc, char **argv)
+{
+    struct fuzz_src src = { .seed = 1 };
+    long runs = 1000, r;
+    int opt, edges = 0, threads = 0;
+
+    while ((opt = getopt(argc, argv, "s:n:et:")) != -1) {
+        switch (opt) {
+        case 's':
+            src.seed = strtoull(optarg, NULL, 0);
+            break;
+        case 'n':
+            runs = atol(optarg);
+            break;
+        case 'e':
+            edges = 1;
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-s seed] [-n runs] [-e] [-t threads]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (src.seed == 0) {
+        src.seed = 1;   /* xorshift would stay at 0 */
+    }
+
+    if (edges) {
+        fuzz_edges();
+        printf("bchd_ufuzz: edge cases passed\n");
+    }
+    if (threads > 0) {
+        fuzz_threads(threads, src.seed);
+        printf("bchd_ufuzz: %d threads passed\n", threads);
+    }
+    for (r = 0; r < runs; r++) {
+        fuzz_run(&src);
+    }
+    printf("bchd_ufuzz: %ld runs passed\n", runs);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,122 @@
+/*
+ * bchd_user.h -- userspace stand-ins for the kernel interfaces the storage engine uses
+ *
+ * With BCHD_USERSPACE defined, bchd_storage.c compiles into an ordinary
+ * userspace library (libbchd.a, see the Makefile), so the storage engine
+ * can be run under perf, valgrind and the sanitizers without loading the module.
+ *  -- kmalloc/kfree map to malloc/free,
+ *  -- copy_{to,from}_user are plain memcpy (there is only one address space),
+ *  -- per-CPU data has a single instance, updated atomically since
+ *     several threads may share it,
+ *  -- mutexes are pthread mutexes,
+ *  -- the non-atomic bit operations are plain C.
+ */
+
+#ifndef _BCHD_USER_H_
+#define _BCHD_USER_H_
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE             /* loff_t */
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+
+typedef uint8_t u8;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int64_t s64;
+
+#define __user
+#define __percpu
+
+#define GFP_KERNEL 0
+#define kmalloc(size, flags) malloc(size)
+#define kzalloc(size, flags) calloc(1, size)
+#define kfree(ptr) free(ptr)
+
+static inline unsigned long copy_to_user(void __user *to, const void *from, unsigned long n)
+{
+    memcpy(to, from, n);
+    return 0;
+}
+
+static inline unsigned long copy_from_user(void *to, const void __user *from, unsigned long n)
+{
+    memcpy(to, from, n);
+    return 0;
+}
+
+/* Per-CPU data: one "CPU" */
+#define alloc_percpu(type) ((type *) calloc(1, sizeof(type)))
+#define free_percpu(ptr) free(ptr)
+#define per_cpu_ptr(ptr, cpu) ((void) (cpu), (ptr))
+#define raw_cpu_ptr(ptr) (ptr)
+#define for_each_possible_cpu(cpu) for ((cpu) = 0; (cpu) < 1; (cpu)++)
+#define this_cpu_add(var, val) __atomic_fetch_add(&(var), (val), __ATOMIC_RELAXED)
+#define this_cpu_inc(var) this_cpu_add(var, 1)
+
+static inline u64 ktime_get_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#define BITS_PER_LONG (8 * sizeof(long))
+#define BITS_TO_LONGS(n) (((n) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+
+static inline void __set_bit(long nr, unsigned long *addr)
+{
+    addr[nr / BITS_PER_LONG] |= 1UL << (nr % BITS_PER_LONG);
+}
+
+static inline void __clear_bit(long nr, unsigned long *addr)
+{
+    addr[nr / BITS_PER_LONG] &= ~(1UL << (nr % BITS_PER_LONG));
+}
+
+static inline int test_bit(long nr, const unsigned long *addr)
+{
+    return (addr[nr / BITS_PER_LONG] >> (nr % BITS_PER_LONG)) & 1;
+}
+
+static inline int fls64(u64 x)
+{
+    return x ? 64 - __builtin_clzll(x) : 0;
+}
+
+struct mutex {
+    pthread_mutex_t m;
+};
+
+static inline void mutex_init(struct mutex *lock)
+{
+    pthread_mutex_init(&lock->m, NULL);
+}
+
+static inline void mutex_lock(struct mutex *lock)
+{
+    pthread_mutex_lock(&lock->m);
+}
+
+/* There are no signals to interrupt us */
+static inline int mutex_lock_interruptible(struct mutex *lock)
+{
+    pthread_mutex_lock(&lock->m);
+    return 0;
+}
+
+static inline void mutex_unlock(struct mutex *lock)
+{
+    pthread_mutex_unlock(&lock->m);
+}
+
+#endif /* _BCHD_USER_H_ */